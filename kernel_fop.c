@@ -8,14 +8,45 @@
  * 
  */
 
+#include <linux/version.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <asm/segment.h>
 #include <asm/uaccess.h>
 #include <linux/buffer_head.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
 #include "kernel_fop.h"
 
-#define MAXFILEOP 10
+#define MAXFILEOP 256 //every stripe of every partition of every drive
 static struct file* file_struct[MAXFILEOP] = {NULL};
+static const struct kernel_file_ops* file_ops[MAXFILEOP] = {NULL};//set instead of file_struct
+static void* file_priv[MAXFILEOP] = {NULL};
+static DEFINE_MUTEX(file_struct_lock);
+
+#define FILE_OPS(fd) ((fd) >= 0 && (fd) < MAXFILEOP && file_ops[fd])
+
+/*
+  Asynchronous requests run on kfop_wq. Submissions are spread over the
+  per-cpu threads so several requests really are in flight at once.
+*/
+static struct workqueue_struct* kfop_wq = NULL;
+static atomic_t kfop_next_cpu = ATOMIC_INIT(0);
+
+struct kfop_req {
+    struct work_struct work;
+    int fd;
+    int rw;
+    void* buf;
+    size_t count;
+    loff_t offset;
+    kernel_file_done_t done;
+    void* priv;
+};
 
 static struct file* file_open(const char* path, int flags, int rights) 
 {
@@ -62,26 +93,101 @@ static int file_write(struct file* file, unsigned long long offset, unsigned cha
     return ret;
 }
 
+static int file_truncate(struct file* file, loff_t length)
+{
+    struct dentry* dentry = file->f_path.dentry;
+    struct iattr newattrs;
+    int ret = 0;
+
+    newattrs.ia_size = length;
+    newattrs.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME | ATTR_FILE;
+    newattrs.ia_file = file;
+    mutex_lock(&dentry->d_inode->i_mutex);
+    ret = notify_change(dentry, &newattrs);
+    mutex_unlock(&dentry->d_inode->i_mutex);
+    return ret;
+}
+
+//fallocate is an inode operation up to 2.6.37.
+static int file_fallocate(struct file* file, int mode, loff_t offset, loff_t len)
+{
+    struct inode* inode = file->f_path.dentry->d_inode;
+    if (NULL == inode->i_op->fallocate) {
+        return -EOPNOTSUPP;
+    }
+    return inode->i_op->fallocate(inode, mode, offset, len);
+}
+
+static int file_sync(struct file* file)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+    return vfs_fsync(file, 0);
+#else
+    return vfs_fsync(file, file->f_path.dentry, 0);
+#endif
+}
+
 static void file_close(struct file* file) 
 {
     filp_close(file, NULL);
 }
 
+//a free slot for fp or ops, -1 if there is none.
+static int file_slot(struct file* fp, const struct kernel_file_ops* ops, void* priv)
+{
+    int fd = 0;
+
+    mutex_lock(&file_struct_lock);
+    for (fd = 0; fd < MAXFILEOP; fd++) {
+        if (NULL == file_struct[fd] && NULL == file_ops[fd]) {
+            file_struct[fd] = fp;
+            file_ops[fd] = ops;
+            file_priv[fd] = priv;
+            break;
+        }
+    }
+    mutex_unlock(&file_struct_lock);
+    return MAXFILEOP == fd ? -1 : fd;
+}
+
 int kernel_file_open(const char* path, int flags)
 {
+    int fd = 0;
     struct file* fp_ptr = file_open(path, flags, 0777);
-    if (NULL != file_struct[0]) {
-        printk("file_struct[0] is not NULL");
+    if (NULL == fp_ptr) {
+        printk("\nkernel_file_open %s failed\n", path);
         return -1;
     }
-    file_struct[0] = fp_ptr;
-    return 0;
+
+    fd = file_slot(fp_ptr, NULL, NULL);
+    if (-1 == fd) {
+        printk("\nkernel_file_open %s: no free slot\n", path);
+        file_close(fp_ptr);
+        return -1;
+    }
+    return fd;
+}
+
+/** 
+ * A descriptor whose requests go to ops; ops->close is called by
+ * kernel_file_close.
+ *
+ * @return the descriptor, -1 if there is no free slot.
+ */
+int kernel_file_open_ops(const struct kernel_file_ops* ops, void* priv)
+{
+    int fd = file_slot(NULL, ops, priv);
+
+    if (-1 == fd) {
+        printk("\nkernel_file_open_ops: no free slot\n");
+    }
+    return fd;
 }
 
 int kernel_file_read(int fd, void* buf, size_t count)
 {
     int ret = 0;
-    if (NULL == file_struct[fd]) {
+    if (fd < 0 || NULL == file_struct[fd]) {
         return -1;
     }
     ret = file_read(file_struct[fd], file_struct[fd]->f_pos, (unsigned char*)buf, count);
@@ -92,7 +198,7 @@ int kernel_file_read(int fd, void* buf, size_t count)
 int kernel_file_write(int fd, void* buf, size_t count)
 {
     int ret = 0;
-    if (NULL == file_struct[fd]) {
+    if (fd < 0 || NULL == file_struct[fd]) {
         return -1;
     }
     ret = file_write(file_struct[fd], file_struct[fd]->f_pos, (unsigned char*)buf, count);
@@ -100,9 +206,247 @@ int kernel_file_write(int fd, void* buf, size_t count)
     return ret;
 }
 
+int kernel_file_pread(int fd, void* buf, size_t count, loff_t offset)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->io(file_priv[fd], KERNEL_FILE_READ, buf, count, offset);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return file_read(file_struct[fd], offset, (unsigned char*)buf, count);
+}
+
+int kernel_file_pwrite(int fd, void* buf, size_t count, loff_t offset)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->io(file_priv[fd], KERNEL_FILE_WRITE, buf, count, offset);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return file_write(file_struct[fd], offset, (unsigned char*)buf, count);
+}
+
+int kernel_file_truncate(int fd, loff_t length)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->io(file_priv[fd], KERNEL_FILE_TRUNCATE, NULL, 0, length);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return file_truncate(file_struct[fd], length);
+}
+
+/** 
+ * Deallocate [offset, offset + len) without changing the file size.
+ * FALLOC_FL_PUNCH_HOLE came with 2.6.38, so a plain file can't have holes
+ * punched here; a descriptor served by code passes it on.
+ *
+ * @return 0, or -EOPNOTSUPP.
+ */
+int kernel_file_punch(int fd, loff_t offset, loff_t len)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->io(file_priv[fd], KERNEL_FILE_PUNCH, NULL, len, offset);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return -EOPNOTSUPP;
+}
+
+/** 
+ * Allocate [offset, offset + len) without changing the file size, so the
+ * extents exist before the data arrives.
+ *
+ * @return 0, or -EOPNOTSUPP if the filesystem can't preallocate.
+ */
+int kernel_file_prealloc(int fd, loff_t offset, loff_t len)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->io(file_priv[fd], KERNEL_FILE_PREALLOC, NULL, len, offset);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return file_fallocate(file_struct[fd], FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+/*
+  Wait until a descriptor served by code can take a write of count bytes
+  at offset, e.g. while its stage is full. The submitter calls this before
+  kernel_file_submit, so the shared I/O workers never sleep on it.
+*/
+void kernel_file_throttle(int fd, size_t count, loff_t offset)
+{
+    if (FILE_OPS(fd) && file_ops[fd]->throttle) {
+        file_ops[fd]->throttle(file_priv[fd], count, offset);
+    }
+}
+
+//1 if both descriptors are the same file.
+int kernel_file_same(int fd1, int fd2)
+{
+    if (FILE_OPS(fd1) || FILE_OPS(fd2)) {
+        return fd1 == fd2;
+    }
+    if (fd1 < 0 || NULL == file_struct[fd1] || fd2 < 0 || NULL == file_struct[fd2]) {
+        return 0;
+    }
+    return file_struct[fd1]->f_path.dentry->d_inode == file_struct[fd2]->f_path.dentry->d_inode;
+}
+
+loff_t kernel_file_size(int fd)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->size(file_priv[fd]);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return i_size_read(file_struct[fd]->f_path.dentry->d_inode);
+}
+
+//data and size on stable storage.
+int kernel_file_sync(int fd)
+{
+    if (FILE_OPS(fd)) {
+        return file_ops[fd]->sync(file_priv[fd]);
+    }
+    if (fd < 0 || NULL == file_struct[fd]) {
+        return -1;
+    }
+    return file_sync(file_struct[fd]);
+}
+
+/** 
+ * Read straight into the pages of a scatterlist, no buffer in between.
+ * Pages are mapped one at a time while the read sleeps on them.
+ *
+ * @return bytes read, or the first error.
+ */
+int kernel_file_pread_sg(int fd, struct kernel_file_sg* sg, size_t count, loff_t offset)
+{
+    struct sg_mapping_iter miter;
+    size_t skip = sg->skip;
+    size_t done = 0;
+    int ret = 0;
+
+    if (NULL == sg->sgl) {
+        return 0;
+    }
+    sg_miter_start(&miter, sg->sgl, sg->nents, SG_MITER_TO_SG);
+    while (done < count && sg_miter_next(&miter)) {
+        size_t n = 0;
+
+        if (skip >= miter.length) {
+            skip -= miter.length;
+            continue;
+        }
+        n = min_t(size_t, miter.length - skip, count - done);
+        ret = kernel_file_pread(fd, miter.addr + skip, n, offset + done);
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+        if (ret != (int)n) {
+            break;
+        }
+        skip = 0;
+    }
+    sg_miter_stop(&miter);
+    return done || ret >= 0 ? (int)done : ret;
+}
+
+static void kfop_req_handler(struct work_struct* work)
+{
+    struct kfop_req* req = container_of(work, struct kfop_req, work);
+    int ret = 0;
+
+    switch (req->rw) {
+    case KERNEL_FILE_WRITE:
+        ret = kernel_file_pwrite(req->fd, req->buf, req->count, req->offset);
+        break;
+    case KERNEL_FILE_TRUNCATE:
+        ret = kernel_file_truncate(req->fd, req->offset);
+        break;
+    case KERNEL_FILE_PUNCH:
+        ret = kernel_file_punch(req->fd, req->offset, req->count);
+        break;
+    case KERNEL_FILE_PREALLOC:
+        ret = kernel_file_prealloc(req->fd, req->offset, req->count);
+        break;
+    case KERNEL_FILE_READ_SG:
+        ret = kernel_file_pread_sg(req->fd, req->buf, req->count, req->offset);
+        break;
+    default:
+        ret = kernel_file_pread(req->fd, req->buf, req->count, req->offset);
+        break;
+    }
+    req->done(req->priv, ret);
+    kfree(req);
+}
+
+/** 
+ * Queue a positional read or write and return at once. done() is called
+ * from the I/O thread with the vfs return value; buf must stay valid until
+ * then. Requests may complete in any order.
+ * KERNEL_FILE_TRUNCATE cuts the file at offset, KERNEL_FILE_PUNCH frees
+ * and KERNEL_FILE_PREALLOC allocates count bytes at offset; buf is unused
+ * for all three. KERNEL_FILE_READ_SG reads into the pages buf, a struct
+ * kernel_file_sg, describes.
+ *
+ * @return 0 if queued, -1 otherwise (done() is not called).
+ */
+int kernel_file_submit(int fd, int rw, void* buf, size_t count, loff_t offset,
+                       kernel_file_done_t done, void* priv)
+{
+    struct kfop_req* req = NULL;
+    int cpu = 0;
+
+    if (fd < 0 || (NULL == file_struct[fd] && !FILE_OPS(fd)) || NULL == kfop_wq) {
+        return -1;
+    }
+    req = (struct kfop_req*)kmalloc(sizeof(struct kfop_req), GFP_KERNEL);
+    if (NULL == req) {
+        return -1;
+    }
+    req->fd = fd;
+    req->rw = rw;
+    req->buf = buf;
+    req->count = count;
+    req->offset = offset;
+    req->done = done;
+    req->priv = priv;
+    INIT_WORK(&req->work, kfop_req_handler);
+
+    cpu = (unsigned int)atomic_inc_return(&kfop_next_cpu) % nr_cpu_ids;
+    if (!cpu_online(cpu)) {
+        cpu = cpumask_any(cpu_online_mask);
+    }
+    queue_work_on(cpu, kfop_wq, &req->work);
+    return 0;
+}
+
+int kernel_fop_init(void)
+{
+    kfop_wq = create_workqueue("kvtape_io");
+    return kfop_wq ? 0 : -ENOMEM;
+}
+
+void kernel_fop_exit(void)
+{
+    if (kfop_wq) {
+        destroy_workqueue(kfop_wq);
+        kfop_wq = NULL;
+    }
+}
+
 off_t kernel_file_seek(int fd, off_t offset, int whence)
 {
-    if (NULL == file_struct[fd]) {
+    if (fd < 0 || NULL == file_struct[fd]) {
         return -1;
     }
 
@@ -122,8 +466,19 @@ off_t kernel_file_seek(int fd, off_t offset, int whence)
 
 void kernel_file_close(int fd)
 {
-   if (NULL == file_struct[fd]) {
+   if (FILE_OPS(fd)) {
+       file_ops[fd]->close(file_priv[fd]);
+       mutex_lock(&file_struct_lock);
+       file_ops[fd] = NULL;
+       file_priv[fd] = NULL;
+       mutex_unlock(&file_struct_lock);
+       return;
+   }
+   if (fd < 0 || NULL == file_struct[fd]) {
        return;
    }
    file_close(file_struct[fd]);
+   mutex_lock(&file_struct_lock);
+   file_struct[fd] = NULL;
+   mutex_unlock(&file_struct_lock);
 }
@@ -16,4 +16,55 @@ int kernel_file_write(int fd, void* buf, size_t count);
 off_t kernel_file_seek(int fd, off_t offset, int whence);
 void kernel_file_close(int fd);
 
+//positional I/O, f_pos is left alone.
+int kernel_file_pread(int fd, void* buf, size_t count, loff_t offset);
+int kernel_file_pwrite(int fd, void* buf, size_t count, loff_t offset);
+
+int kernel_file_truncate(int fd, loff_t length);
+int kernel_file_punch(int fd, loff_t offset, loff_t len);
+int kernel_file_prealloc(int fd, loff_t offset, loff_t len);
+int kernel_file_same(int fd1, int fd2);
+loff_t kernel_file_size(int fd);
+int kernel_file_sync(int fd);
+void kernel_file_throttle(int fd, size_t count, loff_t offset);
+
+#define KERNEL_FILE_READ     0
+#define KERNEL_FILE_WRITE    1
+#define KERNEL_FILE_TRUNCATE 2
+#define KERNEL_FILE_PUNCH    3
+#define KERNEL_FILE_PREALLOC 4
+#define KERNEL_FILE_READ_SG  5
+
+//pages a KERNEL_FILE_READ_SG reads into: nents entries from sgl, skip bytes into the first.
+struct scatterlist;
+struct kernel_file_sg {
+    struct scatterlist* sgl;
+    unsigned int nents;
+    size_t skip;
+};
+int kernel_file_pread_sg(int fd, struct kernel_file_sg* sg, size_t count, loff_t offset);
+
+typedef void (*kernel_file_done_t)(void* priv, int ret);
+int kernel_file_submit(int fd, int rw, void* buf, size_t count, loff_t offset,
+                       kernel_file_done_t done, void* priv);
+
+/*
+  A descriptor served by code instead of a file, e.g. an image kept on two
+  devices. io() takes the KERNEL_FILE_* requests with the positional
+  arguments of kernel_file_submit (TRUNCATE's length in offset) and returns
+  what the plain call would. Only positional calls are supported.
+*/
+struct kernel_file_ops {
+    int (*io)(void* priv, int rw, void* buf, size_t count, loff_t offset);
+    loff_t (*size)(void* priv);
+    int (*sync)(void* priv);
+    void (*close)(void* priv);
+    //wait until a write of count bytes at offset can be taken; optional.
+    void (*throttle)(void* priv, size_t count, loff_t offset);
+};
+int kernel_file_open_ops(const struct kernel_file_ops* ops, void* priv);
+
+int kernel_fop_init(void);
+void kernel_fop_exit(void);
+
 #endif
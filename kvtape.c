@@ -19,7 +19,20 @@
 #include <linux/kernel.h>
 #include <linux/workqueue.h>
 #include <linux/scatterlist.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
 #include "kernel_fop.h"
+#include "kvtape.h"
+#include "kvtape_user.h"
+#include "kvtape_clone.h"
+#include "kvtape_tier.h"
+#include "kvtape_sg.h"
+#include "kvtape_mirror.h"
 
 /*If not define following macros, "Unknown symbol driver_register" similar errors appears. */
 #ifdef MODULE
@@ -34,30 +47,135 @@ MODULE_LICENSE("GPL");
 
 #define MAX_COMMANDS_PER_LUN 16
 #define MAX_LUNS  8
-#define MAX_IOV_SLOTS 8
-#define MAX_SECTORS_PER_CMD  128
 #define MAX_TARGET_IDS	8
 #define MAX_LUNS  8
-#define MAX_CDB_LEN 12
+#define MAX_CDB_LEN 16 //LOCATE(16)
+#define MAX_BLOCK_LEN 0x400000//READ BLOCK LIMITS
+#define MAX_SECTORS_PER_CMD (MAX_BLOCK_LEN >> 9)//a whole block in one command
+#define MAX_DRIVES (MAX_TARGET_IDS - 1)//drive n is target n + 1
+#define MAX_IO_PER_CMD (2 * KVTAPE_MAX_STRIPES)//records of a READ queued at once, or a truncate per stripe
+#define KVTAPE_ASYNC 1//handler return: command completes from I/O callback
+/*
+  DRIVER_SENSE on its own ends up in the status byte, where it reads as
+  BUSY. Sense data goes with CHECK CONDITION.
+*/
+#define CHECK_CONDITION_RESULT ((DRIVER_SENSE << 24) | SAM_STAT_CHECK_CONDITION)
+#define BLANK_CHECK 0x08
+#define VOLUME_OVERFLOW 0x0D
+#define MEDIUM_ERROR 0x03
+#define NOT_READY 0x02
+#define ILLEGAL_REQUEST 0x05
+#define DATA_PROTECT 0x07
 
 //static struct device scsi_dev;
 static struct Scsi_Host *shost;
-static int vdisk_fd = -1;
-static int cur_record_no = 0;
+static struct dentry* kvtape_debugfs = NULL;
+static struct kvtape_drive tape_drives[MAX_DRIVES];
+
+static char* images[MAX_DRIVES] = {"/home/vdisk.dat"};
+static int num_drives = 1;
+module_param_array(images, charp, &num_drives, S_IRUGO);
+MODULE_PARM_DESC(images, "Comma separated backing image per drive, stripes of one drive separated by ':' (default /home/vdisk.dat)");
+
+static unsigned int prealloc_mb = 256;
+module_param(prealloc_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(prealloc_mb, "Preallocate the image this many MB ahead of the write pointer, 0 to disable");
+
+static unsigned int capacity_mb = 0;
+module_param(capacity_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity_mb, "Cartridge capacity in MB, 0 for unlimited");
+
+static unsigned int early_warning_mb = 64;
+module_param(early_warning_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(early_warning_mb, "Report early warning EOM this many MB before capacity");
+
+static unsigned int user_backend = 0;
+module_param(user_backend, uint, S_IRUGO);
+MODULE_PARM_DESC(user_backend, "Hand commands to a daemon through /dev/kvtape_ringN instead of emulating them here");
+
+static unsigned int catalog = 0;
+module_param(catalog, uint, S_IRUGO);
+MODULE_PARM_DESC(catalog, "Note tar members written to a drive in <image>.cat");
+
+static unsigned int container_kb = 0;
+module_param(container_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(container_kb, "Pack records of blank images into containers of this many KB, 0 for the stream format");
+
+static char* dedup_store = NULL;
+module_param(dedup_store, charp, S_IRUGO);
+MODULE_PARM_DESC(dedup_store, "Chunk store shared by all drives; records of stream images are deduplicated into it");
+
+static char* stage_dir = NULL;
+module_param(stage_dir, charp, S_IRUGO);
+MODULE_PARM_DESC(stage_dir, "Directory on a fast device where writes are staged before they migrate to the images");
+
+static unsigned int stage_segment_mb = 64;
+module_param(stage_segment_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(stage_segment_mb, "Migrate staged data to the images in segments of this many MB");
+
+static unsigned int stage_high_mb = 1024;
+module_param(stage_high_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(stage_high_mb, "Writes wait for the migration while an image has this many MB staged");
+
+static char* mirrors[MAX_DRIVES];
+static int num_mirrors = 0;
+module_param_array(mirrors, charp, &num_mirrors, S_IRUGO);
+MODULE_PARM_DESC(mirrors, "Comma separated mirror image per drive, written behind the image; stripes separated by ':' like images");
+
+static unsigned int mirror_lag_mb = 256;
+module_param(mirror_lag_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(mirror_lag_mb, "Writes wait while a mirror trails its image by this many MB");
+
+static unsigned int mirror_sync = 0;
+module_param(mirror_sync, uint, S_IRUGO);
+MODULE_PARM_DESC(mirror_sync, "WRITE FILEMARKS without IMMED completes once the mirrors have caught up");
 
 #define DEBUG_PRINT 1
 
-enum _filemark {
-    NOT_MARK,
-    FILEMARK,
-    SETMARK,
-    DATAMARK
+struct my_work;
+
+//an encrypted record of a READ, decrypted once it has been read.
+struct kvtape_sealed {
+    struct kvtape_sealed* next;
+    char* buf;//IV, ciphertext, tag
+    uint32_t len;
+    uint32_t blkno;
+    size_t skip;//where the plain record goes in the READ's data
+    int copy;//bytes of it the READ asked for
 };
 
-typedef struct {
+//one backing file range of a READ or WRITE.
+struct kvtape_io {
+    struct my_work* owner;
+    int fd;
+    int rw;
+    char* buf;
+    size_t len;
+    loff_t offset;
+    struct kernel_file_sg sg;//buf points here for KERNEL_FILE_READ_SG
+};
+
+typedef struct my_work {
     struct work_struct work;
     struct scsi_cmnd* cmnd;
     void (*done)(struct scsi_cmnd*);
+    struct kvtape_drive* drive;
+    int posted;//done() called, cmnd belongs to the mid level again
+    ktime_t start;//queued time, for the trace ring
+    uint32_t position;//block position when the command started
+    char* iobuf;//bounce buffer of a READ/WRITE, not needed by plain READs
+    int iolen;
+    __u64 charged;//bytes of iobuf and sealed buffers charged to drive->mem
+    int nr_io;
+    struct kvtape_io io[MAX_IO_PER_CMD];
+    atomic_t pending;//outstanding kvtape_io + 1 for the submitter
+    struct kvtape_sealed* sealed;//encrypted records of a READ
+    atomic_t opening;//records being decrypted + 1
+    int crypt_err;
+    int immed;//status posted before the I/O was issued
+    struct work_struct crypt_work;//goes on after encryption or decryption
+    s64 done_at;//ns ktime the drive would be done at, 0 for now
+    struct delayed_work delay_work;//posts it then
 } my_work_t;
 
 //data returned by request sense command.
@@ -152,30 +270,23 @@ static void fill_inquriy_response(char* buf)
     memcpy(buf, inquiry_response.data, 0x24);
 }
 
-//scatterlist must be chained.
-struct scatterlist* sg_next(struct scatterlist* sg)
+static inline struct kvtape_drive* cmnd_to_drive(struct scsi_cmnd* cmnd)
+{
+    return (struct kvtape_drive*)cmnd->device->hostdata;
+}
+
+//fixed mode block size; without a MODE SELECT it has always been 32KB here.
+static inline uint32_t fixed_blksize(struct kvtape_drive* drive)
 {
-    return sg + 1;
+    return drive->blksize ? drive->blksize : 0x8000;
 }
 
 static void do_inquiry(struct scsi_cmnd *cmnd)
 {    
-    char* va = NULL;
-    if (scsi_sg_count(cmnd)) {
-        struct scatterlist* sg = NULL;
-	int i = 0;
-	scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {
-	    va = kmap(sg_page(sg)) + sg->offset;
-            printk("\nscatter list buf[%d], len:%d", i, sg->length);
-            if (sg->length >= 0x24) {
-                fill_inquriy_response(va);
-            }
-            kunmap(sg_page(sg));
-            break;
-	}       
-    } else {        
-		printk("\nkvtape error %s: sg_count is 0\n",__func__);
-    }
+    char buf[0x24];
+
+    fill_inquriy_response(buf);
+    kvtape_sg_reply(cmnd, buf, min(0x24, (int)cmnd->cmnd[4]));
 }
 
 static void gen_get_filemark_sense(struct scsi_cmnd *cmnd, char* sense_buf, int remain)
@@ -197,7 +308,7 @@ static void gen_get_filemark_sense(struct scsi_cmnd *cmnd, char* sense_buf, int
         tranfer_len += (unsigned int)cmnd->cmnd[3] << 8;
         tranfer_len += (unsigned int)cmnd->cmnd[4];
         if (cmnd->cmnd[1] & 0x01) {
-            tranfer_len -= remain/0x8000;//lu[req->lun].sector_size;
+            tranfer_len -= remain/fixed_blksize(cmnd_to_drive(cmnd));
         } else {
             tranfer_len -= remain;
         }
@@ -242,7 +353,7 @@ static void gen_get_setmark_sense(struct scsi_cmnd *cmnd, char* sense_buf, int r
         tranfer_len += (unsigned int)cmnd->cmnd[3] << 8;
         tranfer_len += (unsigned int)cmnd->cmnd[4];
         if (cmnd->cmnd[1] & 0x01) {
-            tranfer_len -= remain/0x8000;//lu[req->lun].sector_size;
+            tranfer_len -= remain/fixed_blksize(cmnd_to_drive(cmnd));
         } else {
             tranfer_len -= remain;
         }
@@ -266,133 +377,475 @@ static void gen_get_setmark_sense(struct scsi_cmnd *cmnd, char* sense_buf, int r
     memcpy(sense_buf, sense_invalide_opcode.data, sizeof(sense_invalide_opcode.data));
 }
 
-static void do_test_unit_ready(struct scsi_cmnd *cmnd)
+//fixed format sense with CHECK CONDITION status.
+static void gen_check_sense(struct scsi_cmnd *cmnd, uint8_t key, uint8_t asc, uint8_t ascq, uint32_t info)
 {
-    //do nothing.
+    union sense_data sense;
+    memset(sense.data, 0, sizeof(union sense_data));
+    sense.bits.byte0 = 0xF0;//current error code.
+    sense.bits.sense_key = key;
+    sense.bits.info[0] = (info >> 24) & 0xFF;
+    sense.bits.info[1] = (info >> 16) & 0xFF;
+    sense.bits.info[2] = (info >> 8) & 0xFF;
+    sense.bits.info[3] = info & 0xFF;
+    sense.bits.additional_sense_len = sizeof(sense.data) - 8;
+    sense.bits.asense_key = asc;
+    sense.bits.asense_key_q = ascq;
+    memcpy(cmnd->sense_buffer, sense.data, sizeof(sense.data));
+    cmnd->result = CHECK_CONDITION_RESULT;
 }
 
-static void do_rewind(struct scsi_cmnd *cmnd)
+//BLANK CHECK, end-of-data detected.
+static void gen_eod_sense(struct scsi_cmnd *cmnd, uint32_t remain)
 {
-    kernel_file_seek(vdisk_fd, 0, SEEK_SET);
+    gen_check_sense(cmnd, BLANK_CHECK, 0x00, 0x05, remain);
 }
 
+//EOM set, end-of-partition/medium detected.
+static void gen_eom_sense(struct scsi_cmnd *cmnd, uint8_t key, uint32_t info)
+{
+    gen_check_sense(cmnd, key, 0x00, 0x02, info);
+    cmnd->sense_buffer[2] |= 0x40;
+}
 
-static void do_erase(struct scsi_cmnd *cmnd)
+/*
+  Capacity of partition part in bytes, 0 for unlimited. Partitions without
+  a size of their own share what the others leave of capacity_mb.
+*/
+static loff_t part_size(struct kvtape_drive* drive, int part)
 {
-    //do nothing.
+    struct kvtape_layout* layout = &drive->layout;
+    uint32_t fixed = 0;
+    int shared = 0;
+    int i = 0;
+
+    if (layout->size_mb[part] || 0 == capacity_mb) {
+        return (loff_t)layout->size_mb[part] << 20;
+    }
+    for (i = 0; i < layout->nr_parts; i++) {
+        fixed += layout->size_mb[i];
+        shared += (0 == layout->size_mb[i]);
+    }
+    if (fixed >= capacity_mb) {
+        return 1;//nothing left for it
+    }
+    return ((loff_t)(capacity_mb - fixed) << 20) / shared;
 }
 
-static void do_mode_select6(struct scsi_cmnd *cmnd)
-{   
-    char* buf = NULL;
-    printk("\ndo_mode_select6, use_sg:%d\n\n",scsi_sg_count(cmnd));
+static loff_t part_capacity(struct kvtape_drive* drive)
+{
+    return part_size(drive, drive->part);
+}
 
-    if (scsi_sg_count(cmnd)) {
-        struct scatterlist* sg = NULL;
-	int i = 0;
-	scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {
-	    buf = kmap(sg_page(sg)) + sg->offset;           
-            if (buf[3] == 8) {
-                uint32_t blk_size = buf[9];
-                blk_size = (blk_size<<8) + buf[10];
-                blk_size = (blk_size<<8) + buf[11];
-                printk("\ntape mode select set block size:%d\n", blk_size);
-            }
-            kunmap(sg_page(sg));
-            break;
-	}       
+//where the head is on the cartridge in bytes, partitions laid end to end.
+static loff_t tape_position(struct kvtape_drive* drive)
+{
+    loff_t pos = 0;
+    int i = 0;
+
+    for (i = 0; i < drive->part; i++) {
+        pos += part_size(drive, i);
+    }
+    return pos + kvtape_index_offset(&drive->index, drive->cur_record_no) * drive->nr_stripes;
+}
+
+/*
+  Check a write that would end the image at end against the partition's
+  capacity. return -1 if it does not fit (VOLUME OVERFLOW), 0 otherwise;
+  a write ending in the early warning zone still happens but reports EOM.
+*/
+static int check_capacity(struct scsi_cmnd *cmnd, loff_t end, uint32_t info)
+{
+    loff_t capacity = part_capacity(cmnd_to_drive(cmnd));
+    loff_t early_warning = (loff_t)early_warning_mb << 20;
+
+    if (0 == capacity) {
+        return 0;
+    }
+    if (end > capacity) {
+        gen_eom_sense(cmnd, VOLUME_OVERFLOW, info);
+        return -1;
+    }
+    if (end > capacity - early_warning) {
+        gen_eom_sense(cmnd, 0x00, 0);
+    }
+    return 0;
+}
+
+//trade the medium fields of the drive for those of a parked partition.
+static void part_swap(struct kvtape_drive* drive, struct kvtape_part* part)
+{
+    int i = 0;
+
+    swap(drive->fd, part->fd);
+    swap(drive->nr_stripes, part->nr_stripes);
+    for (i = 0; i < KVTAPE_MAX_STRIPES; i++) {
+        swap(drive->stripes[i], part->stripes[i]);
+    }
+    swap(drive->cur_record_no, part->cur_record_no);
+    swap(drive->index, part->index);
+    swap(drive->pack, part->pack);
+    swap(drive->catalog, part->catalog);
+    swap(drive->trunc_pending, part->trunc_pending);
+}
+
+/*
+  Mount partition n. The one mounted is parked with its position, so a
+  switch costs the same whatever the partitions hold. What is still on
+  its way to the old partition's image gets there first.
+*/
+static void kvtape_part_switch(struct kvtape_drive* drive, int n)
+{
+    if (n == drive->part) {
+        return;
+    }
+    kvtape_drive_drain(drive);
+    if (drive->pack.size) {
+        kvtape_pack_flush(drive);
+    }
+    kvtape_catalog_flush(&drive->catalog);
+    part_swap(drive, &drive->parts[drive->part]);
+    part_swap(drive, &drive->parts[n]);
+    drive->part = n;
+}
+
+//the memory governor wants the read caches back; runs on cmd_wq.
+static void kvtape_cache_drop(struct work_struct* work)
+{
+    struct kvtape_drive* drive = container_of(work, struct kvtape_drive, mem_work);
+    int i = 0;
+
+    kvtape_pack_drop(drive);
+    for (i = 0; i < drive->layout.nr_parts; i++) {
+        if (i != drive->part) {
+            part_swap(drive, &drive->parts[i]);
+            kvtape_pack_drop(drive);
+            part_swap(drive, &drive->parts[i]);
+        }
+    }
+}
+
+static void kvtape_cache_reclaim(struct kvtape_mem* mem)
+{
+    struct kvtape_drive* drive = container_of(mem, struct kvtape_drive, mem);
+
+    queue_work(drive->cmd_wq, &drive->mem_work);
+}
+
+/*
+  Record buffers run past the 4MB block limit; those the page allocator
+  can't be relied on for are vmalloc'ed.
+*/
+static void* kvtape_buf_alloc(size_t len)
+{
+    if (len <= (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)) {
+        return kmalloc(len, GFP_KERNEL);
+    }
+    return vmalloc(len);
+}
+
+static void kvtape_buf_free(void* buf)
+{
+    if (is_vmalloc_addr(buf)) {
+        vfree(buf);
     } else {
-		printk("\nkvtape error %s: sg_count is 0\n",__func__);
-    }    
+        kfree(buf);
+    }
 }
 
-//read next record length.
-static int do_read_recordlen(void)
+/*
+  I/O buffer of len bytes for my_work, charged to the drive's memory
+  budget; waits while the drive is over its share.
+*/
+static void* kvtape_io_alloc(my_work_t* my_work, size_t len)
 {
-    int len = 0;
-    int ret = kernel_file_read(vdisk_fd, &len, 4);
-    if (4 == ret) {
-        return len;
+    void* buf = NULL;
+
+    kvtape_mem_charge(&my_work->drive->mem, KVTAPE_MEM_IO, len);
+    buf = kvtape_buf_alloc(len);
+    if (NULL == buf) {
+        kvtape_mem_uncharge(&my_work->drive->mem, KVTAPE_MEM_IO, len);
+        return NULL;
+    }
+    my_work->charged += len;
+    return buf;
+}
+
+/*
+  Whether the last IMMED command is still at work, and how far it got in
+  65536ths: its backing file ranges done, or the time the drive modelled
+  takes for it gone by.
+*/
+static int kvtape_busy(struct kvtape_drive* drive, uint16_t* progress)
+{
+    s64 now = ktime_to_ns(ktime_get());
+    int left = atomic_read(&drive->bg_left);
+
+    if (left > 0 && drive->bg_total > 0) {
+        *progress = (drive->bg_total - left) * 65536 / drive->bg_total;
+        return 1;
+    }
+    if (now < drive->busy_end) {
+        *progress = div64_u64((u64)(now - drive->busy_start) << 16, drive->busy_end - drive->busy_start);
+        return 1;
+    }
+    return 0;
+}
+
+//NOT READY, operation in progress, with the progress indication.
+static void fill_progress_sense(union sense_data* sense, uint16_t progress)
+{
+    memset(sense->data, 0, sizeof(union sense_data));
+    sense->bits.byte0 = 0xF0;//current error code.
+    sense->bits.sense_key = NOT_READY;
+    sense->bits.additional_sense_len = sizeof(sense->data) - 8;
+    sense->bits.asense_key = 0x04;
+    sense->bits.asense_key_q = 0x07;
+    sense->bits.sense_key_spec[0] = 0x80;//SKSV
+    sense->bits.sense_key_spec[1] = progress >> 8;
+    sense->bits.sense_key_spec[2] = progress & 0xFF;
+}
+
+static void do_test_unit_ready(struct scsi_cmnd *cmnd)
+{
+    union sense_data sense;
+    uint16_t progress = 0;
+
+    if (kvtape_busy(cmnd_to_drive(cmnd), &progress)) {
+        fill_progress_sense(&sense, progress);
+        memcpy(cmnd->sense_buffer, sense.data, sizeof(sense.data));
+        cmnd->result = CHECK_CONDITION_RESULT;
+    }
+}
+
+/*
+  Sense is always returned with the status, so there is nothing pending
+  here; REQUEST SENSE only tells whether an IMMED command is still at work.
+*/
+static void do_request_sense(struct scsi_cmnd* cmnd)
+{
+    union sense_data sense;
+    uint16_t progress = 0;
+
+    if (kvtape_busy(cmnd_to_drive(cmnd), &progress)) {
+        fill_progress_sense(&sense, progress);
     } else {
+        memset(sense.data, 0, sizeof(union sense_data));
+        sense.bits.byte0 = 0xF0;
+        sense.bits.additional_sense_len = sizeof(sense.data) - 8;
+    }
+    kvtape_sg_reply(cmnd, sense.data, min((int)sizeof(sense.data), (int)cmnd->cmnd[4]));
+}
+
+//to the beginning of partition 0.
+static void do_rewind(struct scsi_cmnd *cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+
+    kvtape_part_switch(drive, 0);
+    drive->cur_record_no = 0;
+}
+
+/*
+  LOAD UNLOAD. There is no cartridge to take out, the medium stays mounted;
+  both ways leave it at the beginning of partition 0, like a rewind.
+*/
+static void do_load_unload(struct scsi_cmnd *cmnd)
+{
+    do_rewind(cmnd);
+}
+
+/*
+  Medium partition mode page. The layout takes effect with the next FORMAT
+  MEDIUM (POFM), like on LTO drives. FDP asks for the drive's own two
+  partitions, SDP for a number of them sharing the cartridge, IDP gives
+  the sizes too.
+*/
+static int mode_select_partition(struct scsi_cmnd* cmnd, const uint8_t* page, int len)
+{
+    struct kvtape_layout layout;
+    uint8_t psum = (page[4] >> 3) & 0x03;
+    uint8_t units = page[6] & 0x0F;
+    uint32_t fixed = 0;
+    int i = 0;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.nr_parts = (page[4] & 0x80) ? 2 : page[3] + 1;
+    if (len < 8 || layout.nr_parts > KVTAPE_MAX_PARTS || (3 == psum && units > 12)) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x26, 0x00, 0);//invalid field in parameter list
         return -1;
     }
+    for (i = 0; (page[4] & 0x20) && i < layout.nr_parts && 9 + 2 * i < len; i++) {
+        uint64_t size = ((uint32_t)page[8 + 2 * i] << 8) | page[9 + 2 * i];
+        int u = units;
+
+        if (0xFFFF == size) {
+            continue;//what is left
+        }
+        switch (psum) {
+        case 0://bytes
+            size = (size + (1 << 20) - 1) >> 20;
+            break;
+        case 1://KB
+            size = (size + 1023) >> 10;
+            break;
+        case 3://10^units bytes
+            while (u--) {
+                size *= 10;
+            }
+            size = (size + (1 << 20) - 1) >> 20;
+            break;
+        }
+        layout.size_mb[i] = size;
+    }
+    //the partitions without a size need at least a MB each.
+    for (i = 0; i < layout.nr_parts; i++) {
+        fixed += layout.size_mb[i] ? layout.size_mb[i] : 1;
+    }
+    if (capacity_mb && fixed > capacity_mb) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x26, 0x00, 0);
+        return -1;
+    }
+    cmnd_to_drive(cmnd)->mode_layout = layout;
+    return 0;
 }
 
+static void do_mode_select6(struct scsi_cmnd *cmnd)
+{
+    uint8_t buf[64];
+    int len = cmnd->cmnd[4];
+    int off = 0;
+    printk("\ndo_mode_select6, use_sg:%d\n\n",scsi_sg_count(cmnd));
+
+    if (0 == scsi_sg_count(cmnd)) {
+        printk("\nkvtape error %s: sg_count is 0\n",__func__);
+        return;
+    }
+    if (len > scsi_bufflen(cmnd)) {
+        len = scsi_bufflen(cmnd);
+    }
+    if (len > sizeof(buf)) {
+        len = sizeof(buf);
+    }
+    memset(buf, 0, sizeof(buf));
+    kvtape_sg_fetch(cmnd, buf, len);
+    if (buf[3] == 8) {
+        uint32_t blk_size = buf[9];
+        blk_size = (blk_size<<8) + buf[10];
+        blk_size = (blk_size<<8) + buf[11];
+        printk("\ntape mode select set block size:%d\n", blk_size);
+        if (blk_size > MAX_BLOCK_LEN) {
+            gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x26, 0x00, 0);//invalid field in parameter list
+            return;
+        }
+        cmnd_to_drive(cmnd)->blksize = blk_size;
+    }
+    //mode pages follow the block descriptors.
+    for (off = 4 + buf[3]; off + 2 <= len; off += 2 + buf[off + 1]) {
+        if (0x11 == (buf[off] & 0x3F) && mode_select_partition(cmnd, buf + off, len - off) < 0) {
+            return;
+        }
+    }
+}
 
 static void  do_space_blocks(struct scsi_cmnd* cmnd, uint32_t space_cnt)
 {	
-    int32_t record_len = 0;
-	uint8_t tape_mark = 0;
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
     int request_data_len = space_cnt;
     while (request_data_len > 0) {
-        record_len = do_read_recordlen();
-		if (record_len < 0) {//check end of partition
-			//gen_endpartition_sense(req);
-			return;
-		}else if (0 == record_len) {//check end of data
-			//gen_enddata_sense(req);
-			return;
-		} else if (1 == record_len) {//check tape mark
-            kernel_file_read(vdisk_fd, &record_len, 1);            
-            if (FILEMARK == tape_mark) {
-                gen_get_filemark_sense(cmnd, cmnd->sense_buffer, request_data_len);                
-                return;
-            } else if (SETMARK == tape_mark) {                
-                gen_get_setmark_sense(cmnd, cmnd->sense_buffer, request_data_len);
-                return;
-            } else {// 1 byte record is strange.
-                request_data_len--;
-                continue;
-            }
+        struct kvtape_rec* rec = kvtape_index_get(&drive->index, drive->cur_record_no);
+        if (NULL == rec) {//check end of data
+            gen_eod_sense(cmnd, request_data_len);
+            return;
+        }
+        drive->cur_record_no++;
+        if (FILEMARK == rec->type) {
+            gen_get_filemark_sense(cmnd, cmnd->sense_buffer, request_data_len);
+            cmnd->result = CHECK_CONDITION_RESULT;
+            return;
+        } else if (SETMARK == rec->type) {
+            gen_get_setmark_sense(cmnd, cmnd->sense_buffer, request_data_len);
+            cmnd->result = CHECK_CONDITION_RESULT;
+            return;
         }
-		//normal record.
-        kernel_file_seek(vdisk_fd, record_len, SEEK_CUR);            
         request_data_len--;
     } 
 }
 
 static void  do_space_filemark(struct scsi_cmnd* cmnd, uint32_t space_cnt)
 {
-    int32_t record_len = 0;
-    uint8_t tape_mark = 0;
-
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
 	int request_data_len = space_cnt;
     while (request_data_len > 0) {
-        record_len = do_read_recordlen();
-		if (record_len < 0) {
-			//gen_endpartition_sense(req);
-            printk("\ntape recordlen < 0, should gen_endpartition_sense\n");
-			return;
-		}else if (0 == record_len) {
-			//gen_enddata_sense(req);
-            printk("\ntape recordlen == 0, should gen_enddata_sense\n");
-			return;
-		}
-		
-        if (record_len > 1) {
-            kernel_file_seek(vdisk_fd, record_len, SEEK_CUR);            
-        } else {//check setmark
-            kernel_file_read(vdisk_fd, &tape_mark, 1);
-            if (FILEMARK == tape_mark) {
-                request_data_len--;
-            } else if (SETMARK == tape_mark) {
-                printk("\nSCSI_TAPE get setmark when space filemark\n");
-                //gen_get_setmark_sense(req);
-				return;
-            } else {//1 byte regular record.
-                kernel_file_seek(vdisk_fd, record_len, SEEK_CUR);            
-            }
+        struct kvtape_rec* rec = kvtape_index_get(&drive->index, drive->cur_record_no);
+        if (NULL == rec) {
+            gen_eod_sense(cmnd, request_data_len);
+            return;
+        }
+        drive->cur_record_no++;
+        if (FILEMARK == rec->type) {
+            request_data_len--;
+        } else if (SETMARK == rec->type) {
+            printk("\nSCSI_TAPE get setmark when space filemark\n");
+            gen_get_setmark_sense(cmnd, cmnd->sense_buffer, request_data_len);
+            cmnd->result = CHECK_CONDITION_RESULT;
+            return;
+        }
+    }
+}
+
+/*
+  Space toward the beginning over count blocks, or count filemarks. A
+  filemark met while spacing blocks, or the last one spaced over, leaves
+  the tape on its beginning side.
+*/
+static void do_space_back(struct scsi_cmnd* cmnd, uint32_t count, int marks)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+
+    while (count > 0) {
+        struct kvtape_rec* rec = NULL;
+
+        if (0 == drive->cur_record_no) {
+            gen_eom_sense(cmnd, NO_SENSE, count);
+            cmnd->sense_buffer[13] = 0x04;//beginning-of-partition/medium detected
+            return;
+        }
+        rec = kvtape_index_get(&drive->index, --drive->cur_record_no);
+        if (SETMARK == rec->type) {
+            gen_check_sense(cmnd, NO_SENSE, 0x00, 0x03, count);//setmark detected
+            cmnd->sense_buffer[2] |= 0x80;
+            return;
+        }
+        if (FILEMARK == rec->type && !marks) {
+            gen_check_sense(cmnd, NO_SENSE, 0x00, 0x01, count);//filemark detected
+            cmnd->sense_buffer[2] |= 0x80;
+            return;
+        }
+        if (FILEMARK == rec->type || !marks) {
+            count--;
         }
     }
 }
 
 static void do_space(struct scsi_cmnd* cmnd)
 {
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
     uint8_t space_type = cmnd->cmnd[1] & 0x07;
     uint32_t space_cnt = (uint32_t)cmnd->cmnd[2] << 16;
     space_cnt += (uint32_t)cmnd->cmnd[3] << 8;
     space_cnt += (uint32_t)cmnd->cmnd[4];
 
+    //the count is 24 bit two's complement, negative toward the beginning.
+    if (space_cnt & 0x800000) {
+        if (space_type > 1) {
+            gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);//invalid field in cdb
+            return;
+        }
+        do_space_back(cmnd, 0x1000000 - space_cnt, space_type);
+        return;
+    }
+
     switch (space_type) {
     case 0://space blocks
         do_space_blocks(cmnd, space_cnt);
@@ -402,102 +855,912 @@ static void do_space(struct scsi_cmnd* cmnd)
         do_space_filemark(cmnd, space_cnt);
         break;
 
+    case 3://end of data
+        drive->cur_record_no = drive->index.count;
+        break;
+
     default:
         printk("\nSCSI_TAPE not supported space type:%d\n", space_type);
         break;
     }
 }
 
-static void do_read_position(struct scsi_cmnd* cmnd)
+/*
+  LOCATE(10) and LOCATE(16) to a logical block, in another partition if CP
+  is set. Past EOD the drive stops at EOD with BLANK CHECK. IMMED makes no
+  difference here.
+*/
+static void do_locate(struct scsi_cmnd* cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+    uint64_t blkno = 0;
+    int part = 0;
+    int i = 0;
+
+    if (0x92 == cmnd->cmnd[0]) {
+        //logical objects are the only destination type there is here.
+        if (cmnd->cmnd[1] & 0x38) {
+            gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);//invalid field in cdb
+            return;
+        }
+        for (i = 4; i < 12; i++) {
+            blkno = (blkno << 8) | cmnd->cmnd[i];
+        }
+        part = cmnd->cmnd[3];
+    } else {
+        blkno = ((uint32_t)cmnd->cmnd[3] << 24) | ((uint32_t)cmnd->cmnd[4] << 16) |
+            ((uint32_t)cmnd->cmnd[5] << 8) | cmnd->cmnd[6];
+        part = cmnd->cmnd[8];
+    }
+    if (cmnd->cmnd[1] & 0x02) {
+        if (part >= drive->layout.nr_parts) {
+            gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);
+            return;
+        }
+        kvtape_part_switch(drive, part);
+    }
+
+    if (blkno > drive->index.count) {
+        drive->cur_record_no = drive->index.count;
+        gen_eod_sense(cmnd, 0);
+        return;
+    }
+    drive->cur_record_no = blkno;
+}
+
+/*
+  SECURITY PROTOCOL OUT with the tape data encryption protocol (0x20) and
+  the Set Data Encryption page: encryption and decryption modes and the
+  AES key. As on a real drive the key only lives in the drive's memory.
+*/
+static void do_security_protocol_out(struct scsi_cmnd* cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+    uint16_t sps = ((uint16_t)cmnd->cmnd[2] << 8) | cmnd->cmnd[3];
+    uint32_t len = ((uint32_t)cmnd->cmnd[6] << 24) | ((uint32_t)cmnd->cmnd[7] << 16) |
+        ((uint32_t)cmnd->cmnd[8] << 8) | cmnd->cmnd[9];
+    uint8_t page[64];
+    uint8_t enc = 0;
+    uint8_t dec = 0;
+    uint16_t key_len = 0;
+
+    if (0x20 != cmnd->cmnd[1] || 0x0010 != sps || (cmnd->cmnd[4] & 0x80)) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);//invalid field in cdb
+        return;
+    }
+    if (len > scsi_bufflen(cmnd)) {
+        len = scsi_bufflen(cmnd);
+    }
+    if (len < 20) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x1A, 0x00, 0);//parameter list length error
+        return;
+    }
+    memset(page, 0, sizeof(page));
+    kvtape_sg_fetch(cmnd, page, len < sizeof(page) ? len : sizeof(page));
+    enc = page[6];
+    dec = page[7];
+    key_len = ((uint16_t)page[18] << 8) | page[19];
+
+    //external mode, raw reads, wrapped keys and packed images are not supported.
+    if ((KVTAPE_ENCRYPT_DISABLE != enc && KVTAPE_ENCRYPT_ENCRYPT != enc) ||
+        (KVTAPE_DECRYPT_DISABLE != dec && KVTAPE_DECRYPT_DECRYPT != dec && KVTAPE_DECRYPT_MIXED != dec) ||
+        0 != page[9] || (enc && drive->pack.size) ||
+        ((enc || dec) && (20 + key_len > len || 20 + key_len > sizeof(page)))) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x26, 0x00, 0);//invalid field in parameter list
+        goto out;
+    }
+    if (KVTAPE_ENCRYPT_DISABLE == enc && KVTAPE_DECRYPT_DISABLE == dec) {
+        kvtape_crypt_clear(&drive->crypt);
+    } else if (kvtape_crypt_set_key(&drive->crypt, page + 20, key_len) < 0) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x26, 0x00, 0);
+        goto out;
+    }
+    drive->crypt.encrypt = enc;
+    drive->crypt.decrypt = dec;
+
+ out:
+    memset(page, 0, sizeof(page));
+}
+
+/*
+  READ POSITION, short form (service actions 0 and 1, both in blocks
+  here): the partition and the logical block the drive is at. Nothing is
+  ever held in a buffer.
+*/
+static void do_read_position(struct scsi_cmnd* cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+    uint32_t pos = drive->cur_record_no;
+    uint8_t databuf[20];
+    int len = sizeof(databuf);
+
+    if ((cmnd->cmnd[1] & 0x1F) > 1) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);
+        return;
+    }
+    memset(databuf, 0, sizeof(databuf));
+    databuf[0] = 0 == pos ? 0x80 : 0x00;//BOP
+    databuf[1] = drive->part;
+    databuf[4] = databuf[8] = (pos >> 24) & 0xFF;//first and last block location
+    databuf[5] = databuf[9] = (pos >> 16) & 0xFF;
+    databuf[6] = databuf[10] = (pos >> 8) & 0xFF;
+    databuf[7] = databuf[11] = pos & 0xFF;
+    kvtape_sg_reply(cmnd, databuf, len);
+}
+
+//send the status; cmnd must not be touched afterwards.
+static void kvtape_cmd_post(my_work_t* my_work)
+{
+    struct scsi_cmnd* cmnd = my_work->cmnd;
+
+    if (my_work->posted) {
+        return;
+    }
+    my_work->posted = 1;
+    kvtape_trace_cmd(&my_work->drive->trace, cmnd, my_work->start, my_work->position);
+    my_work->done(cmnd);
+}
+
+static void kvtape_cmd_delayed(struct work_struct* work);
+
+static void kvtape_cmd_complete(my_work_t* my_work)
+{
+    struct kvtape_drive* drive = my_work->drive;
+    s64 wait = my_work->done_at - ktime_to_ns(ktime_get());
+
+    //the drive modelled would still be at it, the status waits.
+    if (my_work->done_at && wait > 0 && !my_work->posted) {
+        kvtape_timing_delayed(&drive->timing, wait);
+        kvtape_drive_io_get(drive);
+        INIT_DELAYED_WORK(&my_work->delay_work, kvtape_cmd_delayed);
+        schedule_delayed_work(&my_work->delay_work, usecs_to_jiffies(div_u64(wait, NSEC_PER_USEC)));
+        return;
+    }
+    kvtape_cmd_post(my_work);
+    while (my_work->sealed) {
+        struct kvtape_sealed* sealed = my_work->sealed;
+        my_work->sealed = sealed->next;
+        kvtape_buf_free(sealed->buf);
+        kfree(sealed);
+    }
+    kvtape_buf_free(my_work->iobuf);
+    if (my_work->charged) {
+        kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_IO, my_work->charged);
+    }
+    kfree((void *)my_work);
+}
+
+static void kvtape_cmd_delayed(struct work_struct* work)
+{
+    my_work_t* my_work = container_of(work, my_work_t, delay_work.work);
+    struct kvtape_drive* drive = my_work->drive;
+
+    my_work->done_at = 0;
+    kvtape_cmd_complete(my_work);
+    kvtape_drive_io_put(drive);
+}
+
+//a READ's encrypted records are plain now, or failed to authenticate.
+static void kvtape_read_opened(struct work_struct* work)
+{
+    my_work_t* my_work = container_of(work, my_work_t, crypt_work);
+    struct kvtape_drive* drive = my_work->drive;
+    struct kvtape_sealed* sealed = NULL;
+
+    if (my_work->crypt_err) {
+        gen_check_sense(my_work->cmnd, DATA_PROTECT, 0x74, 0x04, 0);//integrity validation failed
+    } else {
+        for (sealed = my_work->sealed; sealed; sealed = sealed->next) {
+            kvtape_sg_copy(my_work->cmnd, sealed->buf + KVTAPE_CRYPT_IV, sealed->copy, sealed->skip, 1);
+        }
+    }
+    kvtape_cmd_complete(my_work);
+    kvtape_drive_io_put(drive);
+}
+
+static void kvtape_read_open_put(my_work_t* my_work)
+{
+    if (atomic_dec_and_test(&my_work->opening)) {
+        INIT_WORK(&my_work->crypt_work, kvtape_read_opened);
+        schedule_work(&my_work->crypt_work);
+    }
+}
+
+static void kvtape_read_open_done(void* priv, int err)
+{
+    my_work_t* my_work = (my_work_t*)priv;
+
+    if (err) {
+        my_work->crypt_err = err;
+    }
+    kvtape_read_open_put(my_work);
+}
+
+//drop one reference; the last one posts the SCSI result.
+static void kvtape_io_put(my_work_t* my_work)
+{
+    struct kvtape_drive* drive = my_work->drive;
+
+    if (!atomic_dec_and_test(&my_work->pending)) {
+        return;
+    }
+    //decrypt what was read; the drive's I/O reference goes with the command.
+    if (my_work->sealed && !my_work->posted && host_byte(my_work->cmnd->result) == DID_OK) {
+        struct kvtape_sealed* sealed = NULL;
+
+        atomic_set(&my_work->opening, 1);
+        for (sealed = my_work->sealed; sealed; sealed = sealed->next) {
+            atomic_inc(&my_work->opening);
+            kvtape_crypt_open(&drive->crypt, sealed->buf, sealed->len, sealed->blkno,
+                              kvtape_read_open_done, my_work);
+        }
+        kvtape_read_open_put(my_work);
+        return;
+    }
+    kvtape_cmd_complete(my_work);
+    kvtape_drive_io_put(drive);
+}
+
+static void kvtape_io_done(void* priv, int ret)
+{
+    struct kvtape_io* io = (struct kvtape_io*)priv;
+    int expect = 0;
+
+    if (io->owner->immed) {
+        atomic_dec(&io->owner->drive->bg_left);
+    }
+    if (KERNEL_FILE_READ == io->rw || KERNEL_FILE_WRITE == io->rw || KERNEL_FILE_READ_SG == io->rw) {
+        expect = io->len;
+    } else if (-EOPNOTSUPP == ret) {//no hole punching here, truncate still frees
+        ret = 0;
+    }
+    if (ret != expect) {
+        printk("\nkvtape error %s: op %d returned %d/%d at %lld\n", __func__,
+               io->rw, ret, expect, (long long)io->offset);
+        if (!io->owner->posted) {
+            io->owner->cmnd->result = DID_ERROR << 16;
+        }
+    }
+    kvtape_io_put(io->owner);
+}
+
+static int kvtape_io_sync(struct kvtape_io* io)
+{
+    switch (io->rw) {
+    case KERNEL_FILE_WRITE:
+        return kernel_file_pwrite(io->fd, io->buf, io->len, io->offset);
+    case KERNEL_FILE_TRUNCATE:
+        return kernel_file_truncate(io->fd, io->offset);
+    case KERNEL_FILE_PUNCH:
+        return kernel_file_punch(io->fd, io->offset, io->len);
+    case KERNEL_FILE_READ_SG:
+        return kernel_file_pread_sg(io->fd, (struct kernel_file_sg*)io->buf, io->len, io->offset);
+    default:
+        return kernel_file_pread(io->fd, io->buf, io->len, io->offset);
+    }
+}
+
+/*
+  Remember one backing file range of the command. Ranges beyond
+  MAX_IO_PER_CMD are rare (fixed mode with tiny records) and done inline.
+  For KERNEL_FILE_READ_SG buf is a struct kernel_file_sg, kept in the io.
+*/
+static void queue_io(my_work_t* my_work, int fd, int rw, char* buf, size_t len, loff_t offset)
+{
+    struct kvtape_io* io = NULL;
+
+    //here on the command thread, not on the I/O workers every drive shares.
+    if (KERNEL_FILE_WRITE == rw) {
+        kernel_file_throttle(fd, len, offset);
+    }
+    if (my_work->nr_io < MAX_IO_PER_CMD) {
+        io = &my_work->io[my_work->nr_io++];
+        io->owner = my_work;
+        io->fd = fd;
+        io->rw = rw;
+        io->buf = buf;
+        io->len = len;
+        io->offset = offset;
+        if (KERNEL_FILE_READ_SG == rw) {
+            io->sg = *(struct kernel_file_sg*)buf;
+            io->buf = (char*)&io->sg;
+        }
+        return;
+    }
+
+    {
+        struct kvtape_io inline_io = {my_work, fd, rw, buf, len, offset};
+        int ret = kvtape_io_sync(&inline_io);
+        if ((KERNEL_FILE_READ == rw || KERNEL_FILE_WRITE == rw || KERNEL_FILE_READ_SG == rw) &&
+            ret != (int)len) {
+            my_work->cmnd->result = DID_ERROR << 16;
+        }
+    }
+}
+
+/*
+  Issue every queued range; the command completes when the last one does.
+  With immed the status goes out now and the ranges finish in the
+  background, still counted in inflight so the next command waits.
+*/
+static void submit_io(my_work_t* my_work, int immed)
+{
+    struct kvtape_drive* drive = my_work->drive;
+    int i = 0;
+
+    atomic_set(&my_work->pending, my_work->nr_io + 1);
+    kvtape_drive_io_get(drive);
+    if (immed) {
+        my_work->immed = 1;
+        drive->bg_total = atomic_read(&drive->bg_left) + my_work->nr_io;
+        atomic_add(my_work->nr_io, &drive->bg_left);
+        kvtape_cmd_post(my_work);
+    }
+    for (i = 0; i < my_work->nr_io; i++) {
+        struct kvtape_io* io = &my_work->io[i];
+        if (kernel_file_submit(io->fd, io->rw, io->buf, io->len, io->offset, kvtape_io_done, io) < 0) {
+            kvtape_io_done(io, kvtape_io_sync(io));
+        }
+    }
+    kvtape_io_put(my_work);
+}
+
+//where the next block of a stripe goes, i.e. its size up to EOD.
+static loff_t stripe_eod(struct kvtape_drive* drive, int stripe)
+{
+    if (drive->pack.size) {
+        return kvtape_pack_end(drive);
+    }
+    return kvtape_index_stripe_end(&drive->index, stripe);
+}
+
+//bytes written up to EOD, over all stripes.
+static loff_t kvtape_drive_used(struct kvtape_drive* drive)
+{
+    loff_t used = 0;
+    int i = 0;
+
+    if (drive->pack.size) {
+        return kvtape_index_offset(&drive->index, drive->index.count);
+    }
+    for (i = 0; i < drive->nr_stripes; i++) {
+        used += stripe_eod(drive, i);
+    }
+    return used;
+}
+
+//drop the records behind EOD from the image.
+static void kvtape_drive_truncate(struct kvtape_drive* drive)
+{
+    int i = 0;
+
+    if (drive->pack.size) {
+        //the open container on disk must not reference cut records.
+        kvtape_pack_flush(drive);
+    }
+    for (i = 0; i < drive->nr_stripes; i++) {
+        struct kvtape_stripe* stripe = &drive->stripes[i];
+        loff_t eod = stripe_eod(drive, i);
+        int ret = kernel_file_truncate(stripe->fd, eod);
+        if (ret) {
+            printk("\nkvtape drive%d stripe %d truncate at %lld failed %d\n",
+                   drive->id, i, (long long)eod, ret);
+        }
+        //truncate also drops the preallocated extents.
+        stripe->alloc_end = eod;
+    }
+    drive->trunc_pending = 0;
+}
+
+static void kvtape_prealloc_done(void* priv, int ret)
+{
+    struct kvtape_stripe* stripe = (struct kvtape_stripe*)priv;
+    struct kvtape_drive* drive = stripe->drive;
+
+    if (0 == ret) {
+        stripe->alloc_end = stripe->prealloc_to;
+    } else {
+        printk("\nkvtape drive%d preallocation stopped, fallocate returned %d\n", drive->id, ret);
+        drive->prealloc_step = 0;
+    }
+    smp_wmb();
+    stripe->prealloc_busy = 0;
+    kvtape_drive_io_put(drive);
+}
+
+/*
+  Keep allocated extents at least half a step ahead of the write pointer,
+  so appends never allocate blocks themselves and the image is laid out in
+  large contiguous pieces. The fallocate runs on the I/O threads.
+*/
+static void kvtape_prealloc(struct kvtape_drive* drive, int i, loff_t end)
+{
+    struct kvtape_stripe* stripe = &drive->stripes[i];
+    //the partition's capacity is shared evenly by the stripes.
+    loff_t capacity = part_capacity(drive) / drive->nr_stripes;
+    loff_t len = drive->prealloc_step;
+
+    if (0 == len || stripe->prealloc_busy) {
+        return;
+    }
+    smp_rmb();
+    if (end + len / 2 <= stripe->alloc_end) {
+        return;
+    }
+    if (end > stripe->alloc_end) {
+        stripe->alloc_end = end;
+    }
+    if (capacity && stripe->alloc_end + len > capacity) {
+        len = capacity - stripe->alloc_end;
+        if (len <= 0) {
+            return;
+        }
+    }
+
+    stripe->prealloc_busy = 1;
+    stripe->prealloc_to = stripe->alloc_end + len;
+    kvtape_drive_io_get(drive);
+    if (kernel_file_submit(stripe->fd, KERNEL_FILE_PREALLOC, NULL, len, stripe->alloc_end,
+                           kvtape_prealloc_done, stripe) < 0) {
+        kvtape_prealloc_done(stripe, kernel_file_prealloc(stripe->fd, stripe->alloc_end, len));
+    }
+}
+
+//stripe k of a ':' separated list of paths, NULL if there is none.
+static char* path_stripe(const char* paths, int k)
+{
+    const char* p = paths;
+
+    while (p && k--) {
+        p = strchr(p, ':');
+        p = p ? p + 1 : NULL;
+    }
+    return p && *p ? kstrndup(p, strcspn(p, ":"), GFP_KERNEL) : NULL;
+}
+
+/*
+  The mirror of stripe k, at path: stripe k of the drive's mirror with
+  what path adds to stripe k of the drive's image, e.g. ".p1" for
+  partition 1. NULL if the drive has no mirror for it.
+*/
+static char* mirror_path(struct kvtape_drive* drive, const char* path, int k)
+{
+    char* image = NULL;
+    char* mirror = NULL;
+    char* ret = NULL;
+
+    if (drive->id >= num_mirrors || NULL == mirrors[drive->id]) {
+        return NULL;
+    }
+    image = path_stripe(images[drive->id], k);
+    mirror = path_stripe(mirrors[drive->id], k);
+    if (image && mirror && 0 == strncmp(path, image, strlen(image))) {
+        ret = kasprintf(GFP_KERNEL, "%s%s", mirror, path + strlen(image));
+    }
+    kfree(image);
+    kfree(mirror);
+    return ret;
+}
+
+static int kvtape_drive_open(struct kvtape_drive* drive, const char* path)
+{
+    char* paths = kstrdup(path, GFP_KERNEL);
+    char* cur = paths;
+    char* p = NULL;
+    int ret = 0;
+
+    if (NULL == paths) {
+        return -ENOMEM;
+    }
+    while (NULL != (p = strsep(&cur, ":"))) {
+        struct kvtape_stripe* stripe = NULL;
+
+        if (KVTAPE_MAX_STRIPES == drive->nr_stripes) {
+            printk("\nkvtape drive%d more than %d stripes, %s ignored\n", drive->id, KVTAPE_MAX_STRIPES, p);
+            continue;
+        }
+        stripe = &drive->stripes[drive->nr_stripes];
+        stripe->drive = drive;
+        if (stage_dir) {
+            stripe->fd = kvtape_tier_open(p, stage_dir, (loff_t)stage_segment_mb << 20,
+                                          (loff_t)stage_high_mb << 20);
+        } else {
+            stripe->fd = kernel_file_open(p, O_RDWR|O_CREAT);
+        }
+        printk("\nkernel_file_open %s, fd:%d\n", p, stripe->fd);
+        if (-1 == stripe->fd) {
+            ret = -ENOENT;
+        } else {
+            char* mirror = mirror_path(drive, p, drive->nr_stripes);
+            int fd = mirror ? kvtape_mirror_open(stripe->fd, mirror, (loff_t)mirror_lag_mb << 20,
+                                                  &drive->mem) : -1;
+
+            //without its mirror the image is still served.
+            if (fd >= 0) {
+                stripe->fd = fd;
+            }
+            kfree(mirror);
+        }
+        drive->nr_stripes++;
+    }
+    kfree(paths);
+    drive->fd = drive->stripes[0].fd;
+    return ret;
+}
+
+//partition n of a drive is its image with ".p<n>" behind each stripe.
+static char* part_path(const char* image, int n)
+{
+    char* paths = kstrdup(image, GFP_KERNEL);
+    char* cur = paths;
+    char* path = NULL;
+    char* p = NULL;
+    int len = 0;
+
+    if (NULL == paths) {
+        return NULL;
+    }
+    path = kmalloc(4 * strlen(image) + 8, GFP_KERNEL);
+    while (path && NULL != (p = strsep(&cur, ":"))) {
+        len += sprintf(path + len, "%s%s.p%d", len ? ":" : "", p, n);
+    }
+    kfree(paths);
+    return path;
+}
+
+/*
+  Open the images of the mounted partition and index them. return -ENOENT
+  if an image can't be opened, the partition then stays empty.
+*/
+static int kvtape_medium_load(struct kvtape_drive* drive, const char* path)
+{
+    int fds[KVTAPE_MAX_STRIPES];
+    int opened = 0;
+    int i = 0;
+
+    drive->fd = -1;
+    drive->catalog.fd = -1;
+    kvtape_index_init(&drive->index);
+    opened = (0 == kvtape_drive_open(drive, path));
+    drive->index.nr_stripes = drive->nr_stripes;
+    //containers are not striped.
+    if (opened && 1 == drive->nr_stripes && kvtape_pack_probe(drive, container_kb) > 0) {
+        if (kvtape_pack_load(drive) < 0) {
+            return -ENOMEM;
+        }
+    } else if (opened) {
+        for (i = 0; i < drive->nr_stripes; i++) {
+            fds[i] = drive->stripes[i].fd;
+        }
+        if (kvtape_index_load(&drive->index, fds) < 0) {
+            return -ENOMEM;
+        }
+        //stripes may hold blocks behind the first gap.
+        drive->trunc_pending = drive->nr_stripes > 1;
+        //streamed partitions share the drive's dedup state.
+        if (NULL == drive->dedup.drive && kvtape_dedup_init(&drive->dedup, drive) < 0) {
+            return -ENOMEM;
+        }
+    }
+    for (i = 0; i < drive->nr_stripes; i++) {
+        drive->stripes[i].alloc_end = stripe_eod(drive, i);
+    }
+    //the sidecar sits next to the first stripe.
+    if (catalog) {
+        char* image = kstrndup(path, strcspn(path, ":"), GFP_KERNEL);
+        int ret = image ? kvtape_catalog_init(&drive->catalog, image) : -ENOMEM;
+        kfree(image);
+        if (ret) {
+            return ret;
+        }
+    }
+    return opened ? 0 : -ENOENT;
+}
+
+//empty the mounted partition.
+static void kvtape_medium_erase(struct kvtape_drive* drive)
+{
+    kvtape_catalog_truncate(&drive->catalog, 0);
+    if (drive->pack.size) {
+        kvtape_pack_truncate(drive, 0);
+    } else {
+        kvtape_index_truncate(&drive->index, 0);
+    }
+    drive->cur_record_no = 0;
+    kvtape_drive_truncate(drive);
+}
+
+//close the mounted partition; I/O must have drained.
+static void kvtape_medium_exit(struct kvtape_drive* drive)
+{
+    int i = 0;
+
+    if (drive->pack.size) {
+        kvtape_pack_flush(drive);
+    }
+    if (drive->trunc_pending) {
+        kvtape_drive_truncate(drive);
+    }
+    kvtape_catalog_exit(&drive->catalog);
+    kvtape_pack_free(drive);
+    kvtape_index_free(&drive->index);
+    for (i = 0; i < drive->nr_stripes; i++) {
+        if (-1 != drive->stripes[i].fd) {
+            kernel_file_close(drive->stripes[i].fd);
+            drive->stripes[i].fd = -1;
+        }
+    }
+    drive->fd = -1;
+}
+
+/*
+  The layout lives in <image>.parts: the number of partitions, then their
+  sizes in MB. Without it the cartridge has a single partition.
+*/
+static void kvtape_layout_load(struct kvtape_drive* drive, const char* image)
+{
+    struct kvtape_layout* layout = &drive->layout;
+    char* path = kasprintf(GFP_KERNEL, "%.*s.parts", (int)strcspn(image, ":"), image);
+    char buf[64];
+    int fd = -1;
+    int n = 0;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->nr_parts = 1;
+    fd = path ? kernel_file_open(path, O_RDONLY) : -1;
+    kfree(path);
+    if (fd < 0) {
+        return;
+    }
+    n = kernel_file_pread(fd, buf, sizeof(buf) - 1, 0);
+    kernel_file_close(fd);
+    buf[n > 0 ? n : 0] = 0;
+    if (sscanf(buf, "%d %u %u %u %u", &layout->nr_parts, &layout->size_mb[0], &layout->size_mb[1],
+               &layout->size_mb[2], &layout->size_mb[3]) < 1 ||
+        layout->nr_parts < 1 || layout->nr_parts > KVTAPE_MAX_PARTS) {
+        memset(layout, 0, sizeof(*layout));
+        layout->nr_parts = 1;
+    }
+}
+
+static int kvtape_layout_save(struct kvtape_drive* drive, const char* image)
+{
+    struct kvtape_layout* layout = &drive->layout;
+    char* path = kasprintf(GFP_KERNEL, "%.*s.parts", (int)strcspn(image, ":"), image);
+    char buf[64];
+    int fd = -1;
+    int len = 0;
+    int ret = 0;
+
+    fd = path ? kernel_file_open(path, O_RDWR|O_CREAT) : -1;
+    kfree(path);
+    if (fd < 0) {
+        return -ENOENT;
+    }
+    len = snprintf(buf, sizeof(buf), "%d %u %u %u %u\n", layout->nr_parts, layout->size_mb[0],
+                   layout->size_mb[1], layout->size_mb[2], layout->size_mb[3]);
+    ret = kernel_file_truncate(fd, 0);
+    if (0 == ret && kernel_file_pwrite(fd, buf, len, 0) != len) {
+        ret = -EIO;
+    }
+    kernel_file_close(fd);
+    return ret;
+}
+
+/*
+  Lay the cartridge out anew. Every partition is emptied, as partitioning
+  a real tape loses its data too; partitions beyond the new layout are
+  closed and the missing ones are created next to the image. If one can't
+  be, the cartridge is left with a single partition.
+*/
+static int kvtape_format(struct kvtape_drive* drive, struct kvtape_layout* layout)
+{
+    const char* image = images[drive->id];
+    int ret = 0;
+    int i = 0;
+
+    kvtape_part_switch(drive, 0);
+    kvtape_medium_erase(drive);
+    for (i = 1; i < drive->layout.nr_parts; i++) {
+        part_swap(drive, &drive->parts[i]);
+        kvtape_medium_erase(drive);
+        kvtape_medium_exit(drive);
+        part_swap(drive, &drive->parts[i]);
+        memset(&drive->parts[i], 0, sizeof(struct kvtape_part));
+    }
+
+    for (i = 1; i < layout->nr_parts && 0 == ret; i++) {
+        char* path = part_path(image, i);
+
+        part_swap(drive, &drive->parts[i]);
+        ret = path ? kvtape_medium_load(drive, path) : -ENOMEM;
+        if (0 == ret) {
+            //left over from an earlier layout.
+            kvtape_medium_erase(drive);
+        }
+        part_swap(drive, &drive->parts[i]);
+        kfree(path);
+    }
+    if (ret) {
+        printk("\nkvtape drive%d partition %d can't be made, error %d\n", drive->id, i - 1, ret);
+        while (--i > 0) {
+            part_swap(drive, &drive->parts[i]);
+            kvtape_medium_exit(drive);
+            part_swap(drive, &drive->parts[i]);
+            memset(&drive->parts[i], 0, sizeof(struct kvtape_part));
+        }
+        memset(&drive->layout, 0, sizeof(drive->layout));
+        drive->layout.nr_parts = 1;
+    } else {
+        drive->layout = *layout;
+    }
+    drive->mode_layout = drive->layout;
+    if (kvtape_layout_save(drive, image) < 0 && 0 == ret) {
+        ret = -EIO;
+    }
+    return ret;
+}
+
+//NOT READY, operation in progress: a running clone still needs the tape from blkno on.
+static int clone_busy(struct scsi_cmnd* cmnd, uint32_t blkno)
+{
+    if (kvtape_clone_guard(cmnd_to_drive(cmnd), blkno) < 0) {
+        gen_check_sense(cmnd, NOT_READY, 0x04, 0x07, 0);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+  Writing anywhere but at EOD makes the current position the new EOD.
+  return -1 with sense set if a clone keeps the tape from being cut there.
+*/
+static int set_eod_here(struct scsi_cmnd* cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+
+    if (drive->cur_record_no < drive->index.count) {
+        if (clone_busy(cmnd, drive->cur_record_no)) {
+            return -1;
+        }
+        kvtape_catalog_truncate(&drive->catalog, drive->cur_record_no);
+        if (drive->pack.size) {
+            kvtape_pack_truncate(drive, drive->cur_record_no);
+        } else {
+            kvtape_index_truncate(&drive->index, drive->cur_record_no);
+        }
+        drive->trunc_pending = 1;
+    }
+    return 0;
+}
+
+/*
+  Queue an encrypted record for reading into a buffer of its own; it is
+  decrypted when the READ's I/O is done. return the bytes it will fill at
+  skip in the READ's data, -1 with sense set if it can't be decrypted.
+*/
+static int queue_sealed(my_work_t* my_work, struct kvtape_rec* rec, size_t skip, int len)
+{
+    struct kvtape_drive* drive = my_work->drive;
+    struct kvtape_sealed* sealed = NULL;
+    int stripe = kvtape_index_stripe(&drive->index, drive->cur_record_no - 1);
+
+    if (NULL == drive->crypt.tfm || drive->crypt.decrypt < KVTAPE_DECRYPT_DECRYPT ||
+        rec->len < KVTAPE_CRYPT_OVERHEAD) {
+        gen_check_sense(my_work->cmnd, DATA_PROTECT, 0x74, 0x01, len);//unable to decrypt data
+        return -1;
+    }
+    sealed = (struct kvtape_sealed*)kzalloc(sizeof(struct kvtape_sealed), GFP_KERNEL);
+    if (sealed) {
+        sealed->buf = kvtape_io_alloc(my_work, rec->len);
+    }
+    if (NULL == sealed || NULL == sealed->buf) {
+        kfree(sealed);
+        my_work->cmnd->result = DID_ERROR << 16;
+        return -1;
+    }
+    sealed->len = rec->len;
+    sealed->blkno = drive->cur_record_no - 1;
+    sealed->skip = skip;
+    sealed->copy = rec->len - KVTAPE_CRYPT_OVERHEAD < len ? rec->len - KVTAPE_CRYPT_OVERHEAD : len;
+    sealed->next = my_work->sealed;
+    my_work->sealed = sealed;
+    queue_io(my_work, drive->stripes[stripe].fd, KERNEL_FILE_READ, sealed->buf, rec->len,
+             kvtape_index_payload(&drive->index, rec));
+    return sealed->copy;
+}
+
+/*
+  Bounce buffer for the records that can't be read straight into the
+  scatterlist; the first one sizes it for the rest of the READ.
+*/
+static char* read_bounce(my_work_t* my_work, int len)
 {
-    char* p = (char*)&cur_record_no;
-    char* buf = NULL;
-   
-    uint8_t databuf[20] = {
-        0x04,
-        0x00,
-        0x00,
-        0x00,
-        *(p + 3),
-        *(p + 2),
-        *(p + 1),
-        *(p + 0),
-        *(p + 3),
-        *(p + 2),
-        *(p + 1),
-        *(p + 0),
-        0x00,
-        0x00,
-        0x00,
-        0x00,
-        0x00,
-        0x00,
-        0x00,
-        0x00
-    };
-    
-   buf = NULL;
-   if (scsi_sg_count(cmnd)) {
-		struct scatterlist* sg = NULL;
-		int i = 0;
-		scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {
-			buf = kmap(sg_page(sg)) + sg->offset;           
-            memcpy(buf, p, sizeof(databuf));
-            kunmap(sg_page(sg));
-            break;
-		}       
-    }  else { 
-		printk("\nkvtape error in %s: sg_count is 0\n",__func__);
+    if (NULL == my_work->iobuf) {
+        my_work->iobuf = kvtape_io_alloc(my_work, len);
     }
+    return my_work->iobuf;
 }
 
-
-//return -1 chk condition, 0 -ok
-static int fill_one_record(struct scsi_cmnd *cmnd, char* buf, int len)
+/*
+  Look the records up in the index and queue their payloads for reading
+  into the command's scatterlist, my_work->iolen bytes in. Packed and
+  deduplicated records are assembled in a bounce buffer and copied right away.
+  return -1 chk condition, 0 -ok
+*/
+static int fill_records(my_work_t* my_work, int len)
 {
-    unsigned char tape_mark = 0;
-    int record_len = 0;    
-    uint32_t read_cnt = 0;
+    struct scsi_cmnd* cmnd = my_work->cmnd;
+    struct kvtape_drive* drive = my_work->drive;
 
     while (len > 0) {
-        record_len = do_read_recordlen();
-        printk("\n%s record_len:%d\n",__func__,record_len);
-        if (record_len < 0) {
-            return 0;
+        struct kvtape_rec* rec = kvtape_index_get(&drive->index, drive->cur_record_no);
+        int record_len = 0;
+
+        if (NULL == rec) {
+            gen_eod_sense(cmnd, len);
+            goto err;
+        }
+        drive->cur_record_no++;
+
+        if (FILEMARK == rec->type) {//get filemar
+            //fix me, len is not correct.
+            gen_get_filemark_sense(cmnd, cmnd->sense_buffer, len);
+            cmnd->result = CHECK_CONDITION_RESULT;
+            goto err;
+        } else if (SETMARK == rec->type) {//get setmark
+            //fix me, len is not correct.
+            gen_get_setmark_sense(cmnd, cmnd->sense_buffer, len);
+            cmnd->result = CHECK_CONDITION_RESULT;
+            goto err;
+        }
+
+        if (ENCRYPTED != rec->type && KVTAPE_DECRYPT_DECRYPT == drive->crypt.decrypt) {
+            gen_check_sense(cmnd, DATA_PROTECT, 0x74, 0x02, len);//unencrypted data while decrypting
+            goto err;
         }
 
-        if (1 == record_len) { //check tape mark
-            kernel_file_read(vdisk_fd, &tape_mark, 1);
-            if (FILEMARK == tape_mark) {//get filemar
-                //fix me, len is not correct.
-                gen_get_filemark_sense(cmnd, cmnd->sense_buffer, len);
-                cmnd->result = DRIVER_SENSE;
+        //one block is never split between two reads, the rest is skipped.
+        record_len = rec->len < len ? rec->len : len;
+        if (ENCRYPTED == rec->type) {
+            record_len = queue_sealed(my_work, rec, my_work->iolen, len);
+            if (record_len < 0) {
                 goto err;
-            } else if (SETMARK == tape_mark) {//get setmark
-                //fix me, len is not correct.
-                gen_get_setmark_sense(cmnd, cmnd->sense_buffer, len);
-                cmnd->result = DRIVER_SENSE;
+            }
+        } else if (RECIPE == rec->type) {
+            int stripe = kvtape_index_stripe(&drive->index, drive->cur_record_no - 1);
+            char* bounce = read_bounce(my_work, len);
+
+            if (NULL == bounce) {
+                cmnd->result = DID_ERROR << 16;
                 goto err;
-            } else {//Not sure if there is 1 byte record.
-                printk("\ntape_error: encounter 1 byte record!\n");
-                /* req->data_buf[read_cnt] = tape_mark; */
-                read_cnt++;
-                len--;
-                continue;
             }
-        }
+            record_len = kvtape_dedup_read(&drive->dedup, drive->stripes[stripe].fd,
+                                           kvtape_index_payload(&drive->index, rec), rec->len,
+                                           bounce, len);
+            if (record_len < 0) {
+                gen_check_sense(cmnd, MEDIUM_ERROR, 0x11, 0x00, len);//unrecovered read error
+                goto err;
+            }
+            kvtape_sg_copy(cmnd, bounce, record_len, my_work->iolen, 1);
+        } else if (drive->pack.size) {
+            char* bounce = read_bounce(my_work, len);
 
-        if (len < record_len) {
-            int ret = kernel_file_read(vdisk_fd, buf + read_cnt, len);
-            printk("\n%s len:%d, record_len%d,kernel_file_read return %d\n",__func__, len, record_len, ret);
-            read_cnt += len;
-            len = 0;
+            if (NULL == bounce || kvtape_pack_read(drive, rec, bounce, record_len) < 0) {
+                cmnd->result = DID_ERROR << 16;
+                goto err;
+            }
+            kvtape_sg_copy(cmnd, bounce, record_len, my_work->iolen, 1);
         } else {
-            int ret = kernel_file_read(vdisk_fd, buf + read_cnt, record_len);
-            printk("\n%s len:%d, record_len%d,kernel_file_read return %d\n",__func__, len, record_len, ret);
-            read_cnt += record_len;
-            len -= record_len;
+            int stripe = kvtape_index_stripe(&drive->index, drive->cur_record_no - 1);
+            struct kernel_file_sg target;
+
+            kvtape_sg_target(cmnd, my_work->iolen, &target);
+            queue_io(my_work, drive->stripes[stripe].fd, KERNEL_FILE_READ_SG,
+                     (char*)&target, record_len, kvtape_index_payload(&drive->index, rec));
         }
+        my_work->iolen += record_len;
+        len -= record_len;
     }
     return 0;
 
@@ -509,11 +1772,12 @@ static int fill_one_record(struct scsi_cmnd *cmnd, char* buf, int len)
  * Read fix block length data or variable block length data. For variable block length, after read, if file position
  * locates within block, skip to end of the block. That is, one block is not allowed divided to two read operations.
  *
- * @param req 
+ * @param my_work 
+ * @return KVTAPE_ASYNC if the payload is still being read.
  */
-static void do_read(struct scsi_cmnd *cmnd)
+static int do_read(my_work_t* my_work)
 {
-    char* buf = NULL;//cmnd->request_buffer;
+    struct scsi_cmnd* cmnd = my_work->cmnd;
 
     int request_data_len = (uint32_t)cmnd->cmnd[2] << 16;
     request_data_len += (uint32_t)cmnd->cmnd[3] << 8;
@@ -521,86 +1785,221 @@ static void do_read(struct scsi_cmnd *cmnd)
     if (0 == (cmnd->cmnd[1] & 0x01)) {
         printk("\ntape read variable blocksize, transferlen:%d, use_sg:%d ", request_data_len, scsi_sg_count(cmnd));
     } else {
-        printk("\ntape read fixed blocksize %d blocks, blocksize:0x8000, use_sg:%d ", request_data_len, scsi_sg_count(cmnd));
-        request_data_len *= 0x8000;
-    }
+        uint32_t blksize = fixed_blksize(my_work->drive);
 
+        printk("\ntape read fixed blocksize %d blocks, blocksize:0x%x, use_sg:%d ", request_data_len, blksize, scsi_sg_count(cmnd));
+        request_data_len = min_t(uint64_t, (uint64_t)request_data_len * blksize, scsi_bufflen(cmnd));
+    }
 
-    if (scsi_sg_count(cmnd)) {
-        struct scatterlist* sg = NULL;
-		int i = 0;
-		int ret = 0;
-        int buf_len = 0;
-		scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {
-			buf = kmap(sg_page(sg)) + sg->offset;           
-			buf_len = request_data_len < sg->length? request_data_len : sg->length;
-            ret = fill_one_record(cmnd, buf, buf_len);
-            kunmap(sg_page(sg));
- 
-            if (ret < 0) {
-                break;
-            }
-            request_data_len -= buf_len;
-            if (request_data_len <= 0) {
-                break;
-            }
-		}       
-    } else {
-        //buf = cmnd->request_buffer;
-        //fill_one_record(cmnd, buf, request_data_len);
+    if (0 == scsi_sg_count(cmnd)) {
         printk("\nkvtape error %s: sg_count is 0\n",__func__);
+        return 0;
     }
+    if (request_data_len > scsi_bufflen(cmnd)) {
+        request_data_len = scsi_bufflen(cmnd);
+    }
+
+    fill_records(my_work, request_data_len);
+    scsi_set_resid(cmnd, scsi_bufflen(cmnd) - my_work->iolen);
+    submit_io(my_work, 0);
+    return KVTAPE_ASYNC;
 }
 
+/*
+  Packed images: the record is copied into the open container and the
+  command completes; the container is written once it is full.
+*/
+static void do_write_packed(struct scsi_cmnd* cmnd, struct kvtape_drive* drive, int transfer_len)
+{
+    char* dst = NULL;
+
+    if (drive->pack.werr) {
+        drive->pack.werr = 0;
+        gen_check_sense(cmnd, MEDIUM_ERROR, 0x0C, 0x00, transfer_len);//write error
+        return;
+    }
+    dst = kvtape_pack_reserve(drive, transfer_len);
+    if (NULL == dst) {
+        cmnd->result = DID_ERROR << 16;
+        return;
+    }
+    kvtape_sg_fetch(cmnd, dst, transfer_len);
+    if (kvtape_pack_commit(drive, transfer_len, NOT_MARK) < 0) {
+        cmnd->result = DID_ERROR << 16;
+        return;
+    }
+    kvtape_catalog_feed(&drive->catalog, drive->cur_record_no, dst, transfer_len);
+    drive->cur_record_no++;
+    kvtape_prealloc(drive, 0, kvtape_pack_end(drive));
+}
 
-static void do_write(struct scsi_cmnd *cmnd)
+/*
+  Replace the record in iobuf by its recipe, the record's new chunks going
+  to the chunk store. image_len is set to the recipe length.
+*/
+static int dedup_record(my_work_t* my_work, int* image_len)
 {
+    int len = *image_len;
+    char* recipe = kvtape_buf_alloc(4 + KVTAPE_RECIPE_MAX(len));
     int ret = 0;
-    char* buf = NULL;//cmnd->request_buffer;
+
+    if (NULL == recipe) {
+        return -ENOMEM;
+    }
+    ret = kvtape_dedup_write(&my_work->drive->dedup, my_work->iobuf + 4, len, recipe + 4);
+    if (ret < 0) {
+        kvtape_buf_free(recipe);
+        return ret;
+    }
+    *image_len = ret;
+    ret |= KVTAPE_RECIPE_FLAG;
+    memcpy(recipe, &ret, 4);
+    kvtape_buf_free(my_work->iobuf);
+    my_work->iobuf = recipe;
+    return 0;
+}
+
+static void kvtape_write_submit(struct work_struct* work)
+{
+    my_work_t* my_work = container_of(work, my_work_t, crypt_work);
+    struct kvtape_drive* drive = my_work->drive;
+
+    submit_io(my_work, 0);
+    kvtape_drive_io_put(drive);
+}
+
+static void kvtape_write_sealed(void* priv, int err)
+{
+    my_work_t* my_work = (my_work_t*)priv;
+
+    /*
+      The index already has the record. Zeros keep the image walkable,
+      read back they fail to authenticate; nothing plain gets written.
+    */
+    if (err) {
+        my_work->cmnd->result = DID_ERROR << 16;
+        memset(my_work->io[0].buf + 4, 0, my_work->io[0].len - 4);
+    }
+    //may be softirq, the write is queued from process context.
+    INIT_WORK(&my_work->crypt_work, kvtape_write_submit);
+    schedule_work(&my_work->crypt_work);
+}
+
+/** 
+ * Header and payload go out as one backing write at EOD. The index is
+ * updated before the write completes, so the next WRITE can be issued
+ * while this one is still in flight.
+ *
+ * @param my_work 
+ * @return KVTAPE_ASYNC if the record is still being written.
+ */
+static int do_write(my_work_t* my_work)
+{
+    struct scsi_cmnd* cmnd = my_work->cmnd;
+    struct kvtape_drive* drive = my_work->drive;
+    loff_t offset = 0;
+    int stripe = 0;
+    int image_len = 0;
+    int data = 0;
+    int hdr = 0;
+    uint8_t type = NOT_MARK;
     int transfer_len = (uint32_t)cmnd->cmnd[2] << 16;
     transfer_len += (uint32_t)cmnd->cmnd[3] << 8;
     transfer_len += (uint32_t)cmnd->cmnd[4];
     if (0 == (cmnd->cmnd[1] & 0x01)) {
         printk("\ntape write variable blocksize, transferlen:%d", transfer_len);
     } else {
-        printk("\ntape write fixed blocksize %d blocks, blocksize:0x8000", transfer_len);
-        transfer_len *= 0x8000;
+        uint32_t blksize = fixed_blksize(drive);
+
+        printk("\ntape write fixed blocksize %d blocks, blocksize:0x%x", transfer_len, blksize);
+        transfer_len = min_t(uint64_t, (uint64_t)transfer_len * blksize, scsi_bufflen(cmnd));
     }
-    
-    //write record len
-    ret = kernel_file_write(vdisk_fd, &transfer_len, 4);
-
-    if (scsi_sg_count(cmnd)) {
-        struct scatterlist* sg = NULL;
-		int i = 0;
-		int ret = 0;  
-		scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {
-			int real_transfer = 0;
-			buf = kmap(sg_page(sg)) + sg->offset;           
-			if (transfer_len >= sg[i].length) {
-                transfer_len -= sg[i].length;
-                real_transfer = sg[i].length;
-            } else {
-                real_transfer = transfer_len;
-                transfer_len = 0;
-            }
-			ret = kernel_file_write(vdisk_fd, buf, real_transfer);
-            kunmap(sg_page(sg));
-            if (0 == transfer_len) {
-                break;
-            }
-		}       
-    } else {
-        //ret = kernel_file_write(vdisk_fd, buf, transfer_len);
-        //printk("\nwrite 6, write len:%d", ret);
+
+    if (0 == scsi_sg_count(cmnd)) {
 		printk("\nkvtape error %s: sg_count is 0\n",__func__);
-    }    
+        return 0;
+    }
+    if (transfer_len > scsi_bufflen(cmnd)) {
+        transfer_len = scsi_bufflen(cmnd);
+    }
+    //a zero length header is EOD in the image, nothing to write anyway.
+    if (0 == transfer_len) {
+        return 0;
+    }
+
+    if (drive->pack.size) {
+        if (set_eod_here(cmnd) < 0) {
+            return 0;
+        }
+        if (check_capacity(cmnd, kvtape_drive_used(drive) + transfer_len, transfer_len) == 0) {
+            do_write_packed(cmnd, drive, transfer_len);
+        }
+        return 0;
+    }
+
+    //an encrypted record has its IV in front and the tag behind.
+    if (drive->crypt.encrypt) {
+        image_len = transfer_len + KVTAPE_CRYPT_OVERHEAD;
+        data = KVTAPE_CRYPT_IV;
+        type = ENCRYPTED;
+    } else {
+        image_len = transfer_len;
+    }
+    my_work->iobuf = kvtape_io_alloc(my_work, 4 + image_len);
+    if (NULL == my_work->iobuf) {
+        cmnd->result = DID_ERROR << 16;
+        return 0;
+    }
+    //record len, then the record.
+    hdr = ENCRYPTED == type ? image_len | KVTAPE_CRYPT_FLAG : image_len;
+    memcpy(my_work->iobuf, &hdr, 4);
+    kvtape_sg_fetch(cmnd, my_work->iobuf + 4 + data, transfer_len);
+
+    if (set_eod_here(cmnd) < 0) {
+        return 0;
+    }
+    if (check_capacity(cmnd, kvtape_drive_used(drive) + 4 + image_len, transfer_len) < 0) {
+        return 0;
+    }
+    //a plain catalog would give away what encrypted records hold.
+    if (ENCRYPTED != type) {
+        kvtape_catalog_feed(&drive->catalog, drive->cur_record_no, my_work->iobuf + 4, transfer_len);
+    }
+    if (drive->dedup.desc && ENCRYPTED != type && transfer_len >= KVTAPE_CHUNK_MIN) {
+        if (dedup_record(my_work, &image_len) < 0) {
+            cmnd->result = DID_ERROR << 16;
+            return 0;
+        }
+        type = RECIPE;
+    }
+
+    stripe = kvtape_index_stripe(&drive->index, drive->index.count);
+    offset = kvtape_index_offset(&drive->index, drive->index.count);
+    if (kvtape_index_append(&drive->index, offset, image_len, type) < 0) {
+        cmnd->result = DID_ERROR << 16;
+        return 0;
+    }
+    drive->cur_record_no++;
+    kvtape_prealloc(drive, stripe, offset + 4 + image_len);
+
+    queue_io(my_work, drive->stripes[stripe].fd, KERNEL_FILE_WRITE, my_work->iobuf, 4 + image_len, offset);
+    if (ENCRYPTED == type) {
+        //the write goes out once the record is sealed; the next WRITE needn't wait.
+        kvtape_drive_io_get(drive);
+        kvtape_crypt_seal(&drive->crypt, my_work->iobuf + 4, transfer_len, drive->cur_record_no - 1,
+                          kvtape_write_sealed, my_work);
+        return KVTAPE_ASYNC;
+    }
+    submit_io(my_work, 0);
+    return KVTAPE_ASYNC;
 }
 
 static void do_write_filemark(struct scsi_cmnd *cmnd)
 {
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
     uint8_t mark = FILEMARK;
     int mark_len = 1;
+    char mark_rec[5];
     uint32_t mark_count = cmnd->cmnd[2];
     mark_count = (mark_count << 8) + cmnd->cmnd[3];
     mark_count = (mark_count << 8) + cmnd->cmnd[4];
@@ -611,19 +2010,142 @@ static void do_write_filemark(struct scsi_cmnd *cmnd)
         mark = FILEMARK;
     }
 
+    //4 bytes record len like any other record, then the mark.
+    memcpy(mark_rec, &mark_len, 4);
+    mark_rec[4] = mark;
+
+    if (mark_count > 0 && set_eod_here(cmnd) < 0) {
+        return;
+    }
     while (mark_count > 0) {
-        int ret = kernel_file_write(vdisk_fd, &mark_len, 1);
-        ret = kernel_file_write(vdisk_fd, &mark, 1);
+        loff_t offset = kvtape_index_offset(&drive->index, drive->index.count);
+        int stripe = kvtape_index_stripe(&drive->index, drive->index.count);
+        int ret = 0;
+
+        if (check_capacity(cmnd, kvtape_drive_used(drive) + drive->index.hdr_len + 1, mark_count) < 0) {
+            break;
+        }
+        if (drive->pack.size) {
+            ret = kvtape_pack_append(drive, (char*)&mark, 1, mark);
+        } else {
+            ret = kernel_file_pwrite(drive->stripes[stripe].fd, mark_rec, sizeof(mark_rec), offset);
+            ret = sizeof(mark_rec) != ret ? -1 : kvtape_index_append(&drive->index, offset, 1, mark);
+        }
+        if (ret < 0) {
+            cmnd->result = DID_ERROR << 16;
+            break;
+        }
         mark_count--;
-        cur_record_no++;
+        drive->cur_record_no++;
+    }
+    //a filemark is where buffered records must be on the image.
+    if (drive->pack.size && kvtape_pack_flush(drive) < 0) {
+        cmnd->result = DID_ERROR << 16;
+    }
+    //and with mirror_sync on the mirrors too, unless the host asked not to wait.
+    if (mirror_sync && !(cmnd->cmnd[1] & 0x01)) {
+        int i = 0;
+
+        kvtape_drive_drain(drive);
+        for (i = 0; i < drive->nr_stripes; i++) {
+            kvtape_mirror_drain(drive->stripes[i].fd);
+        }
+    }
+}
+
+/** 
+ * Erase from the current position. Short and long erase both truncate the
+ * image there, which already frees the rest of it. With IMMED the status is
+ * returned before the image is trimmed. Every stripe is trimmed at its own
+ * EOD.
+ *
+ * @param my_work 
+ * @return KVTAPE_ASYNC if the image is still being trimmed.
+ */
+static int do_erase(my_work_t* my_work)
+{
+    struct scsi_cmnd* cmnd = my_work->cmnd;
+    struct kvtape_drive* drive = my_work->drive;
+    int immed = cmnd->cmnd[1] & 0x02;
+    int i = 0;
+
+    if (clone_busy(cmnd, drive->cur_record_no)) {
+        return 0;
+    }
+    kvtape_catalog_truncate(&drive->catalog, drive->cur_record_no);
+    if (drive->pack.size) {
+        kvtape_pack_truncate(drive, drive->cur_record_no);
+        kvtape_pack_flush(drive);
+    } else {
+        kvtape_index_truncate(&drive->index, drive->cur_record_no);
+    }
+    drive->trunc_pending = 0;
+
+    for (i = 0; i < drive->nr_stripes; i++) {
+        struct kvtape_stripe* stripe = &drive->stripes[i];
+        loff_t offset = stripe_eod(drive, i);
+
+        stripe->alloc_end = offset;
+        queue_io(my_work, stripe->fd, KERNEL_FILE_TRUNCATE, NULL, 0, offset);
+    }
+    submit_io(my_work, immed);
+    return KVTAPE_ASYNC;
+}
+
+/*
+  FORMAT MEDIUM. Format 0 leaves a single partition, 1 and 2 partition the
+  cartridge as the medium partition page says. VERIFY makes no difference
+  here; IMMED only spares the wait for the drive modelled.
+*/
+static void do_format_medium(struct scsi_cmnd* cmnd)
+{
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+    struct kvtape_layout single;
+    uint8_t format = cmnd->cmnd[2] & 0x0F;
+
+    if (format > 2) {
+        gen_check_sense(cmnd, ILLEGAL_REQUEST, 0x24, 0x00, 0);//invalid field in cdb
+        return;
     }
+    if (clone_busy(cmnd, 0)) {
+        return;
+    }
+    memset(&single, 0, sizeof(single));
+    single.nr_parts = 1;
+    if (kvtape_format(drive, format ? &drive->mode_layout : &single) < 0) {
+        gen_check_sense(cmnd, MEDIUM_ERROR, 0x31, 0x00, 0);//medium format corrupted
+    }
+}
+
+//medium partition mode page of the layout the next FORMAT MEDIUM makes.
+static int mode_sense_partition(struct kvtape_drive* drive, uint8_t* page)
+{
+    struct kvtape_layout* layout = &drive->mode_layout;
+    int i = 0;
+
+    page[0] = 0x11;
+    page[1] = 6 + 2 * layout->nr_parts;
+    page[2] = KVTAPE_MAX_PARTS - 1;//maximum additional partitions
+    page[3] = layout->nr_parts - 1;
+    page[4] = 0x20 | 0x10 | 0x04;//IDP, sizes in MB, partitioned by FORMAT MEDIUM
+    page[5] = 0x03;//format and partition recognition
+    page[6] = 0x00;
+    page[7] = 0x00;
+    for (i = 0; i < layout->nr_parts; i++) {
+        uint32_t size = layout->size_mb[i] < 0xFFFF ? layout->size_mb[i] : 0xFFFF;
+        page[8 + 2 * i] = size >> 8;
+        page[9 + 2 * i] = size & 0xFF;
+    }
+    return 8 + 2 * layout->nr_parts;
 }
 
 static void do_mode_sense6(struct scsi_cmnd *cmnd)
 {
-    char* buf = NULL;
-    char header[4] = {0};
-    char blk_descriptor[8];
+    uint8_t buf[4 + 8 + 8 + 2 * KVTAPE_MAX_PARTS];
+    uint8_t* header = buf;
+    uint8_t* blk_descriptor = buf + 4;
+    uint8_t page_code = cmnd->cmnd[2] & 0x3F;
+    int len = 4 + 8;
 
     header[0] = 0x00;//actual mode parameter list length - 1.
     header[1] = 0x00;//default media type, current mounted.
@@ -643,31 +2165,31 @@ static void do_mode_sense6(struct scsi_cmnd *cmnd)
     blk_descriptor[2] = 0x00;
     blk_descriptor[3] = 0x00;
     blk_descriptor[4] = 0x00;
-    blk_descriptor[5] = 0x00;
-    blk_descriptor[6] = 0x00;
-    blk_descriptor[7] = 0x00;
+    blk_descriptor[5] = (cmnd_to_drive(cmnd)->blksize >> 16) & 0xFF;
+    blk_descriptor[6] = (cmnd_to_drive(cmnd)->blksize >> 8) & 0xFF;
+    blk_descriptor[7] = cmnd_to_drive(cmnd)->blksize & 0xFF;
 
-    header[0] = 8 + 4 -1;
+    //(3)the pages asked for, of those there are.
+    if (0x11 == page_code || 0x3F == page_code) {
+        len += mode_sense_partition(cmnd_to_drive(cmnd), buf + len);
+    }
+    header[0] = len - 1;
 
-    buf = NULL;//cmnd->request_buffer;
-    if (scsi_sg_count(cmnd)) {  
-        struct scatterlist* sg = NULL;
-	int i = 0;
-	scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {	
-	    buf = kmap(sg_page(sg)) + sg->offset;           
-	    memcpy(buf, header, 4);
-            memcpy(buf + 4, blk_descriptor, 8);
-            kunmap(sg_page(sg));
-            break;            
-	}       
-    } else {  
-		printk("\nkvtape error in %s: sg_count is 0\n",__func__);
-    }    
+    if (0 == scsi_sg_count(cmnd)) {
+        printk("\nkvtape error in %s: sg_count is 0\n",__func__);
+        return;
+    }
+    if (len > cmnd->cmnd[4]) {
+        len = cmnd->cmnd[4];
+    }
+    if (len > scsi_bufflen(cmnd)) {
+        len = scsi_bufflen(cmnd);
+    }
+    kvtape_sg_reply(cmnd, buf, len);
 }
 
 static void do_read_blocklimit(struct scsi_cmnd *cmnd)
 {
-   char* buf = NULL;//cmnd->request_buffer;
     /*variable block length range is not specified.*/
     char data_buf[6] = {0};
     data_buf[0] = 0;
@@ -677,18 +2199,76 @@ static void do_read_blocklimit(struct scsi_cmnd *cmnd)
     data_buf[4] = 0x00;
     data_buf[5] = 0x01;
 
-    if (scsi_sg_count(cmnd)) {  
-        struct scatterlist* sg = NULL;
-		int i = 0;
-		scsi_for_each_sg(cmnd, sg, scsi_sg_count(cmnd), i) {	
-			buf = kmap(sg_page(sg)) + sg->offset;           
-			memcpy(buf, data_buf, 6);
-            kunmap(sg_page(sg));
-            break;            
-		}       
-    } else {    
-      printk("\nkvtape error %s: sg_count is 0\n",__func__);
-    }        
+    kvtape_sg_reply(cmnd, data_buf, 6);
+}
+
+static void kvtape_user_done(void* priv)
+{
+    kvtape_cmd_complete((my_work_t*)priv);
+}
+
+/*
+  When the drive modelled by drive->timing would let the command complete.
+  Data moves and buffer flushes are timed before the command runs, so the
+  time is there for an asynchronous completion; positioning is timed after,
+  once the new position is known.
+*/
+static s64 cmd_timing(my_work_t* my_work, int done)
+{
+    struct kvtape_drive* drive = my_work->drive;
+    struct scsi_cmnd* cmnd = my_work->cmnd;
+
+    if (!kvtape_timing_on(&drive->timing)) {
+        return 0;
+    }
+    switch (cmnd->cmnd[0]) {
+    case 0x08://read
+    case 0x0A://write
+        return done ? my_work->done_at :
+            kvtape_timing_transfer(&drive->timing, 0x0A == cmnd->cmnd[0], scsi_bufflen(cmnd));
+    case 0x10://write file mark
+        if (cmnd->cmnd[1] & 0x01) {//immed
+            return 0;
+        }
+        //fall through
+    case 0x19://erase
+        return done ? my_work->done_at : kvtape_timing_flush(&drive->timing);
+    case 0x01://rewind
+        return done ? kvtape_timing_rewind(&drive->timing, 0) : 0;
+    case 0x1B://load unload
+        return done ? kvtape_timing_rewind(&drive->timing, 1) : 0;
+    case 0x04://format medium
+    case 0x11://space
+    case 0x2B://locate
+    case 0x92://locate16
+        return done ? kvtape_timing_locate(&drive->timing, tape_position(drive)) : 0;
+    default:
+        return done ? my_work->done_at : 0;
+    }
+}
+
+//the IMMED bit of the commands that have one.
+static int cmd_immed(struct scsi_cmnd* cmnd)
+{
+    switch (cmnd->cmnd[0]) {
+    case 0x01://rewind
+    case 0x04://format medium
+    case 0x10://write file mark
+    case 0x1B://load unload
+    case 0x2B://locate
+    case 0x92://locate16
+        return cmnd->cmnd[1] & 0x01;
+    case 0x19://erase
+        return cmnd->cmnd[1] & 0x02;
+    default:
+        return 0;
+    }
+}
+
+//commands that only report on the drive; they don't wait for its I/O.
+static int cmd_status_only(uint8_t op)
+{
+    return 0x00 == op || 0x03 == op || 0x12 == op;
 }
 
 /*
@@ -698,8 +2278,20 @@ static void do_read_blocklimit(struct scsi_cmnd *cmnd)
 static void scsi_cmd_handler(struct work_struct *work)
 {
     my_work_t* my_work = container_of(work, my_work_t, work);
+    struct kvtape_drive* drive = cmnd_to_drive(my_work->cmnd);
+    uint8_t op = my_work->cmnd->cmnd[0];
+    int ret = 0;
     unsigned short i = 0;
 
+    my_work->position = drive->cur_record_no;
+    if (drive->user) {
+        if (kvtape_user_queue(drive->user, my_work->cmnd, kvtape_user_done, my_work) < 0) {
+            gen_check_sense(my_work->cmnd, NOT_READY, 0x04, 0x00, 0);//no daemon
+            kvtape_cmd_complete(my_work);
+        }
+        return;
+    }
+
     printk("\n do my_wq_function, cmnd->use_sg:%d\n", 
         scsi_sg_count(my_work->cmnd));
 #ifdef DEBUG_PRINT
@@ -708,19 +2300,53 @@ static void scsi_cmd_handler(struct work_struct *work)
     i++;
     }
 #endif
-    
-    switch (my_work->cmnd->cmnd[0]) {
+
+    /*
+      Consecutive READs or WRITEs may overlap; anything else, a repeated
+      ERASE too, sees the backing file only after every outstanding
+      transfer has landed.
+      Status commands don't see it at all, so they can tell how far an
+      IMMED command in the background got.
+    */
+    if (cmd_status_only(op)) {
+        goto run;
+    }
+    if ((0x08 != op && 0x0A != op) || op != drive->async_op) {
+        kvtape_drive_drain(drive);
+    }
+    //records buffered in the open container go to the image first.
+    if (drive->pack.size && 0x0A != op && 0x10 != op) {
+        kvtape_pack_flush(drive);
+    }
+    if (0x0A != op) {
+        kvtape_catalog_flush(&drive->catalog);
+        kvtape_dedup_flush(&drive->dedup);
+    }
+    //the write stream has ended, cut off what used to follow it.
+    if (drive->trunc_pending && 0x0A != op && 0x10 != op) {
+        kvtape_drive_truncate(drive);
+    }
+    my_work->done_at = cmd_timing(my_work, 0);
+
+ run:
+    switch (op) {
     case 0x12://inqiury
         do_inquiry(my_work->cmnd);
         break;
     case 0x00: //test unit ready
         do_test_unit_ready(my_work->cmnd);
         break;
+    case 0x03://request sense
+        do_request_sense(my_work->cmnd);
+        break;
     case 0x01://rewind
         do_rewind(my_work->cmnd);
         break;
+    case 0x1B://load unload
+        do_load_unload(my_work->cmnd);
+        break;
     case 0x19://erase
-        do_erase(my_work->cmnd);
+        ret = do_erase(my_work);
         break;
     case 0x1A://mode sense6
         do_mode_sense6(my_work->cmnd);
@@ -732,10 +2358,10 @@ static void scsi_cmd_handler(struct work_struct *work)
         do_read_blocklimit(my_work->cmnd);
         break;
     case 0x08: //read
-        do_read(my_work->cmnd);
+        ret = do_read(my_work);
         break;
     case 0x0A://write
-        do_write(my_work->cmnd);
+        ret = do_write(my_work);
         break;
     case 0x10://write file mark
         do_write_filemark(my_work->cmnd);
@@ -743,30 +2369,68 @@ static void scsi_cmd_handler(struct work_struct *work)
     case 0x11://space
         do_space(my_work->cmnd);
         break;
+    case 0x04://format medium
+        do_format_medium(my_work->cmnd);
+        break;
+    case 0x2B://locate
+    case 0x92://locate16
+        do_locate(my_work->cmnd);
+        break;
     case 0x34:
         do_read_position(my_work->cmnd);
         break;
+    case 0xB5://security protocol out
+        do_security_protocol_out(my_work->cmnd);
+        break;
     default:
         printk("\ncdb[0]:0x%x is not supported\n", my_work->cmnd->cmnd[0]);
         break;
     }
-    scsi_set_resid(my_work->cmnd, 0); 
-    my_work->done(my_work->cmnd);
-    kfree((void *)my_work);
-    return;
+    if (0x08 == op || 0x0A == op) {
+        kvtape_mem_moved(&drive->mem, scsi_bufflen(my_work->cmnd) - scsi_get_resid(my_work->cmnd));
+    }
+    if (KVTAPE_ASYNC != ret) {
+        my_work->done_at = cmd_timing(my_work, 1);
+    }
+    //with IMMED the status goes now, the drive modelled stays busy behind it.
+    if (KVTAPE_ASYNC != ret && my_work->done_at && cmd_immed(my_work->cmnd)) {
+        drive->busy_start = ktime_to_ns(ktime_get());
+        drive->busy_end = my_work->done_at;
+        my_work->done_at = 0;
+    }
+    //container writes may be in flight behind a synchronous WRITE too.
+    if (!cmd_status_only(op) && (KVTAPE_ASYNC == ret || atomic_read(&drive->inflight))) {
+        drive->async_op = op;
+    }
+    if (KVTAPE_ASYNC == ret) {
+        return;
+    }
+    kvtape_cmd_complete(my_work);
 }
 
 
+/*
+  Called with the host lock held and interrupts off, so no sleeping
+  allocation here. Nothing else is done under the lock: the work item goes
+  on the drive's own workqueue. Each drive runs its commands in order on
+  its own thread; different drives proceed in parallel.
+*/
 static int kvtape_initiator_queuecommand(struct scsi_cmnd *cmnd,  void (*done)(struct scsi_cmnd*))
 {
-    my_work_t* work_ptr = (my_work_t*)kmalloc(sizeof(my_work_t), GFP_KERNEL);
+    struct kvtape_drive* drive = cmnd_to_drive(cmnd);
+    my_work_t* work_ptr = (my_work_t*)kzalloc(sizeof(my_work_t), GFP_ATOMIC);
  
-    if (work_ptr) {     
-        work_ptr->cmnd = cmnd;
-        work_ptr->done = done;
-        INIT_WORK(&work_ptr->work, scsi_cmd_handler);        
-        schedule_work(&work_ptr->work);
+    if (NULL == work_ptr) {
+        return SCSI_MLQUEUE_HOST_BUSY;
     }
+    //data movers set the residual of what they transfer.
+    scsi_set_resid(cmnd, 0);
+    work_ptr->cmnd = cmnd;
+    work_ptr->done = done;
+    work_ptr->drive = drive;
+    work_ptr->start = ktime_get();
+    INIT_WORK(&work_ptr->work, scsi_cmd_handler);        
+    queue_work(drive->cmd_wq, &work_ptr->work);
     return 0;
 }
 
@@ -789,6 +2453,15 @@ int kvtape_initiator_proc_info(struct Scsi_Host *sh, char *buffer, char **start,
    return 0;
 }
 
+static int kvtape_slave_alloc(struct scsi_device* sdev)
+{
+    if (sdev->id < 1 || sdev->id > num_drives || 0 != sdev->lun) {
+        return -ENXIO;
+    }
+    sdev->hostdata = &tape_drives[sdev->id - 1];
+    return 0;
+}
+
 static struct scsi_host_template driver_template = {
       proc_info:kvtape_initiator_proc_info,
       module:THIS_MODULE,
@@ -798,6 +2471,7 @@ static struct scsi_host_template driver_template = {
       detect:NULL,
       release:NULL,
       queuecommand:kvtape_initiator_queuecommand,
+      slave_alloc:kvtape_slave_alloc,
       //eh_strategy_handler:NULL,
       eh_abort_handler:kvtape_initiator_abort,
       eh_device_reset_handler:kvtape_initiator_reset,
@@ -807,8 +2481,9 @@ static struct scsi_host_template driver_template = {
       /* max no. of simultaneously active SCSI commands driver can accept */
       can_queue:MAX_COMMANDS_PER_LUN * MAX_LUNS,
       this_id:-1,		/* our host has no id on the SCSI bus */
-      /* max no. of simultaneously active SCSI commands driver can accept */
-      sg_tablesize:MAX_IOV_SLOTS - 4,
+      /* max no. of scatterlist entries per command; st needs 64 of its
+       * 64KB segments for a 4MB block */
+      sg_tablesize:SG_ALL,
       /* max no. of sectors driver can accept in 1 SCSI READ/WRITE command */
       /* SET BY A MODULE PARAMETER, see max_sectors above */
       max_sectors: 0,
@@ -851,11 +2526,10 @@ static void remove_scsi_target(struct scsi_device *sdev)
     printk("\ndo remove_scsi_target\n");
 }
 
-struct scsi_device* sdev1 = NULL;
-
 static int kvtape_probe(struct device *dev)
 {
 	int retval = 0;
+	int i = 0;
 
 	printk("\ndo kvtape_probe\n");
 	driver_template.max_sectors = MAX_SECTORS_PER_CMD;
@@ -883,9 +2557,11 @@ static int kvtape_probe(struct device *dev)
 	} else {
 		/* Initialize the adapter's private data structure */
 		printk("%s After scsi_add_host ok, call init_initiator and add_scsi_target\n", __func__);
-	    if (NULL == sdev1) {
-            sdev1 = add_scsi_target(1, 0);
-            printk("\nkvtape_probe, sdev1:%p \n",sdev1);
+        for (i = 0; i < num_drives; i++) {
+            if (NULL == tape_drives[i].sdev) {
+                tape_drives[i].sdev = add_scsi_target(tape_drives[i].id + 1, 0);
+                printk("\nkvtape_probe, drive%d sdev:%p \n", i, tape_drives[i].sdev);
+            }
         }
         retval = 0;
 	}
@@ -898,9 +2574,12 @@ out:
 int kvtape_remove(struct device *dev)
 {
 	int ret = 0;
-	printk("\nenter %s, sdev1:%p \n",__func__, sdev1);
-    if (NULL != sdev1) {
-        remove_scsi_target(sdev1);
+	int i = 0;
+	printk("\nenter %s\n",__func__);
+    for (i = 0; i < num_drives; i++) {
+        if (NULL != tape_drives[i].sdev) {
+            remove_scsi_target(tape_drives[i].sdev);
+        }
     }
  
     scsi_remove_host(shost);
@@ -937,23 +2616,166 @@ static struct device kvtape_pseudo = {
 };
 
 
+/*
+  Open the backing files of a drive, path being one image or stripes
+  separated by ':'. return 0 if every stripe is open.
+*/
+static int kvtape_drive_init(struct kvtape_drive* drive, int id, const char* path)
+{
+    char name[16];
+    int ret = 0;
+    int i = 0;
+
+    memset(drive, 0, sizeof(*drive));
+    drive->id = id;
+    drive->fd = -1;
+    drive->layout.nr_parts = 1;
+    atomic_set(&drive->inflight, 0);
+    init_waitqueue_head(&drive->io_wait);
+
+    //the workqueue keeps a pointer to its name.
+    snprintf(drive->name, sizeof(drive->name), "kvtape%d", drive->id);
+    drive->cmd_wq = create_singlethread_workqueue(drive->name);
+    if (NULL == drive->cmd_wq) {
+        return -ENOMEM;
+    }
+
+    INIT_WORK(&drive->mem_work, kvtape_cache_drop);
+    kvtape_mem_register(&drive->mem, drive->id, kvtape_cache_reclaim);
+
+    snprintf(name, sizeof(name), "drive%d", drive->id);
+    drive->dbg_dir = kvtape_debugfs ? debugfs_create_dir(name, kvtape_debugfs) : NULL;
+    kvtape_index_init(&drive->index);
+    drive->catalog.fd = -1;
+
+    //the daemon owns the image.
+    if (user_backend) {
+        drive->user = (struct kvtape_user*)kzalloc(sizeof(struct kvtape_user), GFP_KERNEL);
+        if (NULL == drive->user) {
+            return -ENOMEM;
+        }
+        ret = kvtape_user_init(drive->user, drive);
+        if (ret) {
+            kfree(drive->user);
+            drive->user = NULL;
+            return ret;
+        }
+        return kvtape_trace_init(&drive->trace, drive->id, drive->dbg_dir);
+    }
+
+    //an image that can't be opened is left empty, like a blank cartridge.
+    ret = kvtape_medium_load(drive, path);
+    if (ret && -ENOENT != ret) {
+        return ret;
+    }
+    if (0 == ret) {
+        kvtape_layout_load(drive, path);
+    }
+    for (i = 1; i < drive->layout.nr_parts; i++) {
+        char* part = part_path(path, i);
+
+        part_swap(drive, &drive->parts[i]);
+        ret = part ? kvtape_medium_load(drive, part) : -ENOMEM;
+        part_swap(drive, &drive->parts[i]);
+        kfree(part);
+        if (ret && -ENOENT != ret) {
+            return ret;
+        }
+    }
+    drive->mode_layout = drive->layout;
+    drive->prealloc_step = (loff_t)prealloc_mb << 20;
+    if (kvtape_clone_init(drive) < 0) {
+        return -ENOMEM;
+    }
+    ret = kvtape_timing_init(&drive->timing, drive->dbg_dir);
+    if (ret) {
+        return ret;
+    }
+    return kvtape_trace_init(&drive->trace, drive->id, drive->dbg_dir);
+}
+
+static void kvtape_drive_exit(struct kvtape_drive* drive)
+{
+    int i = 0;
+
+    if (NULL == drive->cmd_wq) {
+        return;
+    }
+    //a clone being taken still needs the command thread and the images.
+    kvtape_clone_exit(drive);
+    kvtape_mem_unregister(&drive->mem);
+    destroy_workqueue(drive->cmd_wq);
+    drive->cmd_wq = NULL;
+    kvtape_drive_drain(drive);
+    kvtape_medium_exit(drive);
+    for (i = 0; i < drive->layout.nr_parts; i++) {
+        if (i != drive->part) {
+            part_swap(drive, &drive->parts[i]);
+            kvtape_medium_exit(drive);
+        }
+    }
+    if (drive->user) {
+        kvtape_user_exit(drive->user);
+        kfree(drive->user);
+        drive->user = NULL;
+    }
+    kvtape_dedup_exit(&drive->dedup);
+    kvtape_crypt_clear(&drive->crypt);
+    kvtape_timing_exit(&drive->timing);
+    kvtape_trace_exit(&drive->trace);
+}
+
 int init_module(void)
 {
 	int err = 0;
+	int i = 0;
 
     printk("\nhello, vincent\n");
+    //drive state must be ready before the scsi device is added and probed.
+    err = kernel_fop_init();
+    if (err) {
+        goto out;
+    }
+    kvtape_debugfs = debugfs_create_dir("kvtape", NULL);
+    err = kvtape_mem_init(kvtape_debugfs);
+    if (err) {
+        goto out_debugfs;
+    }
+    if (stage_dir) {
+        kvtape_tier_init(kvtape_debugfs);
+    }
+    if (num_mirrors) {
+        kvtape_mirror_init(kvtape_debugfs);
+    }
+    if (dedup_store) {
+        err = kvtape_dedup_open(dedup_store, kvtape_debugfs);
+        if (err) {
+            goto out_mem;
+        }
+    }
+    for (i = 0; i < num_drives; i++) {
+        err = kvtape_drive_init(&tape_drives[i], i, images[i]);
+        if (err) {
+            goto out_drives;
+        }
+    }
+
 	printk("%s call into bus_register(&kvtape_bus %p)\n",	__func__, &kvtape_bus);
 	err = bus_register(&kvtape_bus);
 	printk("%s back from bus_register(&kvtape_bus %p), err %d\n",	__func__, &kvtape_bus, err);
 
 	if (err) {
-		goto out;
+		goto out_drives;
 	}
 
 	printk("%s call into driver_register(&kvtape_driver %p)\n",	__func__, &kvtape_driver);
 	err = driver_register(&kvtape_driver);
 	printk("%s back from driver_register(&kvtape_driver %p), err %d\n",	__func__, &kvtape_driver, err);
 
+	if (err) {
+		goto out_bus;
+	}
+
 	printk("%s call into device_register(&kvtape_pseudo %p)\n",	__func__, &kvtape_pseudo);
 	err = device_register(&kvtape_pseudo);
 	printk("%s back from device_register(&kvtape_pseudo %p), err %d\n",__func__, &kvtape_pseudo, err);
@@ -961,18 +2783,33 @@ int init_module(void)
 	if (err) {
 		printk("%s device_register(&kvtape_pseudo %p) failed %d\n",	__func__, &kvtape_pseudo, err);
 		put_device(&kvtape_pseudo);	/* yes, even on an error! */
-		goto out;
+		goto out_driver;
 	}
+	return 0;
 
-    vdisk_fd = kernel_file_open("/home/vdisk.dat", O_RDWR|O_CREAT);
-    printk("\nkernel_file_open vdisk.dat, fd:%d\n", vdisk_fd);
-
+ out_driver:
+	driver_unregister(&kvtape_driver);
+ out_bus:
+	bus_unregister(&kvtape_bus);
+ out_drives:
+    //drives that were never set up have no workqueue and are skipped.
+    for (i = 0; i < num_drives; i++) {
+        kvtape_drive_exit(&tape_drives[i]);
+    }
+    kvtape_dedup_close();
+ out_mem:
+    kvtape_mem_exit();
+ out_debugfs:
+    debugfs_remove_recursive(kvtape_debugfs);
+    kvtape_debugfs = NULL;
+    kernel_fop_exit();
  out:
 	return err;
 }
 
 void cleanup_module ( void )
 {
+    int i = 0;
     printk("\ngoodbye, vincent\n");
 
 	printk("%s call into device_unregister\n",	__func__);
@@ -987,8 +2824,11 @@ void cleanup_module ( void )
 	bus_unregister(&kvtape_bus);
 	printk("%s back from bus_unregister\n",	__func__);
 
-    if (-1 != vdisk_fd) {
-        kernel_file_close(vdisk_fd);
-        vdisk_fd = -1;
+    for (i = 0; i < num_drives; i++) {
+        kvtape_drive_exit(&tape_drives[i]);
     }
+    kvtape_dedup_close();
+    kvtape_mem_exit();
+    debugfs_remove_recursive(kvtape_debugfs);
+    kernel_fop_exit();
 }
@@ -0,0 +1,128 @@
+/**
+ * @file   kvtape.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 09:20:11 2026
+ *
+ * @brief  Per-drive state shared by the kvtape LLD modules.
+ *
+ */
+
+#ifndef KVTAPE_H__
+#define KVTAPE_H__
+
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <asm/atomic.h>
+#include "kvtape_trace.h"
+#include "kvtape_index.h"
+#include "kvtape_pack.h"
+#include "kvtape_catalog.h"
+#include "kvtape_dedup.h"
+#include "kvtape_crypt.h"
+#include "kvtape_timing.h"
+#include "kvtape_mem.h"
+
+struct dentry;
+struct scsi_device;
+struct workqueue_struct;
+struct kvtape_drive;
+struct kvtape_user;
+struct kvtape_clone;
+
+#define KVTAPE_MAX_STRIPES 8
+#define KVTAPE_MAX_PARTS   4
+
+enum _filemark {
+    NOT_MARK,
+    FILEMARK,
+    SETMARK,
+    DATAMARK,
+    RECIPE,             //payload lists the chunks of a deduplicated record
+    ENCRYPTED           //payload is IV, ciphertext and tag
+};
+
+//one backing file of a drive.
+struct kvtape_stripe {
+    struct kvtape_drive* drive;
+    int fd;                     //-1 if not opened
+    loff_t alloc_end;           //file preallocated up to here
+    loff_t prealloc_to;         //alloc_end once the running fallocate is done
+    int prealloc_busy;
+};
+
+//a partition's medium while another one is mounted in the drive.
+struct kvtape_part {
+    int fd;
+    int nr_stripes;
+    struct kvtape_stripe stripes[KVTAPE_MAX_STRIPES];
+    int cur_record_no;
+    struct kvtape_index index;
+    struct kvtape_pack pack;
+    struct kvtape_catalog catalog;
+    int trunc_pending;
+};
+
+//partitions of a cartridge and their sizes in MB, 0 to share what is left.
+struct kvtape_layout {
+    int nr_parts;
+    uint32_t size_mb[KVTAPE_MAX_PARTS];
+};
+
+struct kvtape_drive {
+    int id;
+    char name[16];
+    int fd;                     //backing image, first stripe if striped
+    int nr_stripes;
+    struct kvtape_stripe stripes[KVTAPE_MAX_STRIPES];
+    int cur_record_no;          //logical block position
+    struct kvtape_index index;
+    struct kvtape_pack pack;    //packed format state, pack.size 0 if streamed
+    struct kvtape_catalog catalog;
+    struct kvtape_dedup dedup;  //dedup.desc NULL unless records are deduplicated
+    struct kvtape_crypt crypt;  //key and modes set by SECURITY PROTOCOL OUT
+    int trunc_pending;          //image still holds records behind EOD
+    int part;                   //partition the medium fields above belong to
+    struct kvtape_part parts[KVTAPE_MAX_PARTS];  //the others, parts[part] is unused
+    struct kvtape_layout layout;
+    struct kvtape_layout mode_layout;  //set by MODE SELECT, made by FORMAT MEDIUM
+    uint32_t blksize;           //fixed block size set by MODE SELECT, 0 for variable
+    loff_t prealloc_step;       //0 once the filesystem refused fallocate
+    struct scsi_device* sdev;
+    struct workqueue_struct* cmd_wq;  //commands of this drive, in order
+    atomic_t inflight;          //commands with backing I/O outstanding
+    wait_queue_head_t io_wait;  //woken when inflight drops to 0
+    uint8_t async_op;           //opcode of the last command left in flight
+    //an IMMED command whose status has gone out while it is still at work.
+    s64 busy_start;             //ns ktime
+    s64 busy_end;               //the drive modelled is done then
+    int bg_total;               //its backing file ranges
+    atomic_t bg_left;           //those not done yet
+    struct dentry* dbg_dir;     //debugfs kvtape/driveN
+    struct kvtape_user* user;   //command ring, NULL unless user_backend
+    struct kvtape_clone* clone; //debugfs clone requests, NULL for user_backend
+    struct kvtape_trace trace;
+    struct kvtape_timing timing;  //off unless a profile is set
+    struct kvtape_mem mem;      //buffers charged to the memory budget
+    struct work_struct mem_work;  //drops the caches on cmd_wq
+};
+
+//backing I/O started outside a command, e.g. a container write.
+static inline void kvtape_drive_io_get(struct kvtape_drive* drive)
+{
+    atomic_inc(&drive->inflight);
+}
+
+static inline void kvtape_drive_io_put(struct kvtape_drive* drive)
+{
+    if (atomic_dec_and_test(&drive->inflight)) {
+        wake_up(&drive->io_wait);
+    }
+}
+
+static inline void kvtape_drive_drain(struct kvtape_drive* drive)
+{
+    wait_event(drive->io_wait, 0 == atomic_read(&drive->inflight));
+}
+
+#endif
@@ -0,0 +1,558 @@
+/**
+ * @file   kvtape_bench.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Thu Oct 22 14:05:52 2026
+ *
+ * @brief  Throughput and latency benchmark of a tape drive.
+ *
+ * Runs a matrix of cases against a drive through st (/dev/nstN, st
+ * ioctls) and, with -g, through SG_IO on its sg node, bypassing st:
+ *
+ *     write, read    every block size, fixed and variable block mode,
+ *                    every filemark frequency
+ *     fsf, bsf, eod, locate, tell, rewind
+ *                    over a tape of files written first
+ *     sg_tur, sg_read_position, sg_write, sg_read
+ *                    the same through SG_IO
+ *
+ * and prints one JSON object per case on stdout, so a run can be kept as
+ * a baseline and compared with the next:
+ *
+ *     {"case":"write","mode":"variable","block":262144,"filemark_every":0,
+ *      "cmds":1024,"bytes":268435456,"secs":0.812,"mb_s":315.27,
+ *      "cmds_s":1261.08,"p50_us":702,"p99_us":2004,"p999_us":4810}
+ *
+ * Latency is that of each command (read(), write() or ioctl()); data
+ * cases count filemarks written or crossed as commands too. The tape is
+ * overwritten from the beginning.
+ *
+ *     kvtape_bench [-b 65536,262144,1048576] [-n 256] [-m 0,100] [-r 100]
+ *                  [-g /dev/sg1] /dev/nst0
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mtio.h>
+#include <scsi/sg.h>
+
+#define MAX_LIST 16
+#define SG_TIMEOUT_MS (10 * 60 * 1000)
+
+//latencies of the case being run.
+struct lat {
+    double* us;
+    size_t nr;
+    size_t size;
+    uint64_t bytes;
+    struct timespec begin;
+};
+
+static int tape = -1;
+static char* buf = NULL;
+static size_t buf_len = 0;
+static unsigned long blocks[MAX_LIST] = {65536, 262144, 1048576};
+static int nr_blocks = 3;
+static unsigned long marks[MAX_LIST] = {0, 100};
+static int nr_marks = 2;
+static uint64_t case_bytes = 256ULL << 20;
+static unsigned long reps = 100;
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void lat_begin(struct lat* l)
+{
+    l->nr = 0;
+    l->bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &l->begin);
+}
+
+static void lat_add(struct lat* l, double us, uint64_t bytes)
+{
+    if (l->nr == l->size) {
+        l->size = l->size ? 2 * l->size : 4096;
+        l->us = realloc(l->us, l->size * sizeof(double));
+        if (NULL == l->us) {
+            fprintf(stderr, "kvtape_bench: out of memory\n");
+            exit(1);
+        }
+    }
+    l->us[l->nr++] = us;
+    l->bytes += bytes;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+//nearest rank.
+static double percentile(struct lat* l, double p)
+{
+    size_t i = (size_t)(p * l->nr + 0.999999);
+
+    if (0 == l->nr) {
+        return 0;
+    }
+    return l->us[i ? i - 1 : 0];
+}
+
+static void lat_report(struct lat* l, const char* name, const char* mode, unsigned long block,
+                       unsigned long mark_every)
+{
+    struct timespec end;
+    double secs = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - l->begin.tv_sec) + (end.tv_nsec - l->begin.tv_nsec) / 1e9;
+    qsort(l->us, l->nr, sizeof(double), cmp_double);
+    printf("{\"case\":\"%s\",\"mode\":\"%s\",\"block\":%lu,\"filemark_every\":%lu,"
+           "\"cmds\":%zu,\"bytes\":%llu,\"secs\":%.3f,\"mb_s\":%.2f,\"cmds_s\":%.2f,"
+           "\"p50_us\":%.0f,\"p99_us\":%.0f,\"p999_us\":%.0f}\n",
+           name, mode, block, mark_every, l->nr, (unsigned long long)l->bytes, secs,
+           secs > 0 ? l->bytes / secs / (1 << 20) : 0, secs > 0 ? l->nr / secs : 0,
+           percentile(l, 0.5), percentile(l, 0.99), percentile(l, 0.999));
+    fflush(stdout);
+}
+
+static int mt(short op, int count)
+{
+    struct mtop mtop;
+
+    mtop.mt_op = op;
+    mtop.mt_count = count;
+    return ioctl(tape, MTIOCTOP, &mtop);
+}
+
+//an st ioctl of the case, timed.
+static int mt_timed(struct lat* l, short op, int count)
+{
+    double t = now_us();
+    int ret = mt(op, count);
+
+    lat_add(l, now_us() - t, 0);
+    return ret;
+}
+
+static int mt_tell(uint32_t* blkno)
+{
+    struct mtpos pos;
+
+    if (ioctl(tape, MTIOCPOS, &pos) < 0) {
+        return -1;
+    }
+    *blkno = pos.mt_blkno;
+    return 0;
+}
+
+//block 0 variable, otherwise fixed blocks of that size.
+static int mt_setup(unsigned long fixed)
+{
+    if (mt(MTREW, 1) < 0 || mt(MTSETBLK, fixed) < 0) {
+        fprintf(stderr, "kvtape_bench: can't rewind or set block size %lu: %s\n", fixed, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void fill(size_t len)
+{
+    size_t i = 0;
+
+    //not all zero, so dedup and compression don't make it free.
+    for (i = 0; i < len; i += sizeof(uint32_t)) {
+        *(uint32_t*)(buf + i) = (uint32_t)rand();
+    }
+}
+
+/*
+  case_bytes in block sized WRITEs, a filemark after every mark_every of
+  them, then read back. return -1 if the drive failed.
+*/
+static int bench_data(struct lat* l, unsigned long block, int fixed, unsigned long mark_every)
+{
+    const char* mode = fixed ? "fixed" : "variable";
+    uint64_t nr = case_bytes / block;
+    uint64_t i = 0;
+    ssize_t ret = 0;
+
+    if (mt_setup(fixed ? block : 0) < 0) {
+        return -1;
+    }
+    fill(block);
+    lat_begin(l);
+    for (i = 0; i < nr; i++) {
+        double t = now_us();
+
+        ret = write(tape, buf, block);
+        lat_add(l, now_us() - t, ret > 0 ? ret : 0);
+        if (ret != (ssize_t)block) {
+            fprintf(stderr, "kvtape_bench: write %llu: %s\n", (unsigned long long)i, strerror(errno));
+            return -1;
+        }
+        if (mark_every && 0 == (i + 1) % mark_every && mt_timed(l, MTWEOF, 1) < 0) {
+            fprintf(stderr, "kvtape_bench: write filemark: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    //a trailing filemark flushes what the drive still buffers, as closing st would.
+    if (mt_timed(l, MTWEOF, 1) < 0) {
+        return -1;
+    }
+    lat_report(l, "write", mode, block, mark_every);
+
+    if (mt(MTREW, 1) < 0) {
+        return -1;
+    }
+    lat_begin(l);
+    for (i = 0; i < nr;) {
+        double t = now_us();
+
+        ret = read(tape, buf, block);
+        lat_add(l, now_us() - t, ret > 0 ? ret : 0);
+        if (ret < 0) {
+            fprintf(stderr, "kvtape_bench: read %llu: %s\n", (unsigned long long)i, strerror(errno));
+            return -1;
+        }
+        //0 is a filemark crossed.
+        i += ret > 0;
+    }
+    lat_report(l, "read", mode, block, mark_every);
+    return 0;
+}
+
+/*
+  Positioning over a tape of reps files, each the first nonzero filemark
+  frequency (16 if none) of records of the first block size.
+*/
+static int bench_position(struct lat* l)
+{
+    unsigned long block = blocks[0];
+    unsigned long per_file = 16;
+    unsigned long i = 0;
+    unsigned long j = 0;
+    uint32_t objects = 0;
+    uint32_t blkno = 0;
+    int k = 0;
+
+    for (k = 0; k < nr_marks; k++) {
+        if (marks[k]) {
+            per_file = marks[k];
+            break;
+        }
+    }
+    if (mt_setup(0) < 0) {
+        return -1;
+    }
+    fill(block);
+    for (i = 0; i < reps; i++) {
+        for (j = 0; j < per_file; j++) {
+            if (write(tape, buf, block) != (ssize_t)block) {
+                fprintf(stderr, "kvtape_bench: write: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+        if (mt(MTWEOF, 1) < 0) {
+            return -1;
+        }
+    }
+    if (mt_tell(&objects) < 0) {
+        fprintf(stderr, "kvtape_bench: MTIOCPOS: %s\n", strerror(errno));
+        return -1;
+    }
+
+    mt(MTREW, 1);
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (mt_timed(l, MTFSF, 1) < 0) {
+            return -1;
+        }
+    }
+    lat_report(l, "fsf", "variable", block, per_file);
+
+    //BSF stops on the beginning side of the mark, step back over it each time.
+    lat_begin(l);
+    for (i = 1; i < reps; i++) {
+        if (mt_timed(l, MTBSF, 2) < 0 || mt(MTFSF, 1) < 0) {
+            return -1;
+        }
+    }
+    lat_report(l, "bsf", "variable", block, per_file);
+
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (mt(MTREW, 1) < 0 || mt_timed(l, MTEOM, 1) < 0) {
+            return -1;
+        }
+    }
+    lat_report(l, "eod", "variable", block, per_file);
+
+    srand(1);
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (mt_timed(l, MTSEEK, rand() % objects) < 0) {
+            fprintf(stderr, "kvtape_bench: MTSEEK: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    lat_report(l, "locate", "variable", block, per_file);
+
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        double t = now_us();
+
+        if (mt_tell(&blkno) < 0) {
+            return -1;
+        }
+        lat_add(l, now_us() - t, 0);
+    }
+    lat_report(l, "tell", "variable", block, per_file);
+
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (mt(MTSEEK, rand() % objects) < 0 || mt_timed(l, MTREW, 1) < 0) {
+            return -1;
+        }
+    }
+    lat_report(l, "rewind", "variable", block, per_file);
+    return 0;
+}
+
+/*
+  One command through SG_IO. return 0 on GOOD, 1 on CHECK CONDITION with
+  sense in sense[], -1 if it didn't get through.
+*/
+static int sg_cmd(int sg, uint8_t* cdb, int cdb_len, int dir, void* data, unsigned len, uint8_t* sense)
+{
+    struct sg_io_hdr io;
+
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.cmdp = cdb;
+    io.cmd_len = cdb_len;
+    io.dxfer_direction = len ? dir : SG_DXFER_NONE;
+    io.dxferp = data;
+    io.dxfer_len = len;
+    io.sbp = sense;
+    io.mx_sb_len = 32;
+    io.timeout = SG_TIMEOUT_MS;
+    if (ioctl(sg, SG_IO, &io) < 0 || io.host_status) {
+        return -1;
+    }
+    return io.status ? 1 : 0;
+}
+
+static int sg_timed(struct lat* l, int sg, uint8_t* cdb, int cdb_len, int dir, void* data, unsigned len,
+                    uint8_t* sense)
+{
+    double t = now_us();
+    int ret = sg_cmd(sg, cdb, cdb_len, dir, data, len, sense);
+
+    lat_add(l, now_us() - t, 0 == ret ? len : 0);
+    return ret;
+}
+
+//the same through the sg node, none of st's buffering in between.
+static int bench_sg(struct lat* l, const char* path)
+{
+    uint8_t sense[32];
+    uint8_t rewind[6] = {0x01, 0, 0, 0, 0, 0};
+    uint8_t tur[6] = {0x00, 0, 0, 0, 0, 0};
+    uint8_t pos[10] = {0x34, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t rw[6] = {0, 0, 0, 0, 0, 0};
+    uint8_t mark[6] = {0x10, 0, 0, 0, 1, 0};
+    uint8_t data[20];
+    unsigned long i = 0;
+    int sg = open(path, O_RDWR);
+    int b = 0;
+    int ret = 0;
+
+    if (sg < 0) {
+        fprintf(stderr, "kvtape_bench: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (sg_timed(l, sg, tur, 6, SG_DXFER_NONE, NULL, 0, sense) < 0) {
+            goto fail;
+        }
+    }
+    lat_report(l, "sg_tur", "variable", 0, 0);
+
+    lat_begin(l);
+    for (i = 0; i < reps; i++) {
+        if (sg_timed(l, sg, pos, 10, SG_DXFER_FROM_DEV, data, sizeof(data), sense) < 0) {
+            goto fail;
+        }
+    }
+    lat_report(l, "sg_read_position", "variable", 0, 0);
+
+    for (b = 0; b < nr_blocks; b++) {
+        unsigned long block = blocks[b];
+        uint64_t nr = case_bytes / block;
+
+        //WRITE(6) and READ(6) take 24 bit lengths.
+        if (block >= (1UL << 24)) {
+            continue;
+        }
+        rw[2] = (block >> 16) & 0xFF;
+        rw[3] = (block >> 8) & 0xFF;
+        rw[4] = block & 0xFF;
+
+        fill(block);
+        if (sg_cmd(sg, rewind, 6, SG_DXFER_NONE, NULL, 0, sense)) {
+            goto fail;
+        }
+        rw[0] = 0x0A;
+        lat_begin(l);
+        for (i = 0; i < nr; i++) {
+            if (sg_timed(l, sg, rw, 6, SG_DXFER_TO_DEV, buf, block, sense)) {
+                goto fail;
+            }
+        }
+        if (sg_timed(l, sg, mark, 6, SG_DXFER_NONE, NULL, 0, sense)) {
+            goto fail;
+        }
+        lat_report(l, "sg_write", "variable", block, 0);
+
+        if (sg_cmd(sg, rewind, 6, SG_DXFER_NONE, NULL, 0, sense)) {
+            goto fail;
+        }
+        rw[0] = 0x08;
+        lat_begin(l);
+        for (i = 0; i < nr; i++) {
+            ret = sg_timed(l, sg, rw, 6, SG_DXFER_FROM_DEV, buf, block, sense);
+            if (ret) {
+                fprintf(stderr, "kvtape_bench: sg read %lu: sense key 0x%x\n", i, sense[2] & 0x0F);
+                goto fail;
+            }
+        }
+        lat_report(l, "sg_read", "variable", block, 0);
+    }
+    close(sg);
+    return 0;
+
+fail:
+    fprintf(stderr, "kvtape_bench: SG_IO on %s failed\n", path);
+    close(sg);
+    return -1;
+}
+
+static int parse_list(char* str, unsigned long* list)
+{
+    char* tok = NULL;
+    int nr = 0;
+
+    while (NULL != (tok = strsep(&str, ",")) && nr < MAX_LIST) {
+        list[nr++] = strtoul(tok, NULL, 0);
+    }
+    return nr;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [-b block,...] [-n MB] [-m filemark_every,...] [-r reps] [-g /dev/sgN] /dev/nstN\n"
+            "  -b  block sizes of the data cases (65536,262144,1048576)\n"
+            "  -n  MB moved by each data case (256)\n"
+            "  -m  records between filemarks, 0 for none (0,100)\n"
+            "  -r  commands of each positioning case, files on its tape (100)\n"
+            "  -g  sg node of the same drive, adds the SG_IO cases\n"
+            "The tape is overwritten from the beginning.\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    struct lat l;
+    const char* sg = NULL;
+    int opt = 0;
+    int b = 0;
+    int m = 0;
+    int ret = 0;
+
+    memset(&l, 0, sizeof(l));
+    while (-1 != (opt = getopt(argc, argv, "b:n:m:r:g:h"))) {
+        switch (opt) {
+        case 'b':
+            nr_blocks = parse_list(optarg, blocks);
+            break;
+        case 'n':
+            case_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'm':
+            nr_marks = parse_list(optarg, marks);
+            break;
+        case 'r':
+            reps = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            sg = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || 0 == nr_blocks || 0 == nr_marks || 0 == reps) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (b = 0; b < nr_blocks; b++) {
+        if (0 == blocks[b]) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (blocks[b] > buf_len) {
+            buf_len = blocks[b];
+        }
+    }
+    buf = aligned_alloc(4096, (buf_len + 4095) & ~4095UL);
+    if (NULL == buf) {
+        fprintf(stderr, "kvtape_bench: out of memory\n");
+        return 1;
+    }
+    tape = open(argv[optind], O_RDWR);
+    if (tape < 0) {
+        fprintf(stderr, "kvtape_bench: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    for (b = 0; 0 == ret && b < nr_blocks; b++) {
+        for (m = 0; 0 == ret && m < nr_marks; m++) {
+            ret = bench_data(&l, blocks[b], 0, marks[m]);
+            if (0 == ret) {
+                ret = bench_data(&l, blocks[b], 1, marks[m]);
+            }
+        }
+    }
+    if (0 == ret) {
+        ret = bench_position(&l);
+    }
+    mt(MTSETBLK, 0);
+    mt(MTREW, 1);
+    close(tape);
+    //st lets go of the drive first, the sg node shares it.
+    if (0 == ret && sg) {
+        ret = bench_sg(&l, sg);
+    }
+    free(l.us);
+    free(buf);
+    return ret ? 1 : 0;
+}
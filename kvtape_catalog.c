@@ -0,0 +1,406 @@
+/**
+ * @file   kvtape_catalog.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 09:40:05 2026
+ *
+ * @brief  Tar member catalog built from the WRITE stream.
+ *
+ * The parser walks the stream in 512 byte tar blocks: a header, then its
+ * data rounded up to 512, then the next header. Headers may straddle two
+ * WRITEs. Anything that is not a valid ustar header with a good checksum
+ * is ignored, so non-tar data costs one compare per 512 bytes.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include "kernel_fop.h"
+#include "kvtape_catalog.h"
+
+#define CAT_WBUF_SIZE (64 * 1024)
+#define CAT_LINE_MAX (KVTAPE_CATALOG_NAME_MAX + 64)
+#define CAT_SCAN (2 * CAT_LINE_MAX) //binary search stops below this
+
+static int64_t tar_number(const char* field, int len)
+{
+    int64_t val = 0;
+    int i = 0;
+
+    //GNU base-256 for values that don't fit the octal field.
+    if (field[0] & 0x80) {
+        for (i = 1; i < len; i++) {
+            val = (val << 8) | (uint8_t)field[i];
+        }
+        return val;
+    }
+    for (i = 0; i < len && ' ' == field[i]; i++);
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        val = (val << 3) + (field[i] - '0');
+    }
+    return val;
+}
+
+static int tar_header_valid(const char* hdr)
+{
+    uint32_t sum = 0;
+    int i = 0;
+
+    if (memcmp(hdr + 257, "ustar", 5)) {
+        return 0;
+    }
+    for (i = 0; i < 512; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : (uint8_t)hdr[i];
+    }
+    return sum == tar_number(hdr + 148, 8);
+}
+
+static int block_is_zero(const char* blk)
+{
+    int i = 0;
+    for (i = 0; i < 512; i++) {
+        if (blk[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int kvtape_catalog_flush(struct kvtape_catalog* cat)
+{
+    int ret = 0;
+
+    if (0 == cat->wlen) {
+        return 0;
+    }
+    ret = kernel_file_pwrite(cat->fd, cat->wbuf, cat->wlen, cat->size);
+    if (ret != (int)cat->wlen) {
+        printk("\nkvtape catalog write returned %d/%u\n", ret, cat->wlen);
+        return -EIO;
+    }
+    cat->size += cat->wlen;
+    cat->wlen = 0;
+    return 0;
+}
+
+static void catalog_emit(struct kvtape_catalog* cat, int64_t size, const char* name)
+{
+    char* line = NULL;
+    int len = 0;
+    int i = 0;
+
+    if (cat->wlen + CAT_LINE_MAX > CAT_WBUF_SIZE) {
+        kvtape_catalog_flush(cat);
+    }
+    line = cat->wbuf + cat->wlen;
+    len = snprintf(line, CAT_LINE_MAX, "%010u %u %lld %s\n", cat->first_blk, cat->first_off,
+                   (long long)size, name);
+    if (len >= CAT_LINE_MAX) {
+        len = CAT_LINE_MAX - 1;
+        line[len - 1] = '\n';
+    }
+    //one member per line.
+    for (i = 0; i < len - 1; i++) {
+        if ('\n' == line[i]) {
+            line[i] = '?';
+        }
+    }
+    cat->wlen += len;
+}
+
+//pax records are "<len> <key>=<value>\n"; only path matters here.
+static void pax_path(struct kvtape_catalog* cat)
+{
+    char* p = cat->ext;
+    char* end = cat->ext + cat->ext_have;
+
+    while (p < end) {
+        char* key = NULL;
+        unsigned long len = simple_strtoul(p, &key, 10);
+
+        if (0 == len || p + len > end || ' ' != *key) {
+            return;
+        }
+        key++;
+        if (!strncmp(key, "path=", 5)) {
+            uint32_t n = p + len - (key + 5) - 1;
+            if (n >= KVTAPE_CATALOG_NAME_MAX) {
+                n = KVTAPE_CATALOG_NAME_MAX - 1;
+            }
+            memcpy(cat->name, key + 5, n);
+            cat->name[n] = 0;
+        }
+        p += len;
+    }
+}
+
+static void catalog_ext_done(struct kvtape_catalog* cat)
+{
+    if ('L' == cat->ext_type) {
+        uint32_t n = cat->ext_have < KVTAPE_CATALOG_NAME_MAX ? cat->ext_have : KVTAPE_CATALOG_NAME_MAX - 1;
+        memcpy(cat->name, cat->ext, n);
+        cat->name[n] = 0;
+    } else {
+        pax_path(cat);
+    }
+    cat->ext_type = 0;
+}
+
+static void catalog_header(struct kvtape_catalog* cat)
+{
+    const char* hdr = cat->hdr;
+    int64_t size = 0;
+    char type = 0;
+
+    if (block_is_zero(hdr) || !tar_header_valid(hdr)) {
+        return;
+    }
+    size = tar_number(hdr + 124, 12);
+    if (size < 0) {
+        return;
+    }
+    type = hdr[156];
+    if (!cat->have_first) {
+        cat->have_first = 1;
+        cat->first_blk = cat->hdr_blk;
+        cat->first_off = cat->hdr_off;
+    }
+
+    switch (type) {
+    case 'L'://GNU long name
+    case 'x'://pax extended header
+        cat->ext_type = type;
+        cat->ext_len = size < KVTAPE_CATALOG_NAME_MAX ? size : KVTAPE_CATALOG_NAME_MAX;
+        cat->ext_have = 0;
+        cat->skip = (size + 511) & ~511LL;
+        if (0 == cat->skip) {
+            catalog_ext_done(cat);
+        }
+        return;
+
+    case 'g'://pax global header, not a member
+        cat->have_first = 0;
+        cat->skip = (size + 511) & ~511LL;
+        return;
+
+    case 'K'://GNU long link name, belongs to the next header
+        cat->skip = (size + 511) & ~511LL;
+        return;
+
+    default:
+        break;
+    }
+
+    if (0 == cat->name[0]) {
+        //prefix/name, both NUL terminated only if shorter than the field.
+        int plen = strnlen(hdr + 345, 155);
+        int nlen = strnlen(hdr, 100);
+        int len = 0;
+
+        if (plen && memcmp(hdr + 257, "ustar\0", 6) == 0) {
+            memcpy(cat->name, hdr + 345, plen);
+            cat->name[plen] = '/';
+            len = plen + 1;
+        }
+        memcpy(cat->name + len, hdr, nlen);
+        cat->name[len + nlen] = 0;
+    }
+    catalog_emit(cat, size, cat->name);
+    cat->name[0] = 0;
+    cat->have_first = 0;
+
+    //links, devices, directories and fifos carry no data.
+    cat->skip = (type >= '1' && type <= '6') ? 0 : (size + 511) & ~511LL;
+}
+
+/**
+ * Run the payload of logical block blkno through the parser.
+ */
+void kvtape_catalog_feed(struct kvtape_catalog* cat, uint32_t blkno, const char* data, uint32_t len)
+{
+    uint32_t off = 0;
+
+    if (cat->fd < 0) {
+        return;
+    }
+    while (off < len) {
+        uint32_t n = 0;
+
+        if (cat->skip) {
+            n = cat->skip < len - off ? cat->skip : len - off;
+            if (cat->ext_type && cat->ext_have < cat->ext_len) {
+                uint32_t c = cat->ext_len - cat->ext_have < n ? cat->ext_len - cat->ext_have : n;
+                memcpy(cat->ext + cat->ext_have, data + off, c);
+                cat->ext_have += c;
+            }
+            cat->skip -= n;
+            off += n;
+            if (0 == cat->skip && cat->ext_type) {
+                catalog_ext_done(cat);
+            }
+            continue;
+        }
+
+        if (0 == cat->partial) {
+            cat->hdr_blk = blkno;
+            cat->hdr_off = off;
+        }
+        n = 512 - cat->partial < len - off ? 512 - cat->partial : len - off;
+        memcpy(cat->hdr + cat->partial, data + off, n);
+        cat->partial += n;
+        off += n;
+        if (512 == cat->partial) {
+            cat->partial = 0;
+            catalog_header(cat);
+        }
+    }
+}
+
+//block number of the line starting at offset, or -1.
+static int64_t catalog_line_blk(struct kvtape_catalog* cat, char* buf, loff_t offset)
+{
+    int ret = kernel_file_pread(cat->fd, buf, 10, offset);
+    char* end = NULL;
+    unsigned long blk = 0;
+
+    if (10 != ret) {
+        return -1;
+    }
+    buf[10] = 0;
+    blk = simple_strtoul(buf, &end, 10);
+    return end == buf ? -1 : (int64_t)blk;
+}
+
+//start of the first line at or after offset, or -1.
+static loff_t catalog_next_line(struct kvtape_catalog* cat, char* buf, loff_t offset)
+{
+    int ret = 0;
+    int i = 0;
+
+    if (0 == offset) {
+        return 0;
+    }
+    ret = kernel_file_pread(cat->fd, buf, CAT_LINE_MAX, offset - 1);
+    for (i = 0; i < ret; i++) {
+        if ('\n' == buf[i]) {
+            return offset + i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Sidecar bytes holding the lines of blocks before blkno. Lines are in
+ * block order, so the cut is found by bisection. Buffered lines must
+ * have been flushed.
+ *
+ * @return the offset, negative on error.
+ */
+loff_t kvtape_catalog_offset(struct kvtape_catalog* cat, uint32_t blkno)
+{
+    char* buf = NULL;
+    loff_t lo = 0;
+    loff_t hi = 0;
+
+    buf = vmalloc(CAT_SCAN + 1);
+    if (NULL == buf) {
+        return -ENOMEM;
+    }
+
+    //lo: a line of a block before blkno (or 0), hi: a line of blkno or later (or the end).
+    hi = cat->size;
+    while (hi - lo > CAT_SCAN) {
+        loff_t line = catalog_next_line(cat, buf, lo + (hi - lo) / 2);
+        int64_t blk = line < 0 ? -1 : catalog_line_blk(cat, buf, line);
+
+        if (blk < 0) {
+            break;
+        }
+        if (blk >= blkno) {
+            hi = line;
+        } else {
+            lo = line;
+        }
+    }
+    //walk the lines left.
+    while (lo < hi) {
+        int64_t blk = catalog_line_blk(cat, buf, lo);
+        loff_t next = 0;
+
+        if (blk < 0 || blk >= blkno) {
+            break;
+        }
+        next = catalog_next_line(cat, buf, lo + 1);
+        lo = next < 0 ? hi : next;
+    }
+    vfree(buf);
+    return lo;
+}
+
+/**
+ * Drop the lines of blocks from blkno on: the tape is being rewritten
+ * there.
+ */
+void kvtape_catalog_truncate(struct kvtape_catalog* cat, uint32_t blkno)
+{
+    loff_t lo = 0;
+
+    if (cat->fd < 0) {
+        return;
+    }
+    //restart parsing with the next WRITE.
+    cat->skip = 0;
+    cat->partial = 0;
+    cat->have_first = 0;
+    cat->ext_type = 0;
+    cat->name[0] = 0;
+
+    kvtape_catalog_flush(cat);
+    lo = kvtape_catalog_offset(cat, blkno);
+    if (lo >= 0 && lo < cat->size) {
+        kernel_file_truncate(cat->fd, lo);
+        cat->size = lo;
+    }
+}
+
+int kvtape_catalog_init(struct kvtape_catalog* cat, const char* image)
+{
+    char* path = NULL;
+
+    memset(cat, 0, sizeof(*cat));
+    cat->fd = -1;
+    cat->wbuf = vmalloc(CAT_WBUF_SIZE);
+    cat->ext = kmalloc(KVTAPE_CATALOG_NAME_MAX, GFP_KERNEL);
+    cat->name = kzalloc(KVTAPE_CATALOG_NAME_MAX + 256, GFP_KERNEL);
+    path = kasprintf(GFP_KERNEL, "%s.cat", image);
+    if (NULL == cat->wbuf || NULL == cat->ext || NULL == cat->name || NULL == path) {
+        kfree(path);
+        kvtape_catalog_exit(cat);
+        return -ENOMEM;
+    }
+
+    cat->fd = kernel_file_open(path, O_RDWR|O_CREAT);
+    if (cat->fd < 0) {
+        printk("\nkvtape catalog %s can't be opened, cataloging off\n", path);
+    } else {
+        cat->size = kernel_file_size(cat->fd);
+    }
+    kfree(path);
+    return 0;
+}
+
+void kvtape_catalog_exit(struct kvtape_catalog* cat)
+{
+    if (cat->fd >= 0) {
+        kvtape_catalog_flush(cat);
+        kernel_file_close(cat->fd);
+        cat->fd = -1;
+    }
+    vfree(cat->wbuf);
+    kfree(cat->ext);
+    kfree(cat->name);
+    cat->wbuf = NULL;
+    cat->ext = NULL;
+    cat->name = NULL;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file   kvtape_catalog.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 09:31:20 2026
+ *
+ * @brief  Tar member catalog built from the WRITE stream.
+ *
+ * With catalog=1 every tar (ustar, GNU or pax) member header going by in
+ * a WRITE is noted in a sidecar next to the image, "<image>.cat", one
+ * line per member:
+ *
+ *     <block> <offset> <size> <name>
+ *
+ * block is the logical block holding the member's first header (the long
+ * name or pax header if there is one), offset the byte offset of that
+ * header inside the block, size the member's data size. Lines are in
+ * block order; rewriting the tape in the middle cuts the sidecar at the
+ * same block.
+ *
+ */
+
+#ifndef KVTAPE_CATALOG_H__
+#define KVTAPE_CATALOG_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_CATALOG_NAME_MAX 4096
+
+struct kvtape_catalog {
+    int fd;             //sidecar, -1 if cataloging is off
+    loff_t size;        //sidecar bytes on disk
+    char* wbuf;         //lines not written yet
+    uint32_t wlen;
+
+    //parser state, carried from one WRITE to the next.
+    loff_t skip;        //member data still to go by before the next header
+    char hdr[512];      //header block being assembled
+    uint32_t partial;   //bytes of it seen so far
+    uint32_t hdr_blk;   //where it started
+    uint32_t hdr_off;
+    int have_first;     //first_* set by an extended header
+    uint32_t first_blk;
+    uint32_t first_off;
+    char ext_type;      //'L' or 'x' data being collected, 0 if none
+    uint32_t ext_len;
+    uint32_t ext_have;
+    char* ext;          //long name or pax records
+    char* name;         //name taken from them, "" if none
+};
+
+int kvtape_catalog_init(struct kvtape_catalog* cat, const char* image);
+void kvtape_catalog_exit(struct kvtape_catalog* cat);
+void kvtape_catalog_feed(struct kvtape_catalog* cat, uint32_t blkno, const char* data, uint32_t len);
+int kvtape_catalog_flush(struct kvtape_catalog* cat);
+void kvtape_catalog_truncate(struct kvtape_catalog* cat, uint32_t blkno);
+loff_t kvtape_catalog_offset(struct kvtape_catalog* cat, uint32_t blkno);
+
+#endif
@@ -0,0 +1,431 @@
+/**
+ * @file   kvtape_clone.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Tue Oct 20 10:02:44 2026
+ *
+ * @brief  Cartridge clones and snapshots taken while the drive runs.
+ *
+ * Each stripe is copied by a kernel thread; the kernels this builds on
+ * can't share extents between files, so there is no reflink. Appends
+ * land behind the snapshot and don't disturb the copy. The only thing
+ * that could is rewriting the tape inside the snapshot, so that is
+ * refused until the copy is through (kvtape_clone_guard).
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <asm/uaccess.h>
+#include "kernel_fop.h"
+#include "kvtape.h"
+#include "kvtape_clone.h"
+
+#define CLONE_COPY_SIZE (1024 * 1024)
+
+struct kvtape_clone {
+    struct kvtape_drive* drive;
+    struct dentry* file;
+    struct mutex lock;              //one clone request at a time
+    char dst[256];
+    int nr_stripes;
+    int fds[KVTAPE_MAX_STRIPES];
+    int filemark;                   //snapshot up to this filemark, 0 for EOD
+
+    //taken on the drive's command thread.
+    struct work_struct work;
+    struct completion captured;
+    uint32_t blkno;                 //EOD of the snapshot
+    int src[KVTAPE_MAX_STRIPES];    //stripes of the snapshot
+    int cat_fd;
+    loff_t end[KVTAPE_MAX_STRIPES]; //stripe bytes in the snapshot
+    loff_t cat_len;                 //catalog bytes in the snapshot
+    char* dir;                      //packed: last container's directory, cut at blkno
+    loff_t dir_off;
+
+    //copy thread.
+    struct task_struct* task;
+    struct completion exited;
+    int active;                     //copy running, the snapshot must stay put
+    loff_t copied;
+    loff_t total;
+    int err;
+};
+
+//block behind the n-th filemark, or -1 if there are fewer.
+static int64_t clone_filemark(struct kvtape_drive* drive, int n)
+{
+    uint32_t i = 0;
+
+    for (i = 0; i < drive->index.count; i++) {
+        struct kvtape_rec* rec = kvtape_index_get(&drive->index, i);
+        if (FILEMARK == rec->type && 0 == --n) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/*
+  Runs on the command thread, between two commands: everything before the
+  snapshot point is on the image once outstanding I/O has landed.
+*/
+static void clone_capture(struct work_struct* work)
+{
+    struct kvtape_clone* clone = container_of(work, struct kvtape_clone, work);
+    struct kvtape_drive* drive = clone->drive;
+    struct kvtape_index* idx = &drive->index;
+    int64_t blkno = idx->count;
+    int i = 0;
+
+    kvtape_drive_drain(drive);
+    if (drive->pack.size) {
+        kvtape_pack_flush(drive);
+    }
+    kvtape_catalog_flush(&drive->catalog);
+    kvtape_dedup_flush(&drive->dedup);
+
+    //the other partitions would be missing from the clone.
+    if (drive->layout.nr_parts > 1) {
+        clone->err = -EOPNOTSUPP;
+        goto out;
+    }
+    if (clone->filemark) {
+        blkno = clone_filemark(drive, clone->filemark);
+        if (blkno < 0) {
+            clone->err = -ENOENT;
+            goto out;
+        }
+    }
+    clone->blkno = blkno;
+    clone->dir_off = -1;
+    clone->total = 0;
+
+    if (drive->pack.size) {
+        clone->end[0] = kvtape_pack_snapshot(drive, blkno, clone->dir, &clone->dir_off);
+        if (clone->end[0] < 0) {
+            clone->err = clone->end[0];
+            goto out;
+        }
+    } else {
+        //stripe i holds the blocks before blkno up to its first block from blkno on.
+        for (i = 0; i < drive->nr_stripes; i++) {
+            uint32_t first = blkno + (i - blkno % drive->nr_stripes + drive->nr_stripes) % drive->nr_stripes;
+            clone->end[i] = kvtape_index_offset(idx, first);
+        }
+    }
+    for (i = 0; i < drive->nr_stripes; i++) {
+        loff_t size = kernel_file_size(drive->stripes[i].fd);
+
+        clone->src[i] = drive->stripes[i].fd;
+        if (clone->end[i] > size) {
+            clone->end[i] = size;
+        }
+        clone->total += clone->end[i];
+    }
+    clone->cat_fd = drive->catalog.fd;
+    clone->cat_len = drive->catalog.fd < 0 ? 0 : kvtape_catalog_offset(&drive->catalog, blkno);
+    if (clone->cat_len < 0) {
+        clone->err = clone->cat_len;
+        goto out;
+    }
+    clone->active = 1;
+
+ out:
+    complete(&clone->captured);
+}
+
+static int clone_copy(struct kvtape_clone* clone, int dst, int src, loff_t len, char* buf)
+{
+    loff_t off = 0;
+
+    while (off < len) {
+        int n = len - off < CLONE_COPY_SIZE ? len - off : CLONE_COPY_SIZE;
+        int ret = kernel_file_pread(src, buf, n, off);
+
+        if (ret <= 0) {
+            return ret < 0 ? ret : -EIO;
+        }
+        if (kernel_file_pwrite(dst, buf, ret, off) != ret) {
+            return -EIO;
+        }
+        off += ret;
+        clone->copied += ret;
+    }
+    return 0;
+}
+
+//the catalog goes next to the first stripe of the clone.
+static int clone_catalog(struct kvtape_clone* clone, char* buf)
+{
+    char* path = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    if (clone->cat_len <= 0) {
+        return 0;
+    }
+    path = kasprintf(GFP_KERNEL, "%.*s.cat", (int)strcspn(clone->dst, ":"), clone->dst);
+    if (NULL == path) {
+        return -ENOMEM;
+    }
+    fd = kernel_file_open(path, O_RDWR|O_CREAT);
+    kfree(path);
+    if (fd < 0) {
+        return -ENOENT;
+    }
+    ret = kernel_file_truncate(fd, 0);
+    if (0 == ret) {
+        ret = clone_copy(clone, fd, clone->cat_fd, clone->cat_len, buf);
+    }
+    kernel_file_close(fd);
+    return ret;
+}
+
+static int clone_thread(void* data)
+{
+    struct kvtape_clone* clone = (struct kvtape_clone*)data;
+    struct kvtape_drive* drive = clone->drive;
+    char* buf = NULL;
+    int ret = 0;
+    int i = 0;
+
+    buf = vmalloc(CLONE_COPY_SIZE);
+    if (NULL == buf) {
+        ret = -ENOMEM;
+    }
+    for (i = 0; i < clone->nr_stripes && 0 == ret; i++) {
+        ret = clone_copy(clone, clone->fds[i], clone->src[i], clone->end[i], buf);
+    }
+    //the records of the last container behind the snapshot point are dropped.
+    if (0 == ret && clone->dir_off >= 0 &&
+        kernel_file_pwrite(clone->fds[0], clone->dir, KVTAPE_PACK_DIR, clone->dir_off) != KVTAPE_PACK_DIR) {
+        ret = -EIO;
+    }
+    if (0 == ret) {
+        ret = clone_catalog(clone, buf);
+    }
+    vfree(buf);
+
+    for (i = 0; i < clone->nr_stripes; i++) {
+        kernel_file_close(clone->fds[i]);
+        clone->fds[i] = -1;
+    }
+    printk("\nkvtape drive%d clone to %s %s\n", drive->id, clone->dst, ret ? "failed" : "done");
+    clone->err = ret;
+    smp_wmb();
+    clone->active = 0;
+    complete_and_exit(&clone->exited, 0);
+}
+
+static void clone_close(struct kvtape_clone* clone)
+{
+    int i = 0;
+
+    for (i = 0; i < clone->nr_stripes; i++) {
+        kernel_file_close(clone->fds[i]);
+        clone->fds[i] = -1;
+    }
+    clone->nr_stripes = 0;
+}
+
+//open and empty one destination per stripe.
+static int clone_open(struct kvtape_clone* clone)
+{
+    struct kvtape_drive* drive = clone->drive;
+    char* paths = kstrdup(clone->dst, GFP_KERNEL);
+    char* cur = paths;
+    char* p = NULL;
+    int ret = 0;
+
+    if (NULL == paths) {
+        return -ENOMEM;
+    }
+    clone->nr_stripes = 0;
+    while (0 == ret && NULL != (p = strsep(&cur, ":"))) {
+        int fd = -1;
+
+        if (clone->nr_stripes == drive->nr_stripes) {
+            ret = -EINVAL;
+            break;
+        }
+        fd = kernel_file_open(p, O_RDWR|O_CREAT);
+        if (fd < 0) {
+            ret = -ENOENT;
+            break;
+        }
+        clone->fds[clone->nr_stripes++] = fd;
+        if (kernel_file_same(fd, drive->stripes[clone->nr_stripes - 1].fd)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = kernel_file_truncate(fd, 0);
+    }
+    kfree(paths);
+    if (0 == ret && clone->nr_stripes != drive->nr_stripes) {
+        ret = -EINVAL;
+    }
+    if (ret) {
+        clone_close(clone);
+    }
+    return ret;
+}
+
+static ssize_t clone_write(struct file* file, const char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_clone* clone = file->f_path.dentry->d_inode->i_private;
+    struct kvtape_drive* drive = clone->drive;
+    char buf[sizeof(clone->dst) + 16];
+    char* mark = NULL;
+    int ret = 0;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, ubuf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = 0;
+    strim(buf);
+    mark = strchr(buf, ' ');
+    if (mark) {
+        *mark++ = 0;
+    }
+    if (0 == buf[0]) {
+        return -EINVAL;
+    }
+    if (strlen(buf) >= sizeof(clone->dst)) {
+        return -ENAMETOOLONG;
+    }
+
+    mutex_lock(&clone->lock);
+    if (clone->active) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (clone->task) {
+        wait_for_completion(&clone->exited);
+        clone->task = NULL;
+    }
+    strcpy(clone->dst, buf);
+    clone->filemark = mark ? simple_strtoul(mark, NULL, 10) : 0;
+    clone->err = 0;
+    clone->copied = 0;
+    ret = clone_open(clone);
+    if (ret) {
+        goto out;
+    }
+
+    INIT_WORK(&clone->work, clone_capture);
+    init_completion(&clone->captured);
+    queue_work(drive->cmd_wq, &clone->work);
+    wait_for_completion(&clone->captured);
+    if (clone->err) {
+        ret = clone->err;
+        clone_close(clone);
+        goto out;
+    }
+
+    init_completion(&clone->exited);
+    clone->task = kthread_run(clone_thread, clone, "kvtape%d_clone", drive->id);
+    if (IS_ERR(clone->task)) {
+        ret = PTR_ERR(clone->task);
+        clone->task = NULL;
+        clone->active = 0;
+        clone_close(clone);
+    }
+
+ out:
+    mutex_unlock(&clone->lock);
+    return ret ? ret : count;
+}
+
+static ssize_t clone_read(struct file* file, char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_clone* clone = file->f_path.dentry->d_inode->i_private;
+    char buf[sizeof(clone->dst) + 64];
+    int len = 0;
+
+    if (clone->active) {
+        len = snprintf(buf, sizeof(buf), "copying %s %lld/%lld\n", clone->dst,
+                       (long long)clone->copied, (long long)clone->total);
+    } else if (NULL == clone->task) {
+        len = snprintf(buf, sizeof(buf), "idle\n");
+    } else if (clone->err) {
+        len = snprintf(buf, sizeof(buf), "failed %s %d\n", clone->dst, clone->err);
+    } else {
+        len = snprintf(buf, sizeof(buf), "done %s\n", clone->dst);
+    }
+    return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static const struct file_operations clone_fops = {
+    .owner = THIS_MODULE,
+    .read = clone_read,
+    .write = clone_write,
+};
+
+int kvtape_clone_init(struct kvtape_drive* drive)
+{
+    struct kvtape_clone* clone = (struct kvtape_clone*)kzalloc(sizeof(struct kvtape_clone), GFP_KERNEL);
+
+    if (NULL == clone) {
+        return -ENOMEM;
+    }
+    clone->drive = drive;
+    mutex_init(&clone->lock);
+    clone->dir = vmalloc(KVTAPE_PACK_DIR);
+    if (NULL == clone->dir) {
+        kfree(clone);
+        return -ENOMEM;
+    }
+    if (drive->dbg_dir) {
+        clone->file = debugfs_create_file("clone", S_IRUSR | S_IWUSR, drive->dbg_dir, clone, &clone_fops);
+    }
+    drive->clone = clone;
+    return 0;
+}
+
+void kvtape_clone_exit(struct kvtape_drive* drive)
+{
+    struct kvtape_clone* clone = drive->clone;
+
+    if (NULL == clone) {
+        return;
+    }
+    debugfs_remove(clone->file);
+    mutex_lock(&clone->lock);
+    if (clone->task) {
+        wait_for_completion(&clone->exited);
+        clone->task = NULL;
+    }
+    mutex_unlock(&clone->lock);
+    vfree(clone->dir);
+    kfree(clone);
+    drive->clone = NULL;
+}
+
+/**
+ * Called before the image is changed from block blkno on, i.e. the tape
+ * is rewritten there. The command thread can't wait for the copy, which
+ * may take minutes, so the caller fails the command instead.
+ *
+ * @return 0, or -EBUSY while a copy whose snapshot reaches past blkno runs.
+ */
+int kvtape_clone_guard(struct kvtape_drive* drive, uint32_t blkno)
+{
+    struct kvtape_clone* clone = drive->clone;
+
+    if (NULL == clone || !clone->active || blkno >= clone->blkno) {
+        return 0;
+    }
+    printk("\nkvtape drive%d rewrite at %u refused, the clone is running\n", drive->id, blkno);
+    return -EBUSY;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file   kvtape_clone.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Tue Oct 20 09:46:18 2026
+ *
+ * @brief  Cartridge clones and snapshots taken while the drive runs.
+ *
+ * Writing "<dst>[:<dst>...] [filemark]" to debugfs kvtape/driveN/clone
+ * copies the cartridge up to its current EOD, or up to and including its
+ * n-th filemark, to dst (one path per stripe), catalog included. The
+ * snapshot point is taken between two commands; the copy itself goes on
+ * in the background while the drive keeps working. Reading the file
+ * tells how far it got.
+ *
+ */
+
+#ifndef KVTAPE_CLONE_H__
+#define KVTAPE_CLONE_H__
+
+#include <linux/types.h>
+
+struct kvtape_drive;
+
+int kvtape_clone_init(struct kvtape_drive* drive);
+void kvtape_clone_exit(struct kvtape_drive* drive);
+int kvtape_clone_guard(struct kvtape_drive* drive, uint32_t blkno);
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * @file   kvtape_crypt.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 17:13:26 2026
+ *
+ * @brief  AES-GCM record encryption, keyed by SECURITY PROTOCOL OUT.
+ *
+ * Records are sealed and opened in place through the async AEAD
+ * interface, so a hardware or multi-buffer gcm(aes) works on several
+ * records at once while earlier ones are being written.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/err.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <crypto/aead.h>
+#include "kvtape_crypt.h"
+
+struct crypt_op {
+    struct aead_request* req;
+    struct sg_table table;
+    struct scatterlist assoc;
+    __le32 blkno;               //associated data
+    kvtape_crypt_done_t done;
+    void* priv;
+};
+
+/**
+ * Install an AES key of len bytes (16, 24 or 32), replacing the old one.
+ */
+int kvtape_crypt_set_key(struct kvtape_crypt* crypt, const u8* key, unsigned int len)
+{
+    struct crypto_aead* tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
+    int ret = 0;
+
+    if (IS_ERR(tfm)) {
+        printk("\nkvtape gcm(aes) is not available, error %ld\n", PTR_ERR(tfm));
+        return PTR_ERR(tfm);
+    }
+    ret = crypto_aead_setkey(tfm, key, len);
+    if (0 == ret) {
+        ret = crypto_aead_setauthsize(tfm, KVTAPE_CRYPT_TAG);
+    }
+    if (ret) {
+        crypto_free_aead(tfm);
+        return ret;
+    }
+    kvtape_crypt_clear(crypt);
+    crypt->tfm = tfm;
+    get_random_bytes(&crypt->salt, sizeof(crypt->salt));
+    get_random_bytes(&crypt->seq, sizeof(crypt->seq));
+    return 0;
+}
+
+void kvtape_crypt_clear(struct kvtape_crypt* crypt)
+{
+    if (crypt->tfm) {
+        crypto_free_aead(crypt->tfm);
+        crypt->tfm = NULL;
+    }
+}
+
+static void crypt_op_done(struct crypto_async_request* areq, int err)
+{
+    struct crypt_op* op = (struct crypt_op*)areq->data;
+
+    //taken off the backlog, the real completion follows.
+    if (-EINPROGRESS == err) {
+        return;
+    }
+    op->done(op->priv, err);
+    sg_free_table(&op->table);
+    aead_request_free(op->req);
+    kfree(op);
+}
+
+//records can be vmalloc'ed, so they are mapped a page at a time.
+static int crypt_map(struct sg_table* table, char* buf, __u32 len)
+{
+    struct scatterlist* sg = NULL;
+    int nents = (offset_in_page(buf) + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    int i = 0;
+
+    if (sg_alloc_table(table, nents, GFP_KERNEL)) {
+        return -ENOMEM;
+    }
+    for_each_sg(table->sgl, sg, nents, i) {
+        unsigned int off = offset_in_page(buf);
+        unsigned int n = min_t(__u32, PAGE_SIZE - off, len);
+
+        sg_set_page(sg, is_vmalloc_addr(buf) ? vmalloc_to_page(buf) : virt_to_page(buf), n, off);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void crypt_start(struct kvtape_crypt* crypt, char* rec, __u32 cryptlen, __u32 blkno, int enc,
+                        kvtape_crypt_done_t done, void* priv)
+{
+    struct crypt_op* op = kmalloc(sizeof(struct crypt_op), GFP_KERNEL);
+    int ret = 0;
+
+    if (NULL == op) {
+        done(priv, -ENOMEM);
+        return;
+    }
+    op->req = aead_request_alloc(crypt->tfm, GFP_KERNEL);
+    //in place; the tag follows the ciphertext.
+    if (NULL == op->req ||
+        crypt_map(&op->table, rec + KVTAPE_CRYPT_IV, enc ? cryptlen + KVTAPE_CRYPT_TAG : cryptlen)) {
+        if (op->req) {
+            aead_request_free(op->req);
+        }
+        kfree(op);
+        done(priv, -ENOMEM);
+        return;
+    }
+    op->done = done;
+    op->priv = priv;
+    op->blkno = cpu_to_le32(blkno);
+
+    sg_init_one(&op->assoc, &op->blkno, sizeof(op->blkno));
+    aead_request_set_callback(op->req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+                              crypt_op_done, op);
+    aead_request_set_assoc(op->req, &op->assoc, sizeof(op->blkno));
+    aead_request_set_crypt(op->req, op->table.sgl, op->table.sgl, cryptlen, rec);
+
+    ret = enc ? crypto_aead_encrypt(op->req) : crypto_aead_decrypt(op->req);
+    if (-EINPROGRESS == ret || -EBUSY == ret) {
+        return;
+    }
+    crypt_op_done(&op->req->base, ret);
+}
+
+/**
+ * Encrypt the len byte record at rec + KVTAPE_CRYPT_IV; the IV is written
+ * in front of it and the tag behind it.
+ */
+void kvtape_crypt_seal(struct kvtape_crypt* crypt, char* rec, __u32 len, __u32 blkno,
+                       kvtape_crypt_done_t done, void* priv)
+{
+    __be64 seq = cpu_to_be64(crypt->seq++);
+
+    memcpy(rec, &crypt->salt, sizeof(crypt->salt));
+    memcpy(rec + sizeof(crypt->salt), &seq, sizeof(seq));
+    crypt_start(crypt, rec, len, blkno, 1, done, priv);
+}
+
+/**
+ * Decrypt and authenticate the len byte payload of an encrypted record;
+ * the plain record is left at rec + KVTAPE_CRYPT_IV.
+ */
+void kvtape_crypt_open(struct kvtape_crypt* crypt, char* rec, __u32 len, __u32 blkno,
+                       kvtape_crypt_done_t done, void* priv)
+{
+    if (len < KVTAPE_CRYPT_OVERHEAD) {
+        done(priv, -EBADMSG);
+        return;
+    }
+    crypt_start(crypt, rec, len - KVTAPE_CRYPT_IV, blkno, 0, done, priv);
+}
@@ -0,0 +1,63 @@
+/**
+ * @file   kvtape_crypt.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 17:05:52 2026
+ *
+ * @brief  AES-GCM record encryption, keyed by SECURITY PROTOCOL OUT.
+ *
+ * An encrypted record is a stream record whose length header has
+ * KVTAPE_CRYPT_FLAG set; its payload is
+ *
+ *   [12 byte IV][ciphertext][16 byte GCM tag]
+ *
+ * with the logical block number as associated data, so a record moved to
+ * another position fails authentication. The IV is a random salt followed
+ * by a counter, both drawn anew with every key.
+ *
+ */
+
+#ifndef KVTAPE_CRYPT_H__
+#define KVTAPE_CRYPT_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_CRYPT_FLAG     0x20000000 //in the stream header of an encrypted record
+#define KVTAPE_CRYPT_IV       12
+#define KVTAPE_CRYPT_TAG      16
+#define KVTAPE_CRYPT_OVERHEAD (KVTAPE_CRYPT_IV + KVTAPE_CRYPT_TAG)
+
+//modes of the Set Data Encryption page.
+#define KVTAPE_ENCRYPT_DISABLE 0
+#define KVTAPE_ENCRYPT_ENCRYPT 2
+#define KVTAPE_DECRYPT_DISABLE 0
+#define KVTAPE_DECRYPT_DECRYPT 2    //plain records are an error
+#define KVTAPE_DECRYPT_MIXED   3    //plain records are returned as they are
+
+#ifdef __KERNEL__
+
+struct crypto_aead;
+
+struct kvtape_crypt {
+    struct crypto_aead* tfm;    //NULL while no key is set
+    int encrypt;                //KVTAPE_ENCRYPT_*
+    int decrypt;                //KVTAPE_DECRYPT_*
+    __u32 salt;
+    __u64 seq;
+};
+
+/*
+  done() gets 0, or -EBADMSG if the record does not authenticate. It may
+  be called before kvtape_crypt_seal/open return, or later from softirq.
+*/
+typedef void (*kvtape_crypt_done_t)(void* priv, int err);
+
+int kvtape_crypt_set_key(struct kvtape_crypt* crypt, const u8* key, unsigned int len);
+void kvtape_crypt_clear(struct kvtape_crypt* crypt);
+void kvtape_crypt_seal(struct kvtape_crypt* crypt, char* rec, __u32 len, __u32 blkno,
+                       kvtape_crypt_done_t done, void* priv);
+void kvtape_crypt_open(struct kvtape_crypt* crypt, char* rec, __u32 len, __u32 blkno,
+                       kvtape_crypt_done_t done, void* priv);
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,506 @@
+/**
+ * @file   kvtape_dedup.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 14:20:31 2026
+ *
+ * @brief  Record deduplication against a chunk store shared by all drives.
+ *
+ * Chunk boundaries come from a gear hash over the data, so a weekly full
+ * that shifts by a few bytes still cuts the same chunks. New chunks are
+ * collected in a write buffer and reach the store in large appends, before
+ * any command other than WRITE runs. The digest table is kept in memory
+ * and rebuilt from the store headers on load.
+ *
+ * Restores read the store through two windows per drive: the window a
+ * chunk is found in is copied from while the one after it is read on the
+ * I/O threads, so a full written in one go comes back as sequential reads.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/err.h>
+#include <linux/debugfs.h>
+#include <crypto/hash.h>
+#include "kernel_fop.h"
+#include "kvtape.h"
+#include "kvtape_dedup.h"
+
+#define DEDUP_HASH_BITS 18
+#define DEDUP_WBUF_SIZE (1024 * 1024)
+#define DEDUP_WIN_SIZE  (1024 * 1024)
+#define DEDUP_RECIPE_SIZE KVTAPE_RECIPE_MAX(16 * 1024 * 1024) //largest record the index takes
+#define DEDUP_CUT_MASK  0xfff8000000000000ULL //13 bits, about 8 KB past the minimum
+
+struct dedup_chunk {
+    struct hlist_node node;
+    __u8 digest[32];
+    loff_t off;
+    __u32 len;
+};
+
+static struct {
+    int fd;
+    struct mutex lock;
+    loff_t size;                //store bytes on disk
+    char* wbuf;                 //chunks not written yet, they follow size
+    __u32 wlen;
+    struct hlist_head* hash;
+    struct kmem_cache* cache;
+    struct crypto_shash* tfm;
+    u64 written;                //record bytes deduplicated
+    u64 stored;                 //of them, bytes that went to the store
+    u64 chunks;
+} store = {
+    .fd = -1,
+};
+
+static __u64 gear[256];
+
+//fixed seed: the same data must be cut the same way after a reload.
+static void dedup_gear_init(void)
+{
+    __u64 x = 0x9e3779b97f4a7c15ULL;
+    int i = 0;
+
+    for (i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        gear[i] = x;
+    }
+}
+
+//length of the chunk starting at data.
+static __u32 dedup_cut(const __u8* data, __u32 len)
+{
+    __u64 h = 0;
+    __u32 i = 0;
+
+    if (len <= KVTAPE_CHUNK_MIN) {
+        return len;
+    }
+    if (len > KVTAPE_CHUNK_MAX) {
+        len = KVTAPE_CHUNK_MAX;
+    }
+    for (i = KVTAPE_CHUNK_MIN; i < len; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (0 == (h & DEDUP_CUT_MASK)) {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+static inline struct hlist_head* dedup_bucket(const __u8* digest)
+{
+    __u32 key = ((__u32)digest[0] << 16) | ((__u32)digest[1] << 8) | digest[2];
+    return &store.hash[key & ((1 << DEDUP_HASH_BITS) - 1)];
+}
+
+//store lock held.
+static struct dedup_chunk* dedup_lookup(const __u8* digest)
+{
+    struct dedup_chunk* chunk = NULL;
+    struct hlist_node* pos = NULL;
+
+    hlist_for_each_entry(chunk, pos, dedup_bucket(digest), node) {
+        if (!memcmp(chunk->digest, digest, sizeof(chunk->digest))) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+static struct dedup_chunk* dedup_insert(const __u8* digest, loff_t off, __u32 len)
+{
+    struct dedup_chunk* chunk = kmem_cache_alloc(store.cache, GFP_KERNEL);
+
+    if (NULL == chunk) {
+        return NULL;
+    }
+    memcpy(chunk->digest, digest, sizeof(chunk->digest));
+    chunk->off = off;
+    chunk->len = len;
+    hlist_add_head(&chunk->node, dedup_bucket(digest));
+    store.chunks++;
+    return chunk;
+}
+
+//store lock held. On failure the buffer is kept for the next attempt.
+static int dedup_store_flush(void)
+{
+    int ret = 0;
+
+    if (0 == store.wlen) {
+        return 0;
+    }
+    ret = kernel_file_pwrite(store.fd, store.wbuf, store.wlen, store.size);
+    if (ret != (int)store.wlen) {
+        printk("\nkvtape chunk store write returned %d/%u\n", ret, store.wlen);
+        return -EIO;
+    }
+    store.size += store.wlen;
+    store.wlen = 0;
+    return 0;
+}
+
+//store lock held.
+static struct dedup_chunk* dedup_append(const __u8* digest, const char* data, __u32 len)
+{
+    struct kvtape_chunk_hdr* hdr = NULL;
+    struct dedup_chunk* chunk = NULL;
+
+    if (store.wlen + sizeof(*hdr) + len > DEDUP_WBUF_SIZE && dedup_store_flush() < 0) {
+        return NULL;
+    }
+    chunk = dedup_insert(digest, store.size + store.wlen + sizeof(*hdr), len);
+    if (NULL == chunk) {
+        return NULL;
+    }
+    hdr = (struct kvtape_chunk_hdr*)(store.wbuf + store.wlen);
+    hdr->magic = KVTAPE_CHUNK_MAGIC;
+    hdr->len = len;
+    memcpy(hdr->digest, digest, sizeof(hdr->digest));
+    memcpy(store.wbuf + store.wlen + sizeof(*hdr), data, len);
+    store.wlen += sizeof(*hdr) + len;
+    store.stored += len;
+    return chunk;
+}
+
+/**
+ * Cut a record into chunks, store the new ones and describe the record
+ * in recipe, which must have room for KVTAPE_RECIPE_MAX(len) bytes.
+ *
+ * @return recipe length, negative on error.
+ */
+int kvtape_dedup_write(struct kvtape_dedup* dd, const char* data, __u32 len, char* recipe)
+{
+    struct kvtape_recipe_ent* ent = (struct kvtape_recipe_ent*)recipe;
+    __u8 digest[32];
+    __u32 off = 0;
+    __u32 n = 0;
+
+    while (off < len) {
+        __u32 clen = dedup_cut((const __u8*)data + off, len - off);
+        struct dedup_chunk* chunk = NULL;
+
+        if (crypto_shash_digest(dd->desc, data + off, clen, digest)) {
+            return -EIO;
+        }
+        mutex_lock(&store.lock);
+        chunk = dedup_lookup(digest);
+        if (NULL == chunk) {
+            chunk = dedup_append(digest, data + off, clen);
+        }
+        if (chunk) {
+            ent[n].offset = chunk->off;
+            ent[n].len = clen;
+            store.written += clen;
+        }
+        mutex_unlock(&store.lock);
+        if (NULL == chunk) {
+            return -EIO;
+        }
+        n++;
+        off += clen;
+    }
+    return n * sizeof(struct kvtape_recipe_ent);
+}
+
+int kvtape_dedup_flush(struct kvtape_dedup* dd)
+{
+    int ret = 0;
+
+    if (NULL == dd->desc) {
+        return 0;
+    }
+    mutex_lock(&store.lock);
+    ret = dedup_store_flush();
+    mutex_unlock(&store.lock);
+    return ret;
+}
+
+static void dedup_win_done(void* priv, int ret)
+{
+    struct kvtape_dedup_win* win = (struct kvtape_dedup_win*)priv;
+    struct kvtape_dedup* dd = win->dd;
+
+    win->len = ret < 0 ? 0 : ret;
+    smp_wmb();
+    win->busy = 0;
+    wake_up(&dd->wait);
+    kvtape_drive_io_put(dd->drive);
+}
+
+static void dedup_win_read(struct kvtape_dedup_win* win, loff_t off, int async)
+{
+    win->off = off;
+    win->len = 0;
+    win->ahead = 0;
+    win->busy = 1;
+    kvtape_drive_io_get(win->dd->drive);
+    if (!async || kernel_file_submit(store.fd, KERNEL_FILE_READ, win->buf, DEDUP_WIN_SIZE, off,
+                                     dedup_win_done, win) < 0) {
+        dedup_win_done(win, kernel_file_pread(store.fd, win->buf, DEDUP_WIN_SIZE, off));
+    }
+}
+
+static int dedup_win_has(struct kvtape_dedup_win* win, loff_t off, __u32 len)
+{
+    return win->off <= off && off + len <= win->off + (win->busy ? DEDUP_WIN_SIZE : win->len);
+}
+
+//copy len bytes of chunk data at store offset off.
+static int dedup_fetch(struct kvtape_dedup* dd, loff_t off, char* dst, __u32 len)
+{
+    struct kvtape_dedup_win* win = NULL;
+    struct kvtape_dedup_win* other = NULL;
+    int i = 0;
+
+    //not on disk yet, still in the write buffer.
+    mutex_lock(&store.lock);
+    if (off + len > store.size) {
+        int ret = -EIO;
+        if (off >= store.size && off + len <= store.size + store.wlen) {
+            memcpy(dst, store.wbuf + (off - store.size), len);
+            ret = 0;
+        }
+        mutex_unlock(&store.lock);
+        return ret;
+    }
+    mutex_unlock(&store.lock);
+
+    for (i = 0; i < 2; i++) {
+        if (dedup_win_has(&dd->win[i], off, len)) {
+            win = &dd->win[i];
+            wait_event(dd->wait, !win->busy);
+            smp_rmb();
+            if (!dedup_win_has(win, off, len)) {//short read
+                win = NULL;
+            }
+            break;
+        }
+    }
+    if (NULL == win) {
+        //reuse the window that is not being read ahead.
+        win = dd->win[0].busy ? &dd->win[1] : &dd->win[0];
+        wait_event(dd->wait, !win->busy);
+        dedup_win_read(win, off & ~4095LL, 0);
+        smp_rmb();
+        if (!dedup_win_has(win, off, len)) {
+            return -EIO;
+        }
+    }
+    memcpy(dst, win->buf + (off - win->off), len);
+
+    //the store is being read in order, fetch what comes next.
+    if (!win->ahead && DEDUP_WIN_SIZE == win->len) {
+        win->ahead = 1;
+        other = win == &dd->win[0] ? &dd->win[1] : &dd->win[0];
+        wait_event(dd->wait, !other->busy);
+        dedup_win_read(other, win->off + DEDUP_WIN_SIZE, 1);
+    }
+    return 0;
+}
+
+/**
+ * Put a deduplicated record back together: read its recipe_len byte
+ * recipe at offset of image fd and fetch its chunks, up to len bytes.
+ *
+ * @return record bytes copied to dst, negative on error.
+ */
+int kvtape_dedup_read(struct kvtape_dedup* dd, int fd, loff_t offset, __u32 recipe_len,
+                      char* dst, __u32 len)
+{
+    struct kvtape_recipe_ent* ent = (struct kvtape_recipe_ent*)dd->recipe;
+    __u32 n = recipe_len / sizeof(struct kvtape_recipe_ent);
+    __u32 done = 0;
+    __u32 i = 0;
+
+    if (NULL == dd->desc) {
+        return -ENODEV;
+    }
+    if (recipe_len > DEDUP_RECIPE_SIZE || recipe_len % sizeof(struct kvtape_recipe_ent) ||
+        kernel_file_pread(fd, dd->recipe, recipe_len, offset) != (int)recipe_len) {
+        return -EIO;
+    }
+    for (i = 0; i < n && done < len; i++) {
+        __u32 clen = ent[i].len < len - done ? ent[i].len : len - done;
+
+        if (ent[i].len > KVTAPE_CHUNK_MAX || dedup_fetch(dd, ent[i].offset, dst + done, clen) < 0) {
+            return -EIO;
+        }
+        done += clen;
+    }
+    return done;
+}
+
+/*
+  Rebuild the digest table from the store. A chunk cut short by a crash
+  ends the walk and is dropped from the store.
+*/
+static int dedup_scan(void)
+{
+    char* buf = store.wbuf;
+    loff_t base = 0;
+    loff_t pos = 0;
+    int valid = 0;
+    int eof = 0;
+
+    for (;;) {
+        struct kvtape_chunk_hdr* hdr = NULL;
+
+        if (!eof && pos + sizeof(*hdr) + KVTAPE_CHUNK_MAX > base + valid) {
+            base = pos;
+            valid = kernel_file_pread(store.fd, buf, DEDUP_WBUF_SIZE, base);
+            if (valid < 0) {
+                valid = 0;
+            }
+            eof = valid < DEDUP_WBUF_SIZE;
+        }
+        if (pos + sizeof(*hdr) > base + valid) {
+            break;
+        }
+        hdr = (struct kvtape_chunk_hdr*)(buf + (pos - base));
+        if (KVTAPE_CHUNK_MAGIC != hdr->magic || 0 == hdr->len || hdr->len > KVTAPE_CHUNK_MAX ||
+            pos + sizeof(*hdr) + hdr->len > base + valid) {
+            break;
+        }
+        if (NULL == dedup_insert(hdr->digest, pos + sizeof(*hdr), hdr->len)) {
+            return -ENOMEM;
+        }
+        pos += sizeof(*hdr) + hdr->len;
+    }
+
+    store.size = pos;
+    if (kernel_file_size(store.fd) > pos) {
+        kernel_file_truncate(store.fd, pos);
+    }
+    printk("\nkvtape chunk store %llu chunks, %lld bytes\n", (unsigned long long)store.chunks, (long long)pos);
+    return 0;
+}
+
+int kvtape_dedup_open(const char* path, struct dentry* dbg_dir)
+{
+    int i = 0;
+    int ret = 0;
+
+    mutex_init(&store.lock);
+    dedup_gear_init();
+    store.tfm = crypto_alloc_shash("sha256", 0, 0);
+    if (IS_ERR(store.tfm)) {
+        ret = PTR_ERR(store.tfm);
+        store.tfm = NULL;
+        printk("\nkvtape dedup needs sha256, error %d\n", ret);
+        return ret;
+    }
+    store.cache = kmem_cache_create("kvtape_chunk", sizeof(struct dedup_chunk), 0, 0, NULL);
+    store.hash = vmalloc(sizeof(struct hlist_head) << DEDUP_HASH_BITS);
+    store.wbuf = vmalloc(DEDUP_WBUF_SIZE);
+    if (NULL == store.cache || NULL == store.hash || NULL == store.wbuf) {
+        kvtape_dedup_close();
+        return -ENOMEM;
+    }
+    for (i = 0; i < (1 << DEDUP_HASH_BITS); i++) {
+        INIT_HLIST_HEAD(&store.hash[i]);
+    }
+
+    store.fd = kernel_file_open(path, O_RDWR|O_CREAT);
+    if (store.fd < 0) {
+        printk("\nkvtape chunk store %s can't be opened\n", path);
+        kvtape_dedup_close();
+        return -ENOENT;
+    }
+    ret = dedup_scan();
+    if (ret) {
+        kvtape_dedup_close();
+        return ret;
+    }
+
+    if (dbg_dir) {
+        debugfs_create_u64("dedup_written", S_IRUGO, dbg_dir, &store.written);
+        debugfs_create_u64("dedup_stored", S_IRUGO, dbg_dir, &store.stored);
+        debugfs_create_u64("dedup_chunks", S_IRUGO, dbg_dir, &store.chunks);
+    }
+    return 0;
+}
+
+void kvtape_dedup_close(void)
+{
+    int i = 0;
+
+    if (store.fd >= 0) {
+        dedup_store_flush();
+        kernel_file_close(store.fd);
+        store.fd = -1;
+    }
+    if (store.hash) {
+        for (i = 0; i < (1 << DEDUP_HASH_BITS); i++) {
+            struct dedup_chunk* chunk = NULL;
+            struct hlist_node* pos = NULL;
+            struct hlist_node* n = NULL;
+
+            hlist_for_each_entry_safe(chunk, pos, n, &store.hash[i], node) {
+                kmem_cache_free(store.cache, chunk);
+            }
+        }
+        vfree(store.hash);
+        store.hash = NULL;
+    }
+    if (store.cache) {
+        kmem_cache_destroy(store.cache);
+        store.cache = NULL;
+    }
+    if (store.tfm) {
+        crypto_free_shash(store.tfm);
+        store.tfm = NULL;
+    }
+    vfree(store.wbuf);
+    store.wbuf = NULL;
+}
+
+int kvtape_dedup_init(struct kvtape_dedup* dd, struct kvtape_drive* drive)
+{
+    int i = 0;
+
+    memset(dd, 0, sizeof(*dd));
+    dd->drive = drive;
+    init_waitqueue_head(&dd->wait);
+    if (NULL == store.tfm) {
+        return 0;
+    }
+
+    dd->desc = kmalloc(sizeof(struct shash_desc) + crypto_shash_descsize(store.tfm), GFP_KERNEL);
+    dd->recipe = vmalloc(DEDUP_RECIPE_SIZE);
+    for (i = 0; i < 2; i++) {
+        dd->win[i].dd = dd;
+        dd->win[i].off = -1;
+        dd->win[i].buf = vmalloc(DEDUP_WIN_SIZE);
+    }
+    if (NULL == dd->desc || NULL == dd->recipe || NULL == dd->win[0].buf || NULL == dd->win[1].buf) {
+        kvtape_dedup_exit(dd);
+        return -ENOMEM;
+    }
+    dd->desc->tfm = store.tfm;
+    dd->desc->flags = 0;
+    return 0;
+}
+
+//the drive's I/O must have drained, read ahead included.
+void kvtape_dedup_exit(struct kvtape_dedup* dd)
+{
+    int i = 0;
+
+    kfree(dd->desc);
+    dd->desc = NULL;
+    vfree(dd->recipe);
+    dd->recipe = NULL;
+    for (i = 0; i < 2; i++) {
+        vfree(dd->win[i].buf);
+        dd->win[i].buf = NULL;
+    }
+}
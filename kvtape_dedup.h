@@ -0,0 +1,83 @@
+/**
+ * @file   kvtape_dedup.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 19 14:12:47 2026
+ *
+ * @brief  Record deduplication against a chunk store shared by all drives.
+ *
+ * With dedup_store=<path> the records written to stream format images are
+ * cut into content defined chunks of 2 to 64 KB, and every chunk whose
+ * SHA-256 is not yet in the store is appended there:
+ *
+ *   [kvtape_chunk_hdr][data] [kvtape_chunk_hdr][data] ...
+ *
+ * The image then holds a recipe instead of the record: a stream record
+ * whose length header has KVTAPE_RECIPE_FLAG set and whose payload is an
+ * array of kvtape_recipe_ent, the record's chunks in order. Records
+ * shorter than a chunk, and everything in packed images, are stored as
+ * they are. The store only grows.
+ *
+ */
+
+#ifndef KVTAPE_DEDUP_H__
+#define KVTAPE_DEDUP_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_CHUNK_MAGIC 0x4b43564b /* "KVCK" */
+#define KVTAPE_CHUNK_MIN   (2 * 1024)
+#define KVTAPE_CHUNK_MAX   (64 * 1024)
+#define KVTAPE_RECIPE_FLAG 0x40000000 //in the stream header of a recipe
+
+struct kvtape_chunk_hdr {
+    __u32 magic;
+    __u32 len;
+    __u8 digest[32];    //SHA-256 of the data
+};
+
+struct kvtape_recipe_ent {
+    __u64 offset;       //store offset of the chunk data
+    __u32 len;
+} __attribute__((packed));
+
+//recipe bytes a len byte record may need.
+#define KVTAPE_RECIPE_MAX(len) (((len) / KVTAPE_CHUNK_MIN + 1) * sizeof(struct kvtape_recipe_ent))
+
+#ifdef __KERNEL__
+
+#include <linux/wait.h>
+
+struct dentry;
+struct shash_desc;
+struct kvtape_drive;
+
+//a piece of the store read ahead for restores.
+struct kvtape_dedup_win {
+    struct kvtape_dedup* dd;
+    char* buf;
+    loff_t off;
+    int len;            //valid bytes
+    int busy;           //read in flight
+    int ahead;          //the window behind it was requested
+};
+
+struct kvtape_dedup {
+    struct kvtape_drive* drive;
+    struct shash_desc* desc;    //NULL if the drive does not dedup
+    char* recipe;               //recipe being read
+    struct kvtape_dedup_win win[2];
+    wait_queue_head_t wait;     //woken when a window read is done
+};
+
+int kvtape_dedup_open(const char* path, struct dentry* dbg_dir);
+void kvtape_dedup_close(void);
+int kvtape_dedup_init(struct kvtape_dedup* dd, struct kvtape_drive* drive);
+void kvtape_dedup_exit(struct kvtape_dedup* dd);
+int kvtape_dedup_write(struct kvtape_dedup* dd, const char* data, __u32 len, char* recipe);
+int kvtape_dedup_read(struct kvtape_dedup* dd, int fd, loff_t offset, __u32 recipe_len,
+                      char* dst, __u32 len);
+int kvtape_dedup_flush(struct kvtape_dedup* dd);
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,195 @@
+/**
+ * @file   kvtape_index.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 11:04:15 2026
+ *
+ * @brief  In-memory record index of a tape image.
+ *
+ * Records are kept in fixed chunks so the index grows without moving
+ * existing entries. Truncation only lowers count; chunks behind it are
+ * reused by later appends and freed with the index.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "kernel_fop.h"
+#include "kvtape.h"
+#include "kvtape_index.h"
+
+#define SCAN_BUF_SIZE (64 * 1024)
+#define MAX_RECORD_LEN (16 * 1024 * 1024) //longer headers are taken as garbage
+
+void kvtape_index_init(struct kvtape_index* idx)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->hdr_len = 4;
+    idx->nr_stripes = 1;
+}
+
+void kvtape_index_free(struct kvtape_index* idx)
+{
+    uint32_t i = 0;
+    for (i = 0; i < idx->nr_chunks; i++) {
+        vfree(idx->chunks[i]);
+    }
+    kfree(idx->chunks);
+    kvtape_index_init(idx);
+}
+
+int kvtape_index_append(struct kvtape_index* idx, loff_t offset, uint32_t len, uint8_t type)
+{
+    struct kvtape_rec* rec = NULL;
+    uint32_t chunk = idx->count / KVTAPE_INDEX_CHUNK;
+
+    if (chunk >= idx->nr_chunks) {
+        struct kvtape_rec** chunks = NULL;
+
+        chunks = kmalloc((chunk + 1) * sizeof(struct kvtape_rec*), GFP_KERNEL);
+        if (NULL == chunks) {
+            return -ENOMEM;
+        }
+        chunks[chunk] = vmalloc(KVTAPE_INDEX_CHUNK * sizeof(struct kvtape_rec));
+        if (NULL == chunks[chunk]) {
+            kfree(chunks);
+            return -ENOMEM;
+        }
+        if (idx->nr_chunks) {
+            memcpy(chunks, idx->chunks, idx->nr_chunks * sizeof(struct kvtape_rec*));
+        }
+        kfree(idx->chunks);
+        idx->chunks = chunks;
+        idx->nr_chunks = chunk + 1;
+    }
+
+    rec = &idx->chunks[chunk][idx->count % KVTAPE_INDEX_CHUNK];
+    rec->offset = offset;
+    rec->len = len;
+    rec->type = type;
+    idx->count++;
+    return 0;
+}
+
+void kvtape_index_truncate(struct kvtape_index* idx, uint32_t count)
+{
+    if (count < idx->count) {
+        idx->count = count;
+    }
+}
+
+/*
+  Walk the record headers of one stream image. The walk stops at a zero
+  length (EOD of an image made with dd if=/dev/zero), at a short read, at
+  a header that can't be a record, or at a record torn off by the end of
+  the file, so EOD lands in front of it.
+*/
+static int index_scan(struct kvtape_index* idx, int fd)
+{
+    char* buf = NULL;
+    loff_t base = 0;    //image offset of buf[0]
+    loff_t pos = 0;     //next header
+    int valid = 0;      //bytes in buf
+    loff_t size = kernel_file_size(fd);
+
+    kvtape_index_truncate(idx, 0);
+    buf = vmalloc(SCAN_BUF_SIZE);
+    if (NULL == buf) {
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        int32_t record_len = 0;
+        uint8_t type = NOT_MARK;
+
+        //header and mark byte must be in the buffer.
+        if (pos + 5 > base + valid) {
+            base = pos;
+            valid = kernel_file_pread(fd, buf, SCAN_BUF_SIZE, base);
+            if (valid < 4) {
+                break;
+            }
+        }
+        memcpy(&record_len, buf + (pos - base), 4);
+        if (record_len > 0 && (record_len & KVTAPE_RECIPE_FLAG)) {
+            record_len &= ~KVTAPE_RECIPE_FLAG;
+            type = RECIPE;
+        } else if (record_len > 0 && (record_len & KVTAPE_CRYPT_FLAG)) {
+            record_len &= ~KVTAPE_CRYPT_FLAG;
+            type = ENCRYPTED;
+        }
+        if (record_len <= 0 || record_len > MAX_RECORD_LEN || pos + 4 + record_len > size) {
+            break;
+        }
+        if (1 == record_len) {
+            if (pos + 5 > base + valid) {//short read inside the record
+                break;
+            }
+            type = buf[pos - base + 4];
+            if (FILEMARK != type && SETMARK != type) {
+                type = NOT_MARK;
+            }
+        }
+        if (kvtape_index_append(idx, pos, record_len, type) < 0) {
+            vfree(buf);
+            return -ENOMEM;
+        }
+        pos += 4 + record_len;
+    }
+
+    vfree(buf);
+    printk("\nkvtape index loaded %u records, EOD at %lld\n", idx->count, (long long)pos);
+    return idx->count;
+}
+
+/**
+ * Rebuild the index from the image, fds[] holding idx->nr_stripes stripe
+ * files. Stripes are scanned one by one and their blocks interleaved; the
+ * first block missing from its stripe is EOD.
+ *
+ * @return number of records found, negative on error.
+ */
+int kvtape_index_load(struct kvtape_index* idx, const int* fds)
+{
+    struct kvtape_index* part = NULL;
+    uint32_t nr = idx->nr_stripes;
+    uint32_t i = 0;
+    int ret = -ENOMEM;
+
+    if (1 == nr) {
+        return index_scan(idx, fds[0]);
+    }
+
+    part = kmalloc(nr * sizeof(struct kvtape_index), GFP_KERNEL);
+    if (NULL == part) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr; i++) {
+        kvtape_index_init(&part[i]);
+    }
+    for (i = 0; i < nr; i++) {
+        if (index_scan(&part[i], fds[i]) < 0) {
+            goto out;
+        }
+    }
+
+    kvtape_index_truncate(idx, 0);
+    for (i = 0; ; i++) {
+        struct kvtape_rec* rec = kvtape_index_get(&part[i % nr], i / nr);
+        if (NULL == rec) {
+            break;
+        }
+        if (kvtape_index_append(idx, rec->offset, rec->len, rec->type) < 0) {
+            goto out;
+        }
+    }
+    ret = idx->count;
+    printk("\nkvtape index %u records over %u stripes\n", idx->count, nr);
+
+ out:
+    for (i = 0; i < nr; i++) {
+        kvtape_index_free(&part[i]);
+    }
+    kfree(part);
+    return ret;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file   kvtape_index.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 11:02:37 2026
+ *
+ * @brief  In-memory record index of a tape image.
+ *
+ * Entry n describes logical block n: where it starts in the image, the
+ * payload length and whether it is a tape mark. In the stream format a
+ * block starts with its 4 byte length header (hdr_len 4); packed images
+ * keep lengths in the container directory and index the payload itself
+ * (hdr_len 0). count is the EOD position; anything behind it in the image
+ * is stale. A deduplicated block is indexed by its recipe (type RECIPE,
+ * len the recipe length).
+ *
+ * A striped drive spreads its blocks round-robin over nr_stripes backing
+ * files: block n lives in stripe n % nr_stripes and offset is within that
+ * file. Each stripe on its own is a stream format image.
+ *
+ */
+
+#ifndef KVTAPE_INDEX_H__
+#define KVTAPE_INDEX_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_INDEX_CHUNK 4096 //records per chunk
+
+struct kvtape_rec {
+    loff_t offset;      //image offset of the block
+    uint32_t len;       //payload length, 1 for tape marks
+    uint8_t type;       //enum _filemark
+};
+
+struct kvtape_index {
+    uint32_t count;     //records before EOD
+    uint32_t hdr_len;   //image bytes in front of each payload
+    uint32_t nr_stripes;//backing files the blocks are spread over
+    uint32_t nr_chunks; //chunks allocated
+    struct kvtape_rec** chunks;
+};
+
+void kvtape_index_init(struct kvtape_index* idx);
+void kvtape_index_free(struct kvtape_index* idx);
+int kvtape_index_append(struct kvtape_index* idx, loff_t offset, uint32_t len, uint8_t type);
+void kvtape_index_truncate(struct kvtape_index* idx, uint32_t count);
+int kvtape_index_load(struct kvtape_index* idx, const int* fds);
+
+static inline struct kvtape_rec* kvtape_index_get(struct kvtape_index* idx, uint32_t blkno)
+{
+    if (blkno >= idx->count) {
+        return NULL;
+    }
+    return &idx->chunks[blkno / KVTAPE_INDEX_CHUNK][blkno % KVTAPE_INDEX_CHUNK];
+}
+
+static inline loff_t kvtape_index_payload(struct kvtape_index* idx, struct kvtape_rec* rec)
+{
+    return rec->offset + idx->hdr_len;
+}
+
+static inline uint32_t kvtape_index_stripe(struct kvtape_index* idx, uint32_t blkno)
+{
+    return blkno % idx->nr_stripes;
+}
+
+//end of the last block before EOD in a stripe, where its next block goes.
+static inline loff_t kvtape_index_stripe_end(struct kvtape_index* idx, uint32_t stripe)
+{
+    struct kvtape_rec* rec = NULL;
+    uint32_t last = 0;
+
+    if (idx->count <= stripe) {
+        return 0;
+    }
+    last = idx->count - 1 - (idx->count - 1 - stripe) % idx->nr_stripes;
+    rec = kvtape_index_get(idx, last);
+    return rec->offset + idx->hdr_len + rec->len;
+}
+
+//image offset of block blkno in its stripe, EOD offset for blkno == count.
+static inline loff_t kvtape_index_offset(struct kvtape_index* idx, uint32_t blkno)
+{
+    if (blkno < idx->count) {
+        return kvtape_index_get(idx, blkno)->offset;
+    }
+    return kvtape_index_stripe_end(idx, kvtape_index_stripe(idx, blkno));
+}
+
+#endif
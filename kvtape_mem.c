@@ -0,0 +1,306 @@
+/**
+ * @file   kvtape_mem.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 25 10:05:47 2026
+ *
+ * @brief  Module wide budget for the drives' data buffers.
+ *
+ * Rates are sampled at most once a second, by whoever charges next, so an
+ * idle module costs nothing. Waiters recheck when memory is uncharged and
+ * every 100ms anyway, which picks up a new budget or share.
+ *
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include "kvtape_mem.h"
+
+static unsigned int mem_budget_mb = 1024;
+module_param(mem_budget_mb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mem_budget_mb, "Data buffers of all drives in MB, 0 for no limit (default 1024), may be changed at runtime");
+
+#define MEM_MAX_PRESSURE 3 //the budget goes down to an eighth under memory pressure
+
+static DEFINE_SPINLOCK(mem_lock);
+static LIST_HEAD(mem_list);
+static DECLARE_WAIT_QUEUE_HEAD(mem_wait);
+static __u64 mem_total[KVTAPE_MEM_KINDS];
+static int mem_drives;
+static int mem_pressure;
+static unsigned long mem_sampled;   //jiffies
+static unsigned long mem_squeezed;  //jiffies of the last memory pressure
+static unsigned int mem_gen;        //bumped by every uncharge
+static struct dentry* mem_file;
+
+//bytes, 0 for no limit.
+static __u64 mem_budget(void)
+{
+    return ((__u64)mem_budget_mb << 20) >> mem_pressure;
+}
+
+//rates over the last second, and the pressure easing off; mem_lock held.
+static void mem_sample(void)
+{
+    unsigned long now = jiffies;
+    unsigned long elapsed = now - mem_sampled;
+    struct kvtape_mem* mem = NULL;
+
+    if (elapsed < HZ) {
+        return;
+    }
+    list_for_each_entry(mem, &mem_list, list) {
+        mem->rate = (mem->rate + div64_u64(mem->moved * HZ, elapsed)) >> 1;
+        mem->moved = 0;
+    }
+    if (mem_pressure && time_after(now, mem_squeezed + HZ)) {
+        mem_pressure--;
+    }
+    mem_sampled = now;
+}
+
+//half of budget split evenly, the other half by throughput; mem_lock held.
+static __u64 mem_share(struct kvtape_mem* mem, __u64 budget)
+{
+    struct kvtape_mem* p = NULL;
+    __u64 sum = 0;
+    int n = mem_drives > 0 ? mem_drives : 1;
+
+    list_for_each_entry(p, &mem_list, list) {
+        sum += p->rate;
+    }
+    if (0 == sum) {
+        return div_u64(budget, n);
+    }
+    //the fraction in 1/1024th keeps the product in 64 bits.
+    return div_u64(budget >> 1, n) + ((budget >> 11) * div64_u64(mem->rate << 10, sum));
+}
+
+//can mem take len more bytes of I/O buffers; mem_lock held.
+static int mem_fits(struct kvtape_mem* mem, __u64 len)
+{
+    __u64 budget = mem_budget();
+    __u64 held = mem->used[KVTAPE_MEM_IO] + mem->used[KVTAPE_MEM_PINNED];
+
+    if (0 == budget || 0 == mem->used[KVTAPE_MEM_IO]) {
+        return 1;
+    }
+    return held + len <= mem_share(mem, budget) &&
+        mem_total[KVTAPE_MEM_IO] + mem_total[KVTAPE_MEM_PINNED] + len <= budget;
+}
+
+//ask every drive to drop its caches; mem_lock held.
+static void mem_reclaim(void)
+{
+    struct kvtape_mem* mem = NULL;
+
+    list_for_each_entry(mem, &mem_list, list) {
+        if (mem->used[KVTAPE_MEM_CACHE] && mem->reclaim) {
+            mem->reclaim(mem);
+        }
+    }
+}
+
+static int mem_over(void)
+{
+    __u64 budget = mem_budget();
+
+    return budget && mem_total[KVTAPE_MEM_IO] + mem_total[KVTAPE_MEM_PINNED] +
+        mem_total[KVTAPE_MEM_CACHE] + mem_total[KVTAPE_MEM_QUEUED] > budget;
+}
+
+/**
+ * Account len bytes of kind to mem. I/O buffers wait until mem is within
+ * its share; the others are taken as they come.
+ */
+void kvtape_mem_charge(struct kvtape_mem* mem, int kind, __u64 len)
+{
+    ktime_t start = ktime_set(0, 0);
+    int waited = 0;
+
+    spin_lock(&mem_lock);
+    mem_sample();
+    while (KVTAPE_MEM_IO == kind && !mem_fits(mem, len)) {
+        unsigned int gen = mem_gen;
+
+        if (!waited) {
+            waited = 1;
+            start = ktime_get();
+            mem->waits++;
+            mem_reclaim();
+        }
+        spin_unlock(&mem_lock);
+        wait_event_timeout(mem_wait, gen != mem_gen, HZ / 10);
+        spin_lock(&mem_lock);
+        mem_sample();
+    }
+    if (waited) {
+        mem->wait_us += ktime_us_delta(ktime_get(), start);
+    }
+    mem->used[kind] += len;
+    mem_total[kind] += len;
+    if (mem_over()) {
+        mem_reclaim();
+    }
+    spin_unlock(&mem_lock);
+}
+
+void kvtape_mem_uncharge(struct kvtape_mem* mem, int kind, __u64 len)
+{
+    spin_lock(&mem_lock);
+    len = len < mem->used[kind] ? len : mem->used[kind];
+    mem->used[kind] -= len;
+    mem_total[kind] -= len;
+    mem_gen++;
+    spin_unlock(&mem_lock);
+    wake_up(&mem_wait);
+}
+
+void kvtape_mem_moved(struct kvtape_mem* mem, __u64 len)
+{
+    spin_lock(&mem_lock);
+    mem->moved += len;
+    spin_unlock(&mem_lock);
+}
+
+void kvtape_mem_register(struct kvtape_mem* mem, int id, void (*reclaim)(struct kvtape_mem*))
+{
+    memset(mem, 0, sizeof(*mem));
+    mem->id = id;
+    mem->reclaim = reclaim;
+    spin_lock(&mem_lock);
+    list_add_tail(&mem->list, &mem_list);
+    mem_drives++;
+    spin_unlock(&mem_lock);
+}
+
+//reclaim is not called any more; what mem still holds can be uncharged.
+void kvtape_mem_unregister(struct kvtape_mem* mem)
+{
+    spin_lock(&mem_lock);
+    if (mem->list.next && !list_empty(&mem->list)) {
+        list_del_init(&mem->list);
+        mem_drives--;
+    }
+    spin_unlock(&mem_lock);
+}
+
+//the kernel is short of memory: drop the caches and tighten the budget.
+static void mem_squeeze(void)
+{
+    spin_lock(&mem_lock);
+    if (time_after(jiffies, mem_squeezed + HZ / 10)) {
+        if (mem_pressure < MEM_MAX_PRESSURE) {
+            mem_pressure++;
+        }
+        mem_squeezed = jiffies;
+        mem_reclaim();
+    }
+    spin_unlock(&mem_lock);
+}
+
+static unsigned long mem_cache_pages(void)
+{
+    unsigned long pages = 0;
+
+    spin_lock(&mem_lock);
+    pages = (unsigned long)(mem_total[KVTAPE_MEM_CACHE] >> PAGE_SHIFT);
+    spin_unlock(&mem_lock);
+    return pages;
+}
+
+//caches are dropped on the drives' threads, nothing is freed right here.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+static int mem_shrink(struct shrinker* s, int nr_to_scan, gfp_t gfp_mask)
+#else
+static int mem_shrink(int nr_to_scan, gfp_t gfp_mask)
+#endif
+{
+    if (nr_to_scan) {
+        mem_squeeze();
+    }
+    return mem_cache_pages();
+}
+
+static struct shrinker mem_shrinker = {
+    .shrink = mem_shrink,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static ssize_t mem_read(struct file* file, char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_mem* mem = NULL;
+    size_t size = 0;
+    char* buf = NULL;
+    int len = 0;
+    ssize_t ret = 0;
+
+    spin_lock(&mem_lock);
+    size = 256 + 128 * mem_drives;
+    spin_unlock(&mem_lock);
+    buf = kmalloc(size, GFP_KERNEL);
+    if (NULL == buf) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&mem_lock);
+    mem_sample();
+    len = snprintf(buf, size, "budget_mb %u\npressure %d\nio_kb %llu\npinned_kb %llu\ncache_kb %llu\n"
+                   "queued_kb %llu\n"
+                   "drive io_kb pinned_kb cache_kb queued_kb share_kb rate_kbs waits wait_ms\n",
+                   (unsigned int)(mem_budget() >> 20), mem_pressure,
+                   (unsigned long long)(mem_total[KVTAPE_MEM_IO] >> 10),
+                   (unsigned long long)(mem_total[KVTAPE_MEM_PINNED] >> 10),
+                   (unsigned long long)(mem_total[KVTAPE_MEM_CACHE] >> 10),
+                   (unsigned long long)(mem_total[KVTAPE_MEM_QUEUED] >> 10));
+    list_for_each_entry(mem, &mem_list, list) {
+        if (len >= size) {
+            break;
+        }
+        len += snprintf(buf + len, size - len, "%d %llu %llu %llu %llu %llu %llu %llu %llu\n", mem->id,
+                        (unsigned long long)(mem->used[KVTAPE_MEM_IO] >> 10),
+                        (unsigned long long)(mem->used[KVTAPE_MEM_PINNED] >> 10),
+                        (unsigned long long)(mem->used[KVTAPE_MEM_CACHE] >> 10),
+                        (unsigned long long)(mem->used[KVTAPE_MEM_QUEUED] >> 10),
+                        (unsigned long long)(mem_share(mem, mem_budget()) >> 10),
+                        (unsigned long long)(mem->rate >> 10),
+                        (unsigned long long)mem->waits,
+                        (unsigned long long)div_u64(mem->wait_us, 1000));
+    }
+    spin_unlock(&mem_lock);
+    ret = simple_read_from_buffer(ubuf, count, ppos, buf, len < size ? len : size - 1);
+    kfree(buf);
+    return ret;
+}
+
+static const struct file_operations mem_fops = {
+    .owner = THIS_MODULE,
+    .read = mem_read,
+};
+
+int kvtape_mem_init(struct dentry* dir)
+{
+    mem_sampled = jiffies;
+    mem_squeezed = jiffies - HZ;
+    if (dir) {
+        mem_file = debugfs_create_file("mem", S_IRUSR, dir, NULL, &mem_fops);
+    }
+    register_shrinker(&mem_shrinker);
+    return 0;
+}
+
+void kvtape_mem_exit(void)
+{
+    unregister_shrinker(&mem_shrinker);
+    debugfs_remove(mem_file);
+    mem_file = NULL;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file   kvtape_mem.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 25 09:42:18 2026
+ *
+ * @brief  Module wide budget for the drives' data buffers.
+ *
+ * Every drive charges the buffers it holds against mem_budget_mb: I/O
+ * buffers of commands and container writes in flight, the open container
+ * and the container read cache. Half the budget is split evenly between
+ * the drives, the other half by their throughput over the last seconds.
+ * A drive over its share waits for its own I/O to finish instead of
+ * allocating more; with nothing in flight it always gets its buffer, so it
+ * never stalls for good. Copies queued for a background writer (a
+ * mirror) are counted but never waited for, their writer bounds them.
+ * Caches are not limited but are dropped when the budget runs out or the
+ * kernel asks for memory, and then the budget is halved for a while.
+ *
+ * debugfs kvtape/mem reports the budget and what each drive holds.
+ *
+ */
+
+#ifndef KVTAPE_MEM_H__
+#define KVTAPE_MEM_H__
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct dentry;
+
+enum kvtape_mem_kind {
+    KVTAPE_MEM_IO,      //in flight, charging it waits for room
+    KVTAPE_MEM_PINNED,  //held while the medium is loaded
+    KVTAPE_MEM_CACHE,   //dropped on demand
+    KVTAPE_MEM_QUEUED,  //waiting for a background writer, taken as it comes
+    KVTAPE_MEM_KINDS
+};
+
+struct kvtape_mem {
+    struct list_head list;
+    int id;
+    __u64 used[KVTAPE_MEM_KINDS];
+    __u64 moved;        //bytes transferred since the last sample
+    __u64 rate;         //bytes/s, smoothed
+    __u64 waits;        //charges that had to wait
+    __u64 wait_us;
+    //drop the caches; called with a spinlock held, so it must not sleep.
+    void (*reclaim)(struct kvtape_mem* mem);
+};
+
+int kvtape_mem_init(struct dentry* dir);
+void kvtape_mem_exit(void);
+
+void kvtape_mem_register(struct kvtape_mem* mem, int id, void (*reclaim)(struct kvtape_mem*));
+void kvtape_mem_unregister(struct kvtape_mem* mem);
+
+void kvtape_mem_charge(struct kvtape_mem* mem, int kind, __u64 len);
+void kvtape_mem_uncharge(struct kvtape_mem* mem, int kind, __u64 len);
+
+//len bytes of data went to or came from the host.
+void kvtape_mem_moved(struct kvtape_mem* mem, __u64 len);
+
+#endif
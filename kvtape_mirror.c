@@ -0,0 +1,499 @@
+/**
+ * @file   kvtape_mirror.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 26 09:38:27 2026
+ *
+ * @brief  Images copied to a second file as they are written.
+ *
+ * Writes, truncates, punches and preallocations that succeed on the image
+ * are queued, writes with a copy of their data, and the mirror thread
+ * replays them in order. The drive never has two requests on one range in
+ * flight, so replaying in queue order ends in the image's content. A
+ * mirror whose size differs from the image's when it is opened (a new one,
+ * or one left behind) is first copied over in full. A replay that fails
+ * leaves the mirror stale: nothing more is queued, writers no longer wait
+ * for it and it is emptied, so the next load copies it over again. The
+ * copies of the data queued are charged to the drive's memory budget
+ * without waiting; the lag budget, checked on the drive's command thread
+ * before a write is issued, is what holds writers back.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/debugfs.h>
+#include <asm/uaccess.h>
+#include "kernel_fop.h"
+#include "kvtape_mem.h"
+#include "kvtape_mirror.h"
+
+#define MIRROR_COPY_SIZE (1024 * 1024)
+
+struct mirror_op {
+    struct list_head list;
+    int rw;
+    char* buf;                  //copy of the data of a KERNEL_FILE_WRITE
+    size_t count;
+    loff_t offset;
+    unsigned long queued;       //jiffies
+};
+
+struct kvtape_mirror {
+    struct list_head list;      //all mirrors, for debugfs
+    int image;
+    int mirror;
+    int fd;                     //the descriptor over both
+    loff_t lag;                 //bytes queued before writers wait
+    struct kvtape_mem* mem;     //the drive's budget, charged for the copies queued
+    spinlock_t lock;            //everything below
+    struct list_head queue;
+    loff_t queued;              //bytes of data in the queue
+    unsigned long oldest;       //jiffies the op being replayed was queued, 0 if none
+    loff_t resync;              //image bytes left to copy over, 0 once in step
+    int err;                    //the mirror is stale
+    u64 written;
+    u64 stalls;                 //writes that waited for the mirror
+    wait_queue_head_t wait;     //the thread, writers over the lag budget, drains
+    struct task_struct* task;
+    char* buf;
+    char* name;
+};
+
+static LIST_HEAD(mirrors);
+static DEFINE_SPINLOCK(mirrors_lock);
+
+static char* mirror_buf_alloc(size_t count)
+{
+    return count <= PAGE_SIZE ? kmalloc(count, GFP_KERNEL) : vmalloc(count);
+}
+
+static void mirror_buf_free(char* buf)
+{
+    if (is_vmalloc_addr(buf)) {
+        vfree(buf);
+    } else {
+        kfree(buf);
+    }
+}
+
+static void mirror_op_free(struct kvtape_mirror* m, struct mirror_op* op)
+{
+    if (op->buf) {
+        mirror_buf_free(op->buf);
+        kvtape_mem_uncharge(m->mem, KVTAPE_MEM_QUEUED, op->count);
+    }
+    kfree(op);
+}
+
+//the mirror can't follow any more; lock held.
+static void mirror_break(struct kvtape_mirror* m, int err)
+{
+    if (0 == m->err) {
+        printk("\nkvtape mirror %s: error %d, the mirror is stale until reloaded\n", m->name, err);
+        m->err = err;
+    }
+}
+
+static int mirror_room(struct kvtape_mirror* m, size_t count)
+{
+    int room = 0;
+
+    spin_lock(&m->lock);
+    room = m->err || 0 == m->queued || m->queued + count <= m->lag;
+    spin_unlock(&m->lock);
+    return room;
+}
+
+//everything queued so far is on the mirror, or never will be.
+static int mirror_idle(struct kvtape_mirror* m)
+{
+    int idle = 0;
+
+    spin_lock(&m->lock);
+    idle = m->err || (list_empty(&m->queue) && 0 == m->oldest && 0 == m->resync);
+    spin_unlock(&m->lock);
+    return idle;
+}
+
+static void mirror_queue(struct kvtape_mirror* m, int rw, void* buf, size_t count, loff_t offset)
+{
+    struct mirror_op* op = (struct mirror_op*)kzalloc(sizeof(struct mirror_op), GFP_KERNEL);
+
+    if (op && KERNEL_FILE_WRITE == rw) {
+        //on an I/O worker, with the write's own buffer still charged: never wait here.
+        kvtape_mem_charge(m->mem, KVTAPE_MEM_QUEUED, count);
+        op->buf = mirror_buf_alloc(count);
+        if (NULL == op->buf) {
+            kvtape_mem_uncharge(m->mem, KVTAPE_MEM_QUEUED, count);
+            kfree(op);
+            op = NULL;
+        } else {
+            op->count = count;
+            memcpy(op->buf, buf, count);
+        }
+    }
+    spin_lock(&m->lock);
+    if (NULL == op || m->err) {
+        if (NULL == op) {
+            mirror_break(m, -ENOMEM);
+        }
+        spin_unlock(&m->lock);
+        if (op) {
+            mirror_op_free(m, op);
+        }
+        wake_up(&m->wait);
+        return;
+    }
+    op->rw = rw;
+    op->count = count;
+    op->offset = offset;
+    op->queued = jiffies;
+    list_add_tail(&op->list, &m->queue);
+    if (KERNEL_FILE_WRITE == rw) {
+        m->queued += count;
+    }
+    spin_unlock(&m->lock);
+    wake_up(&m->wait);
+}
+
+static int mirror_io(void* priv, int rw, void* buf, size_t count, loff_t offset)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)priv;
+    int ret = 0;
+
+    switch (rw) {
+    case KERNEL_FILE_WRITE:
+        ret = kernel_file_pwrite(m->image, buf, count, offset);
+        if (ret > 0) {
+            mirror_queue(m, rw, buf, ret, offset);
+        }
+        return ret;
+    case KERNEL_FILE_TRUNCATE:
+        ret = kernel_file_truncate(m->image, offset);
+        break;
+    case KERNEL_FILE_PUNCH:
+        ret = kernel_file_punch(m->image, offset, count);
+        break;
+    case KERNEL_FILE_PREALLOC:
+        ret = kernel_file_prealloc(m->image, offset, count);
+        break;
+    default:
+        return kernel_file_pread(m->image, buf, count, offset);
+    }
+    if (0 == ret) {
+        mirror_queue(m, rw, NULL, count, offset);
+    }
+    return ret;
+}
+
+static int mirror_apply(struct kvtape_mirror* m, struct mirror_op* op)
+{
+    int ret = 0;
+
+    switch (op->rw) {
+    case KERNEL_FILE_WRITE:
+        ret = kernel_file_pwrite(m->mirror, op->buf, op->count, op->offset);
+        return ret == (int)op->count ? 0 : (ret < 0 ? ret : -EIO);
+    case KERNEL_FILE_TRUNCATE:
+        return kernel_file_truncate(m->mirror, op->offset);
+    case KERNEL_FILE_PUNCH:
+        //the mirror's filesystem may not punch; the range is rewritten or truncated later anyway.
+        ret = kernel_file_punch(m->mirror, op->offset, op->count);
+        return -EOPNOTSUPP == ret ? 0 : ret;
+    default:
+        kernel_file_prealloc(m->mirror, op->offset, op->count);
+        return 0;
+    }
+}
+
+//copy the image over a mirror that isn't in step with it.
+static int mirror_resync(struct kvtape_mirror* m)
+{
+    loff_t end = m->resync;
+    loff_t off = 0;
+
+    printk("\nkvtape mirror %s: copying %lld bytes of the image\n", m->name, (long long)end);
+    while (off < end) {
+        int len = min_t(loff_t, MIRROR_COPY_SIZE, end - off);
+        int n = kernel_file_pread(m->image, m->buf, len, off);
+
+        if (kthread_should_stop()) {
+            return -EINTR;
+        }
+        if (n <= 0) {
+            return n < 0 ? n : -EIO;
+        }
+        if (kernel_file_pwrite(m->mirror, m->buf, n, off) != n) {
+            return -EIO;
+        }
+        off += n;
+        spin_lock(&m->lock);
+        m->resync = end - off;
+        spin_unlock(&m->lock);
+    }
+    return kernel_file_truncate(m->mirror, end);
+}
+
+static int mirror_thread(void* data)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)data;
+    int emptied = 0;
+    int ret = 0;
+
+    if (m->resync) {
+        ret = mirror_resync(m);
+        spin_lock(&m->lock);
+        m->resync = 0;
+        if (ret) {
+            mirror_break(m, ret);
+        }
+        spin_unlock(&m->lock);
+        wake_up(&m->wait);
+    }
+    //what is queued goes to the mirror before the thread stops.
+    for (;;) {
+        struct mirror_op* op = NULL;
+
+        wait_event_interruptible(m->wait, kthread_should_stop() || !list_empty(&m->queue) ||
+                                 (m->err && !emptied));
+        //a stale mirror must not pass for a good one on the next load.
+        if (m->err && !emptied) {
+            emptied = 1;
+            kernel_file_truncate(m->mirror, 0);
+        }
+        spin_lock(&m->lock);
+        if (!list_empty(&m->queue)) {
+            op = list_first_entry(&m->queue, struct mirror_op, list);
+            list_del(&op->list);
+            m->oldest = op->queued;
+        }
+        spin_unlock(&m->lock);
+        if (NULL == op) {
+            if (kthread_should_stop()) {
+                break;
+            }
+            continue;
+        }
+        ret = m->err ? 0 : mirror_apply(m, op);
+        spin_lock(&m->lock);
+        m->oldest = 0;
+        if (KERNEL_FILE_WRITE == op->rw) {
+            m->queued -= op->count;
+            m->written += ret ? 0 : op->count;
+        }
+        if (ret) {
+            mirror_break(m, ret);
+        }
+        spin_unlock(&m->lock);
+        mirror_op_free(m, op);
+        wake_up(&m->wait);
+    }
+    return 0;
+}
+
+static loff_t mirror_size(void* priv)
+{
+    return kernel_file_size(((struct kvtape_mirror*)priv)->image);
+}
+
+static int mirror_sync(void* priv)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)priv;
+    int ret = kernel_file_sync(m->image);
+
+    wait_event(m->wait, mirror_idle(m));
+    if (0 == ret && 0 == m->err) {
+        kernel_file_sync(m->mirror);
+    }
+    return ret;
+}
+
+static void mirror_free(struct kvtape_mirror* m)
+{
+    struct mirror_op* op = NULL;
+    struct mirror_op* next = NULL;
+
+    list_for_each_entry_safe(op, next, &m->queue, list) {
+        list_del(&op->list);
+        mirror_op_free(m, op);
+    }
+    kernel_file_close(m->mirror);
+    vfree(m->buf);
+    kfree(m->name);
+    kfree(m);
+}
+
+static void mirror_close(void* priv)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)priv;
+
+    spin_lock(&mirrors_lock);
+    list_del(&m->list);
+    spin_unlock(&mirrors_lock);
+    kthread_stop(m->task);
+    kernel_file_close(m->image);
+    mirror_free(m);
+}
+
+/*
+  A write waits only while the mirror trails by more than the lag budget,
+  then for whatever the image itself holds writes back for.
+*/
+static void mirror_throttle(void* priv, size_t count, loff_t offset)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)priv;
+
+    if (!mirror_room(m, count)) {
+        spin_lock(&m->lock);
+        m->stalls++;
+        spin_unlock(&m->lock);
+        wait_event(m->wait, mirror_room(m, count));
+    }
+    kernel_file_throttle(m->image, count, offset);
+}
+
+static const struct kernel_file_ops mirror_ops = {
+    .io = mirror_io,
+    .size = mirror_size,
+    .sync = mirror_sync,
+    .close = mirror_close,
+    .throttle = mirror_throttle,
+};
+
+int kvtape_mirror_open(int fd, const char* path, loff_t lag, struct kvtape_mem* mem)
+{
+    struct kvtape_mirror* m = (struct kvtape_mirror*)kzalloc(sizeof(struct kvtape_mirror), GFP_KERNEL);
+    loff_t size = 0;
+
+    if (NULL == m) {
+        return -1;
+    }
+    m->image = fd;
+    m->lag = lag;
+    m->mem = mem;
+    m->fd = -1;
+    spin_lock_init(&m->lock);
+    INIT_LIST_HEAD(&m->queue);
+    init_waitqueue_head(&m->wait);
+    m->name = kstrdup(path, GFP_KERNEL);
+    m->buf = vmalloc(MIRROR_COPY_SIZE);
+    m->mirror = kernel_file_open(path, O_RDWR|O_CREAT);
+    if (NULL == m->name || NULL == m->buf || m->mirror < 0) {
+        goto fail;
+    }
+    size = kernel_file_size(fd);
+    if (kernel_file_size(m->mirror) != size) {
+        m->resync = size;
+    }
+    m->task = kthread_run(mirror_thread, m, "kvtape_mirror");
+    if (IS_ERR(m->task)) {
+        goto fail;
+    }
+    m->fd = kernel_file_open_ops(&mirror_ops, m);
+    if (m->fd < 0) {
+        kthread_stop(m->task);
+        goto fail;
+    }
+    spin_lock(&mirrors_lock);
+    list_add_tail(&m->list, &mirrors);
+    spin_unlock(&mirrors_lock);
+    printk("\nkvtape mirror %s: %lld bytes to copy over\n", path, (long long)m->resync);
+    return m->fd;
+
+fail:
+    printk("\nkvtape mirror %s: can't be opened\n", path);
+    mirror_free(m);
+    return -1;
+}
+
+int kvtape_mirror_drain(int fd)
+{
+    struct kvtape_mirror* m = NULL;
+    struct kvtape_mirror* p = NULL;
+
+    spin_lock(&mirrors_lock);
+    list_for_each_entry(p, &mirrors, list) {
+        if (p->fd == fd) {
+            m = p;
+            break;
+        }
+    }
+    spin_unlock(&mirrors_lock);
+    if (NULL == m) {
+        return 0;
+    }
+    wait_event(m->wait, mirror_idle(m));
+    return m->err;
+}
+
+static int mirror_line(struct kvtape_mirror* m, char* buf, size_t size)
+{
+    unsigned long oldest = 0;
+    int len = 0;
+
+    spin_lock(&m->lock);
+    oldest = m->oldest;
+    if (0 == oldest && !list_empty(&m->queue)) {
+        oldest = list_first_entry(&m->queue, struct mirror_op, list)->queued;
+    }
+    len = snprintf(buf, size, "%s %llu %u %llu %llu %llu %s\n", m->name,
+                   (unsigned long long)(m->queued >> 10),
+                   oldest ? jiffies_to_msecs(jiffies - oldest) : 0,
+                   (unsigned long long)(m->resync >> 20),
+                   (unsigned long long)(m->written >> 20),
+                   (unsigned long long)m->stalls,
+                   m->err ? "stale" : (m->resync ? "copying" : "ok"));
+    spin_unlock(&m->lock);
+    return len;
+}
+
+static ssize_t mirror_read(struct file* file, char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_mirror* m = NULL;
+    size_t size = 128;
+    char* buf = NULL;
+    int len = 0;
+    ssize_t ret = 0;
+
+    spin_lock(&mirrors_lock);
+    list_for_each_entry(m, &mirrors, list) {
+        size += strlen(m->name) + 128;
+    }
+    spin_unlock(&mirrors_lock);
+    buf = kmalloc(size, GFP_KERNEL);
+    if (NULL == buf) {
+        return -ENOMEM;
+    }
+    len = snprintf(buf, size, "mirror lag_kb lag_ms copy_mb written_mb stalls state\n");
+    spin_lock(&mirrors_lock);
+    list_for_each_entry(m, &mirrors, list) {
+        if (len >= size) {
+            break;
+        }
+        len += mirror_line(m, buf + len, size - len);
+    }
+    spin_unlock(&mirrors_lock);
+    ret = simple_read_from_buffer(ubuf, count, ppos, buf, len < size ? len : size - 1);
+    kfree(buf);
+    return ret;
+}
+
+static const struct file_operations mirror_fops = {
+    .owner = THIS_MODULE,
+    .read = mirror_read,
+};
+
+void kvtape_mirror_init(struct dentry* dir)
+{
+    if (dir) {
+        debugfs_create_file("mirror", S_IRUSR, dir, NULL, &mirror_fops);
+    }
+}
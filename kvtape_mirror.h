@@ -0,0 +1,37 @@
+/**
+ * @file   kvtape_mirror.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Mon Oct 26 09:14:52 2026
+ *
+ * @brief  Images copied to a second file as they are written.
+ *
+ * A mirrored image is one kernel_fop descriptor over the image and its
+ * mirror. Requests are served by the image; every change to it is queued
+ * and a thread replays the queue on the mirror, so the mirror trails the
+ * image by what is queued. Writers wait only while that is over the lag
+ * budget.
+ *
+ */
+
+#ifndef KVTAPE_MIRROR_H__
+#define KVTAPE_MIRROR_H__
+
+#include <linux/types.h>
+
+struct dentry;
+struct kvtape_mem;
+
+/*
+  Mirror the image open at fd to path, trailing it by up to lag bytes, the
+  data queued charged to mem. return a kernel_fop descriptor that owns fd
+  from now on, -1 on failure (fd is left as it is).
+*/
+int kvtape_mirror_open(int fd, const char* path, loff_t lag, struct kvtape_mem* mem);
+
+//wait until the mirror of fd has caught up. return 0, or the error that broke it.
+int kvtape_mirror_drain(int fd);
+
+//debugfs file listing every mirror.
+void kvtape_mirror_init(struct dentry* dir);
+
+#endif
@@ -0,0 +1,467 @@
+/**
+ * @file   kvtape_pack.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 13:52:08 2026
+ *
+ * @brief  Packed image format: records aggregated into fixed size containers.
+ *
+ * WRITE copies the record into the open container and completes; a full
+ * container goes to the image as one write on the I/O threads while the
+ * next one fills. Non-write commands and filemarks flush the open
+ * container. READ loads a whole container once and serves every record in
+ * it from memory; that copy is a cache the memory governor may drop.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include "kernel_fop.h"
+#include "kvtape.h"
+#include "kvtape_pack.h"
+
+#define MIN_CONTAINER_KB 128 //a container must hold the largest record
+
+struct pack_wreq {
+    struct kvtape_drive* drive;
+    char* buf;
+    __u32 len;
+    __u32 size;         //container size, charged as I/O until written
+};
+
+static inline struct kvtape_pack_hdr* pack_hdr(char* buf)
+{
+    return (struct kvtape_pack_hdr*)buf;
+}
+
+static inline loff_t pack_container(struct kvtape_pack* pack, loff_t offset)
+{
+    return offset & ~((loff_t)pack->size - 1);
+}
+
+static void pack_init_open(struct kvtape_pack* pack, __u32 first_blk)
+{
+    struct kvtape_pack_hdr* hdr = pack_hdr(pack->wbuf);
+
+    memset(pack->wbuf, 0, KVTAPE_PACK_DIR);
+    hdr->magic = KVTAPE_PACK_MAGIC;
+    hdr->size = pack->size;
+    hdr->epoch = pack->epoch;
+    hdr->first_blk = first_blk;
+}
+
+/*
+  Bytes of the open container worth writing: directory and payload up to
+  the next 4k boundary, with the slack zeroed.
+*/
+static __u32 pack_fill_tail(struct kvtape_pack* pack)
+{
+    __u32 used = KVTAPE_PACK_DIR + pack_hdr(pack->wbuf)->used;
+    __u32 len = (used + 4095) & ~4095;
+
+    if (len > pack->size) {
+        len = pack->size;
+    }
+    memset(pack->wbuf + used, 0, len - used);
+    return len;
+}
+
+static int pack_hdr_valid(struct kvtape_pack* pack, struct kvtape_pack_hdr* hdr, __u32 first_blk, __u32 epoch)
+{
+    __u32 used = 0;
+    __u32 i = 0;
+
+    if (KVTAPE_PACK_MAGIC != hdr->magic || pack->size != hdr->size ||
+        first_blk != hdr->first_blk || hdr->epoch < epoch ||
+        hdr->nr_recs > KVTAPE_PACK_MAX_RECS || hdr->used > pack->size - KVTAPE_PACK_DIR) {
+        return 0;
+    }
+    for (i = 0; i < hdr->nr_recs; i++) {
+        used += hdr->dir[i].len;
+    }
+    return used == hdr->used;
+}
+
+/**
+ * Pick the format of a drive's image: packed if it starts with a
+ * container, or if it is blank and container_kb asks for packing.
+ *
+ * @return 1 if packed, 0 for the stream format.
+ */
+int kvtape_pack_probe(struct kvtape_drive* drive, unsigned int container_kb)
+{
+    struct kvtape_pack_hdr hdr;
+    int ret = kernel_file_pread(drive->fd, &hdr, sizeof(hdr), 0);
+
+    memset(&drive->pack, 0, sizeof(drive->pack));
+    if (sizeof(hdr) == ret && KVTAPE_PACK_MAGIC == hdr.magic) {
+        if (!is_power_of_2(hdr.size) || hdr.size < MIN_CONTAINER_KB * 1024) {
+            printk("\nkvtape drive%d bad container size %u\n", drive->id, hdr.size);
+            return 0;
+        }
+        drive->pack.size = hdr.size;
+        return 1;
+    }
+    //a blank image has no records, or a zero header from dd.
+    if (container_kb && (ret < 4 || 0 == hdr.magic)) {
+        if (container_kb < MIN_CONTAINER_KB) {
+            container_kb = MIN_CONTAINER_KB;
+        }
+        drive->pack.size = roundup_pow_of_two(container_kb) * 1024;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild the index from the container directories and open the last
+ * container for appends.
+ *
+ * @return number of records found, negative on error.
+ */
+int kvtape_pack_load(struct kvtape_drive* drive)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_index* idx = &drive->index;
+    struct kvtape_pack_hdr* hdr = NULL;
+    loff_t off = 0;
+    loff_t last = -1;
+    __u32 epoch = 0;
+
+    idx->hdr_len = 0;
+    kvtape_index_truncate(idx, 0);
+    pack->wbuf = vmalloc(pack->size);
+    pack->rbuf = vmalloc(pack->size);
+    pack->roff = -1;
+    if (pack->wbuf) {
+        kvtape_mem_charge(&drive->mem, KVTAPE_MEM_PINNED, pack->size);
+    }
+    if (pack->rbuf) {
+        kvtape_mem_charge(&drive->mem, KVTAPE_MEM_CACHE, pack->size);
+    }
+    if (NULL == pack->wbuf || NULL == pack->rbuf) {
+        return -ENOMEM;
+    }
+
+    hdr = pack_hdr(pack->rbuf);
+    for (;;) {
+        loff_t payload = off + KVTAPE_PACK_DIR;
+        __u32 i = 0;
+
+        if (KVTAPE_PACK_DIR != kernel_file_pread(drive->fd, pack->rbuf, KVTAPE_PACK_DIR, off)) {
+            break;
+        }
+        if (!pack_hdr_valid(pack, hdr, idx->count, epoch)) {
+            break;
+        }
+        for (i = 0; i < hdr->nr_recs; i++) {
+            if (kvtape_index_append(idx, payload, hdr->dir[i].len, hdr->dir[i].type) < 0) {
+                return -ENOMEM;
+            }
+            payload += hdr->dir[i].len;
+        }
+        epoch = hdr->epoch;
+        last = off;
+        off += pack->size;
+    }
+    pack->epoch = epoch;
+
+    //appends continue in the last container.
+    if (last >= 0 && kernel_file_pread(drive->fd, pack->wbuf, pack->size, last) >= KVTAPE_PACK_DIR) {
+        pack->woff = last;
+    } else {
+        pack->woff = 0;
+        pack_init_open(pack, idx->count);
+    }
+    pack->dirty = 0;
+
+    printk("\nkvtape drive%d packed image, %u KB containers, %u records\n",
+           drive->id, pack->size / 1024, idx->count);
+    return idx->count;
+}
+
+void kvtape_pack_free(struct kvtape_drive* drive)
+{
+    if (drive->pack.wbuf) {
+        kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_PINNED, drive->pack.size);
+    }
+    kvtape_pack_drop(drive);
+    vfree(drive->pack.wbuf);
+    drive->pack.wbuf = NULL;
+}
+
+//free the read cache; the next READ outside the open container reloads it.
+void kvtape_pack_drop(struct kvtape_drive* drive)
+{
+    struct kvtape_pack* pack = &drive->pack;
+
+    if (pack->rbuf) {
+        vfree(pack->rbuf);
+        pack->rbuf = NULL;
+        pack->roff = -1;
+        kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_CACHE, pack->size);
+    }
+}
+
+static void pack_write_done(void* priv, int ret)
+{
+    struct pack_wreq* req = (struct pack_wreq*)priv;
+
+    if (ret != (int)req->len) {
+        printk("\nkvtape drive%d container write returned %d/%u\n", req->drive->id, ret, req->len);
+        req->drive->pack.werr = 1;
+    }
+    vfree(req->buf);
+    kvtape_mem_uncharge(&req->drive->mem, KVTAPE_MEM_IO, req->size);
+    kvtape_drive_io_put(req->drive);
+    kfree(req);
+}
+
+/*
+  Hand the open container to the I/O threads and start a new one behind it.
+  The container in flight is charged as I/O, so a writer that outruns the
+  image waits here for room in the memory budget.
+*/
+static int pack_seal(struct kvtape_drive* drive)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_pack_hdr* hdr = pack_hdr(pack->wbuf);
+    __u32 next_blk = hdr->first_blk + hdr->nr_recs;
+    struct pack_wreq* req = NULL;
+    char* next = NULL;
+
+    kvtape_mem_charge(&drive->mem, KVTAPE_MEM_IO, pack->size);
+    next = vmalloc(pack->size);
+    if (NULL == next) {
+        kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_IO, pack->size);
+        return -ENOMEM;
+    }
+
+    if (pack->dirty) {
+        req = (struct pack_wreq*)kmalloc(sizeof(struct pack_wreq), GFP_KERNEL);
+        if (NULL == req) {
+            vfree(next);
+            kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_IO, pack->size);
+            return -ENOMEM;
+        }
+        req->drive = drive;
+        req->buf = pack->wbuf;
+        req->len = pack_fill_tail(pack);
+        req->size = pack->size;
+        kernel_file_throttle(drive->fd, req->len, pack->woff);
+        kvtape_drive_io_get(drive);
+        if (kernel_file_submit(drive->fd, KERNEL_FILE_WRITE, req->buf, req->len, pack->woff,
+                               pack_write_done, req) < 0) {
+            pack_write_done(req, kernel_file_pwrite(drive->fd, req->buf, req->len, pack->woff));
+        }
+    } else {
+        vfree(pack->wbuf);
+        kvtape_mem_uncharge(&drive->mem, KVTAPE_MEM_IO, pack->size);
+    }
+
+    if (pack->roff == pack->woff) {
+        pack->roff = -1;
+    }
+    pack->woff += pack->size;
+    pack->wbuf = next;
+    pack_init_open(pack, next_blk);
+    pack->dirty = 0;
+    return 0;
+}
+
+/**
+ * Make room for a len byte record in the open container, sealing it if
+ * the record does not fit.
+ *
+ * @return where the caller copies the payload, NULL if out of memory.
+ */
+char* kvtape_pack_reserve(struct kvtape_drive* drive, __u32 len)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_pack_hdr* hdr = pack_hdr(pack->wbuf);
+
+    if (KVTAPE_PACK_MAX_RECS == hdr->nr_recs || KVTAPE_PACK_DIR + hdr->used + len > pack->size) {
+        if (pack_seal(drive) < 0) {
+            return NULL;
+        }
+        hdr = pack_hdr(pack->wbuf);
+    }
+    return pack->wbuf + KVTAPE_PACK_DIR + hdr->used;
+}
+
+//account the record reserved last in the directory and the index.
+int kvtape_pack_commit(struct kvtape_drive* drive, __u32 len, __u8 type)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_pack_hdr* hdr = pack_hdr(pack->wbuf);
+    loff_t payload = pack->woff + KVTAPE_PACK_DIR + hdr->used;
+
+    if (kvtape_index_append(&drive->index, payload, len, type) < 0) {
+        return -ENOMEM;
+    }
+    hdr->dir[hdr->nr_recs].len = len;
+    hdr->dir[hdr->nr_recs].type = type;
+    hdr->nr_recs++;
+    hdr->used += len;
+    pack->dirty = 1;
+    return 0;
+}
+
+int kvtape_pack_append(struct kvtape_drive* drive, const char* data, __u32 len, __u8 type)
+{
+    char* dst = kvtape_pack_reserve(drive, len);
+    if (NULL == dst) {
+        return -ENOMEM;
+    }
+    memcpy(dst, data, len);
+    return kvtape_pack_commit(drive, len, type);
+}
+
+//write the open container as it is; it stays open for further appends.
+int kvtape_pack_flush(struct kvtape_drive* drive)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    __u32 len = 0;
+
+    if (!pack->dirty) {
+        return 0;
+    }
+    len = pack_fill_tail(pack);
+    if (kernel_file_pwrite(drive->fd, pack->wbuf, len, pack->woff) != (int)len) {
+        pack->werr = 1;
+        return -EIO;
+    }
+    if (pack->roff == pack->woff) {
+        pack->roff = -1;
+    }
+    pack->dirty = 0;
+    return 0;
+}
+
+int kvtape_pack_read(struct kvtape_drive* drive, struct kvtape_rec* rec, char* dst, __u32 len)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    loff_t coff = pack_container(pack, rec->offset);
+    char* src = NULL;
+
+    if (coff == pack->woff) {
+        src = pack->wbuf;
+    } else {
+        if (NULL == pack->rbuf) {
+            pack->rbuf = vmalloc(pack->size);
+            if (NULL == pack->rbuf) {
+                return -ENOMEM;
+            }
+            kvtape_mem_charge(&drive->mem, KVTAPE_MEM_CACHE, pack->size);
+            pack->roff = -1;
+        }
+        if (coff != pack->roff) {
+            int ret = kernel_file_pread(drive->fd, pack->rbuf, pack->size, coff);
+            if (ret < (int)(rec->offset - coff + len)) {
+                pack->roff = -1;
+                return -EIO;
+            }
+            pack->roff = coff;
+        }
+        src = pack->rbuf;
+    }
+    memcpy(dst, src + (rec->offset - coff), len);
+    return 0;
+}
+
+/**
+ * Make blkno the new EOD: its container becomes the open one, cut after
+ * the records in front of blkno and stamped with a new epoch.
+ */
+int kvtape_pack_truncate(struct kvtape_drive* drive, __u32 blkno)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_rec* rec = kvtape_index_get(&drive->index, blkno);
+    struct kvtape_pack_hdr* hdr = NULL;
+    loff_t coff = 0;
+    __u32 n = 0;
+
+    if (NULL == rec) {
+        return 0;
+    }
+    coff = pack_container(pack, rec->offset);
+    if (coff != pack->woff) {
+        //the open container lies behind the new EOD, drop it unwritten.
+        kvtape_drive_drain(drive);
+        if (kernel_file_pread(drive->fd, pack->wbuf, pack->size, coff) < KVTAPE_PACK_DIR) {
+            return -EIO;
+        }
+        pack->woff = coff;
+    }
+
+    hdr = pack_hdr(pack->wbuf);
+    n = blkno - hdr->first_blk;
+    memset(&hdr->dir[n], 0, (hdr->nr_recs - n) * sizeof(struct kvtape_pack_ent));
+    hdr->nr_recs = n;
+    hdr->used = rec->offset - coff - KVTAPE_PACK_DIR;
+    hdr->epoch = ++pack->epoch;
+    pack->dirty = 1;
+    if (pack->roff >= coff) {
+        pack->roff = -1;
+    }
+    kvtape_index_truncate(&drive->index, blkno);
+    return 0;
+}
+
+//image size that holds everything up to EOD.
+loff_t kvtape_pack_end(struct kvtape_drive* drive)
+{
+    struct kvtape_pack* pack = &drive->pack;
+
+    if (0 == pack_hdr(pack->wbuf)->nr_recs) {
+        return pack->woff;
+    }
+    return pack->woff + pack->size;
+}
+
+/**
+ * Where a snapshot of the records before blkno ends in the image. If
+ * blkno falls inside a container, or is EOD inside the open one, dir gets
+ * a copy of that container's directory cut before blkno and *dir_off its
+ * offset, else *dir_off is -1.
+ * The open container must have been flushed.
+ *
+ * @return image bytes the snapshot takes, negative on error.
+ */
+loff_t kvtape_pack_snapshot(struct kvtape_drive* drive, __u32 blkno, char* dir, loff_t* dir_off)
+{
+    struct kvtape_pack* pack = &drive->pack;
+    struct kvtape_rec* rec = kvtape_index_get(&drive->index, blkno);
+    struct kvtape_pack_hdr* hdr = pack_hdr(dir);
+    loff_t coff = 0;
+    __u32 len = 0;
+    __u32 n = 0;
+
+    *dir_off = -1;
+    if (NULL == rec) {
+        //the open container fills up in place, keep its directory as it is now.
+        if (0 == pack_hdr(pack->wbuf)->nr_recs) {
+            return pack->woff;
+        }
+        memcpy(dir, pack->wbuf, KVTAPE_PACK_DIR);
+        coff = pack->woff;
+    } else {
+        coff = pack_container(pack, rec->offset);
+        if (coff == pack->woff) {
+            memcpy(dir, pack->wbuf, KVTAPE_PACK_DIR);
+        } else if (kernel_file_pread(drive->fd, dir, KVTAPE_PACK_DIR, coff) != KVTAPE_PACK_DIR) {
+            return -EIO;
+        }
+        n = blkno - hdr->first_blk;
+        if (0 == n) {
+            return coff;
+        }
+        memset(&hdr->dir[n], 0, (hdr->nr_recs - n) * sizeof(struct kvtape_pack_ent));
+        hdr->nr_recs = n;
+        hdr->used = rec->offset - coff - KVTAPE_PACK_DIR;
+    }
+    *dir_off = coff;
+    len = (KVTAPE_PACK_DIR + hdr->used + 4095) & ~4095;
+    return coff + (len < pack->size ? len : pack->size);
+}
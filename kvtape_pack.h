@@ -0,0 +1,76 @@
+/**
+ * @file   kvtape_pack.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 13:40:26 2026
+ *
+ * @brief  Packed image format: records aggregated into fixed size containers.
+ *
+ * A packed image is a row of containers of the same power of two size.
+ * Each starts with a KVTAPE_PACK_DIR byte directory (header + one entry
+ * per record) followed by the payloads back to back. Records are
+ * collected in the open container in memory and the backing file only
+ * sees whole container writes and reads.
+ *
+ * epoch is raised whenever the tape is rewritten in the middle, so
+ * containers left behind the new EOD are recognized as stale on load.
+ *
+ */
+
+#ifndef KVTAPE_PACK_H__
+#define KVTAPE_PACK_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_PACK_MAGIC 0x4b50564b /* "KVPK" */
+#define KVTAPE_PACK_DIR   4096
+
+struct kvtape_pack_ent {
+    __u32 len;
+    __u32 type;         //enum _filemark
+};
+
+struct kvtape_pack_hdr {
+    __u32 magic;
+    __u32 size;         //container size in bytes
+    __u32 epoch;
+    __u32 first_blk;    //logical block of dir[0]
+    __u32 nr_recs;
+    __u32 used;         //payload bytes
+    struct kvtape_pack_ent dir[0];
+};
+
+#define KVTAPE_PACK_MAX_RECS \
+    ((KVTAPE_PACK_DIR - sizeof(struct kvtape_pack_hdr)) / sizeof(struct kvtape_pack_ent))
+
+#ifdef __KERNEL__
+
+struct kvtape_drive;
+struct kvtape_rec;
+
+struct kvtape_pack {
+    __u32 size;         //container size, 0 for the stream format
+    __u32 epoch;
+    char* wbuf;         //open container
+    loff_t woff;        //its image offset
+    int dirty;          //wbuf differs from the image
+    int werr;           //a container write failed, reported on the next write
+    char* rbuf;         //last container read
+    loff_t roff;        //its image offset, -1 if none
+};
+
+int kvtape_pack_probe(struct kvtape_drive* drive, unsigned int container_kb);
+int kvtape_pack_load(struct kvtape_drive* drive);
+void kvtape_pack_free(struct kvtape_drive* drive);
+void kvtape_pack_drop(struct kvtape_drive* drive);
+char* kvtape_pack_reserve(struct kvtape_drive* drive, __u32 len);
+int kvtape_pack_commit(struct kvtape_drive* drive, __u32 len, __u8 type);
+int kvtape_pack_append(struct kvtape_drive* drive, const char* data, __u32 len, __u8 type);
+int kvtape_pack_flush(struct kvtape_drive* drive);
+int kvtape_pack_read(struct kvtape_drive* drive, struct kvtape_rec* rec, char* dst, __u32 len);
+int kvtape_pack_truncate(struct kvtape_drive* drive, __u32 blkno);
+loff_t kvtape_pack_end(struct kvtape_drive* drive);
+loff_t kvtape_pack_snapshot(struct kvtape_drive* drive, __u32 blkno, char* dir, loff_t* dir_off);
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * @file   kvtape_sg.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sat Oct 24 10:21:53 2026
+ *
+ * @brief  Data moves between the drive and a command's scatterlist.
+ *
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
+#include <scsi/scsi_cmnd.h>
+#include "kernel_fop.h"
+#include "kvtape_sg.h"
+
+//atomic mappings used a per-cpu slot shared with interrupts before 2.6.37.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,37)
+#define sg_map_lock(flags) local_irq_save(flags)
+#define sg_map_unlock(flags) local_irq_restore(flags)
+#else
+#define sg_map_lock(flags) ((void)(flags))
+#define sg_map_unlock(flags) ((void)(flags))
+#endif
+
+/*
+  The entry skip falls in, skip made relative to it. Whole entries are
+  stepped over without being mapped.
+*/
+static struct scatterlist* sg_seek(struct scsi_cmnd* cmnd, size_t* skip, unsigned int* nents)
+{
+    struct scatterlist* sg = scsi_sglist(cmnd);
+
+    *nents = scsi_sg_count(cmnd);
+    while (sg && *nents && *skip >= sg->length) {
+        *skip -= sg->length;
+        sg = sg_next(sg);
+        (*nents)--;
+    }
+    return *nents ? sg : NULL;
+}
+
+/*
+  Records run to several MB, so each page is mapped, copied and unmapped
+  on its own and interrupts are only held off for one page at a time.
+*/
+size_t kvtape_sg_copy(struct scsi_cmnd* cmnd, void* buf, size_t len, size_t skip, int to_sg)
+{
+    struct sg_mapping_iter miter;
+    struct scatterlist* sg = NULL;
+    unsigned int nents = 0;
+    unsigned long flags = 0;
+    size_t copied = 0;
+
+    sg = sg_seek(cmnd, &skip, &nents);
+    if (NULL == sg || 0 == len) {
+        return 0;
+    }
+    sg_miter_start(&miter, sg, nents, SG_MITER_ATOMIC | (to_sg ? SG_MITER_TO_SG : SG_MITER_FROM_SG));
+    while (copied < len) {
+        size_t n = 0;
+
+        sg_map_lock(flags);
+        if (!sg_miter_next(&miter)) {
+            sg_map_unlock(flags);
+            break;
+        }
+        if (skip >= miter.length) {
+            skip -= miter.length;
+        } else {
+            n = min_t(size_t, miter.length - skip, len - copied);
+            if (to_sg) {
+                memcpy(miter.addr + skip, (char*)buf + copied, n);
+            } else {
+                memcpy((char*)buf + copied, miter.addr + skip, n);
+            }
+            skip = 0;
+            copied += n;
+        }
+        sg_miter_stop(&miter);
+        sg_map_unlock(flags);
+    }
+    return copied;
+}
+
+void kvtape_sg_reply(struct scsi_cmnd* cmnd, const void* buf, size_t len)
+{
+    size_t copied = kvtape_sg_copy(cmnd, (void*)buf, min_t(size_t, len, scsi_bufflen(cmnd)), 0, 1);
+
+    scsi_set_resid(cmnd, scsi_bufflen(cmnd) - copied);
+}
+
+size_t kvtape_sg_fetch(struct scsi_cmnd* cmnd, void* buf, size_t len)
+{
+    size_t copied = kvtape_sg_copy(cmnd, buf, min_t(size_t, len, scsi_bufflen(cmnd)), 0, 0);
+
+    scsi_set_resid(cmnd, scsi_bufflen(cmnd) - copied);
+    return copied;
+}
+
+void kvtape_sg_target(struct scsi_cmnd* cmnd, size_t skip, struct kernel_file_sg* target)
+{
+    target->sgl = sg_seek(cmnd, &skip, &target->nents);
+    target->skip = skip;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file   kvtape_sg.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sat Oct 24 10:08:26 2026
+ *
+ * @brief  Data moves between the drive and a command's scatterlist.
+ *
+ * Every command's data goes through here. The scatterlist is walked a page
+ * at a time with atomic mappings, so entries spanning several pages or
+ * sitting in highmem are fine and no kmap slot is held across a copy.
+ * A READ of plain records skips the copy altogether: kernel_fop reads the
+ * image straight into the scatterlist's pages (KERNEL_FILE_READ_SG).
+ *
+ */
+
+#ifndef KVTAPE_SG_H__
+#define KVTAPE_SG_H__
+
+#include <linux/types.h>
+
+struct scsi_cmnd;
+struct kernel_file_sg;
+
+//copy len bytes at skip in the scatterlist; return the bytes copied.
+size_t kvtape_sg_copy(struct scsi_cmnd* cmnd, void* buf, size_t len, size_t skip, int to_sg);
+
+//data-in of a command that returns buf, the residual is what it leaves.
+void kvtape_sg_reply(struct scsi_cmnd* cmnd, const void* buf, size_t len);
+
+//data-out taken into buf, the residual is what is left of it.
+size_t kvtape_sg_fetch(struct scsi_cmnd* cmnd, void* buf, size_t len);
+
+//where a KERNEL_FILE_READ_SG lands: the scatterlist from skip on.
+void kvtape_sg_target(struct scsi_cmnd* cmnd, size_t skip, struct kernel_file_sg* target);
+
+#endif
@@ -0,0 +1,478 @@
+/**
+ * @file   kvtape_tier.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Fri Oct 23 09:42:18 2026
+ *
+ * @brief  Images staged on a fast device and migrated to bulk storage.
+ *
+ * The stage file mirrors the image offset for offset. The migrator copies
+ * the segment behind the migration point to the bulk file once it is full
+ * (or the drive has been idle for a while, or the stage is over its
+ * high-water mark), syncs it, moves the point on and tries to punch the
+ * segment out of the stage; before 2.6.38 it stays there, unused, until
+ * the image is truncated below it. Moving the point
+ * takes the tier's semaphore for writing, every request holds it for
+ * reading, so a request sees one point from start to end; a write into
+ * the segment while it is being copied makes the migrator copy it again.
+ * The point is kept in <stage>.tier, the image is whole again after a
+ * reload.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/rwsem.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/debugfs.h>
+#include "kernel_fop.h"
+#include "kvtape_tier.h"
+
+#define TIER_COPY_SIZE (1024 * 1024)
+#define TIER_IDLE (HZ)          //a drive this long without writes has its tail migrated
+
+struct kvtape_tier {
+    int bulk;
+    int stage;
+    int state;                  //<stage>.tier, the migration point
+    loff_t segment;
+    loff_t high;
+    struct rw_semaphore sem;    //held for reading by requests, for writing to move the point
+    spinlock_t lock;            //end and the segment being copied
+    loff_t migrated;            //bulk holds [0, migrated), the stage the rest
+    loff_t end;                 //image size, the stage file's
+    loff_t copy_from;           //segment being copied
+    loff_t copy_to;
+    int copy_dirty;             //written while being copied
+    int failed;                 //the last migration failed, writes don't wait for it
+    unsigned long last_write;
+    wait_queue_head_t wait;     //writers over the high-water mark, the migrator
+    struct task_struct* task;
+    char* buf;
+    char* name;
+};
+
+//all tiers, for debugfs.
+static struct {
+    spinlock_t lock;
+    u64 staged;                 //bytes on the stages not migrated yet
+    u64 migrated;
+    u64 segments;
+    u64 stalls;                 //writes that waited for the migrator
+} tiers = {
+    .lock = __SPIN_LOCK_UNLOCKED(tiers.lock),
+};
+
+static void tier_count(s64 staged, loff_t migrated, int stalls)
+{
+    spin_lock(&tiers.lock);
+    tiers.staged += staged;
+    tiers.migrated += migrated;
+    tiers.segments += migrated > 0;
+    tiers.stalls += stalls;
+    spin_unlock(&tiers.lock);
+}
+
+static loff_t tier_staged(struct kvtape_tier* tier)
+{
+    loff_t staged = 0;
+
+    spin_lock(&tier->lock);
+    staged = tier->end - tier->migrated;
+    spin_unlock(&tier->lock);
+    return staged;
+}
+
+static int tier_save(struct kvtape_tier* tier)
+{
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%020lld\n", (long long)tier->migrated);
+
+    if (kernel_file_pwrite(tier->state, buf, len, 0) != len) {
+        return -EIO;
+    }
+    return kernel_file_sync(tier->state);
+}
+
+//[offset, offset + count) of the image, split at the migration point.
+static int tier_rw(struct kvtape_tier* tier, int rw, char* buf, size_t count, loff_t offset)
+{
+    size_t low = 0;
+    int ret = 0;
+    int n = 0;
+
+    if (offset < tier->migrated) {
+        low = min_t(loff_t, count, tier->migrated - offset);
+        ret = KERNEL_FILE_WRITE == rw ? kernel_file_pwrite(tier->bulk, buf, low, offset) :
+            kernel_file_pread(tier->bulk, buf, low, offset);
+        if (ret != (int)low || low == count) {
+            return ret;
+        }
+    }
+    n = KERNEL_FILE_WRITE == rw ? kernel_file_pwrite(tier->stage, buf + low, count - low, offset + low) :
+        kernel_file_pread(tier->stage, buf + low, count - low, offset + low);
+    if (n < 0) {
+        return low ? (int)low : n;
+    }
+    return low + n;
+}
+
+static int tier_write(struct kvtape_tier* tier, char* buf, size_t count, loff_t offset)
+{
+    loff_t end = offset + count;
+    loff_t grown = 0;
+    int ret = 0;
+
+    down_read(&tier->sem);
+    ret = tier_rw(tier, KERNEL_FILE_WRITE, buf, count, offset);
+    spin_lock(&tier->lock);
+    if (end > tier->copy_from && offset < tier->copy_to) {
+        tier->copy_dirty = 1;
+    }
+    if (ret > 0 && offset + ret > tier->end) {
+        grown = offset + ret - tier->end;
+        tier->end = offset + ret;
+    }
+    tier->last_write = jiffies;
+    spin_unlock(&tier->lock);
+    up_read(&tier->sem);
+    tier_count(grown, 0, 0);
+    if (tier_staged(tier) >= tier->segment) {
+        wake_up(&tier->wait);
+    }
+    return ret;
+}
+
+//cut the image at length, on both tiers if it ends below the migration point.
+static int tier_truncate(struct kvtape_tier* tier, loff_t length)
+{
+    loff_t staged = 0;
+    int ret = 0;
+
+    down_write(&tier->sem);
+    staged = tier_staged(tier);
+    if (length < tier->migrated) {
+        ret = kernel_file_truncate(tier->bulk, length);
+        tier->migrated = length;
+        if (0 == ret) {
+            ret = tier_save(tier);
+        }
+    }
+    if (0 == ret) {
+        ret = kernel_file_truncate(tier->stage, length);
+    }
+    spin_lock(&tier->lock);
+    tier->end = kernel_file_size(tier->stage);
+    tier->copy_dirty = 1;
+    spin_unlock(&tier->lock);
+    tier_count(tier_staged(tier) - staged, 0, 0);
+    up_write(&tier->sem);
+    wake_up(&tier->wait);
+    return ret;
+}
+
+//punch and preallocate: each tier gets its part, preallocation only the stage's.
+static int tier_space(struct kvtape_tier* tier, int rw, size_t count, loff_t offset)
+{
+    loff_t low = 0;
+    int ret = 0;
+
+    down_read(&tier->sem);
+    if (offset < tier->migrated) {
+        low = min_t(loff_t, count, tier->migrated - offset);
+        if (KERNEL_FILE_PUNCH == rw) {
+            ret = kernel_file_punch(tier->bulk, offset, low);
+        }
+    }
+    if (0 == ret && low < count) {
+        ret = KERNEL_FILE_PUNCH == rw ? kernel_file_punch(tier->stage, offset + low, count - low) :
+            kernel_file_prealloc(tier->stage, offset + low, count - low);
+        spin_lock(&tier->lock);
+        if (KERNEL_FILE_PUNCH == rw && offset + count > tier->copy_from && offset < tier->copy_to) {
+            tier->copy_dirty = 1;
+        }
+        spin_unlock(&tier->lock);
+    }
+    up_read(&tier->sem);
+    return ret;
+}
+
+static int tier_io(void* priv, int rw, void* buf, size_t count, loff_t offset)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)priv;
+    int ret = 0;
+
+    switch (rw) {
+    case KERNEL_FILE_WRITE:
+        return tier_write(tier, buf, count, offset);
+    case KERNEL_FILE_TRUNCATE:
+        return tier_truncate(tier, offset);
+    case KERNEL_FILE_PUNCH:
+    case KERNEL_FILE_PREALLOC:
+        return tier_space(tier, rw, count, offset);
+    default:
+        down_read(&tier->sem);
+        ret = tier_rw(tier, KERNEL_FILE_READ, buf, count, offset);
+        up_read(&tier->sem);
+        return ret;
+    }
+}
+
+//appends wait for the migrator while the stage is full, on the writer's thread.
+static void tier_throttle(void* priv, size_t count, loff_t offset)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)priv;
+
+    if (offset + count > tier->migrated && tier_staged(tier) >= tier->high && !tier->failed) {
+        tier_count(0, 0, 1);
+        wake_up(&tier->wait);
+        wait_event(tier->wait, tier_staged(tier) < tier->high || tier->failed);
+    }
+}
+
+static loff_t tier_size(void* priv)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)priv;
+    loff_t end = 0;
+
+    spin_lock(&tier->lock);
+    end = tier->end;
+    spin_unlock(&tier->lock);
+    return end;
+}
+
+static int tier_sync(void* priv)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)priv;
+    int ret = kernel_file_sync(tier->stage);
+
+    return ret ? ret : kernel_file_sync(tier->bulk);
+}
+
+/*
+  The segment behind the migration point if it should go now: a full one,
+  or the tail once the drive is idle or the stage is over high water.
+*/
+static loff_t tier_ready(struct kvtape_tier* tier)
+{
+    loff_t staged = 0;
+    int idle = 0;
+
+    spin_lock(&tier->lock);
+    staged = tier->end - tier->migrated;
+    idle = time_after(jiffies, tier->last_write + TIER_IDLE);
+    spin_unlock(&tier->lock);
+    if (staged >= tier->segment) {
+        return tier->segment;
+    }
+    return staged > 0 && (idle || staged >= tier->high) ? staged : 0;
+}
+
+//copy [from, to) from the stage to bulk. return 0, or -EAGAIN if it was written meanwhile.
+static int tier_copy(struct kvtape_tier* tier, loff_t from, loff_t to)
+{
+    loff_t off = from;
+
+    while (off < to) {
+        int len = min_t(loff_t, TIER_COPY_SIZE, to - off);
+        int n = kernel_file_pread(tier->stage, tier->buf, len, off);
+
+        if (n != len) {
+            return n < 0 ? n : -EAGAIN;
+        }
+        if (kernel_file_pwrite(tier->bulk, tier->buf, len, off) != len) {
+            return -EIO;
+        }
+        off += len;
+        if (tier->copy_dirty) {
+            return -EAGAIN;
+        }
+    }
+    return kernel_file_sync(tier->bulk);
+}
+
+static int tier_migrate(struct kvtape_tier* tier, loff_t len)
+{
+    loff_t from = tier->migrated;
+    loff_t to = from + len;
+    int ret = 0;
+
+    spin_lock(&tier->lock);
+    tier->copy_from = from;
+    tier->copy_to = to;
+    tier->copy_dirty = 0;
+    spin_unlock(&tier->lock);
+
+    ret = tier_copy(tier, from, to);
+
+    down_write(&tier->sem);
+    spin_lock(&tier->lock);
+    if (tier->copy_dirty || tier->migrated != from) {
+        ret = -EAGAIN;
+    }
+    tier->copy_from = tier->copy_to = 0;
+    spin_unlock(&tier->lock);
+    if (0 == ret) {
+        tier->migrated = to;
+        ret = tier_save(tier);
+    }
+    if (0 == ret) {
+        //no request is left that could read it from the stage.
+        kernel_file_punch(tier->stage, from, len);
+        tier_count(-len, len, 0);
+    }
+    up_write(&tier->sem);
+    wake_up(&tier->wait);
+    return ret;
+}
+
+static int tier_thread(void* data)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)data;
+    loff_t len = 0;
+    int ret = 0;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(tier->wait, kthread_should_stop() || tier_ready(tier), TIER_IDLE);
+        len = kthread_should_stop() ? 0 : tier_ready(tier);
+        if (0 == len) {
+            continue;
+        }
+        ret = tier_migrate(tier, len);
+        tier->failed = ret && -EAGAIN != ret;
+        if (tier->failed) {
+            printk("\nkvtape tier %s: migration failed %d, retrying\n", tier->name, ret);
+            wake_up(&tier->wait);
+            schedule_timeout_interruptible(TIER_IDLE);
+        }
+    }
+    return 0;
+}
+
+static void tier_free(struct kvtape_tier* tier)
+{
+    kernel_file_close(tier->state);
+    kernel_file_close(tier->stage);
+    kernel_file_close(tier->bulk);
+    vfree(tier->buf);
+    kfree(tier->name);
+    kfree(tier);
+}
+
+static void tier_close(void* priv)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)priv;
+
+    kthread_stop(tier->task);
+    tier_count(-tier_staged(tier), 0, 0);
+    tier_free(tier);
+}
+
+static const struct kernel_file_ops tier_ops = {
+    .io = tier_io,
+    .size = tier_size,
+    .sync = tier_sync,
+    .close = tier_close,
+    .throttle = tier_throttle,
+};
+
+/*
+  Where the migration point was left. Without <stage>.tier the image is
+  all on bulk, e.g. one staged for the first time.
+*/
+static loff_t tier_load(struct kvtape_tier* tier)
+{
+    char buf[24];
+    int n = kernel_file_pread(tier->state, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0) {
+        return kernel_file_size(tier->bulk);
+    }
+    buf[n] = 0;
+    return simple_strtoll(buf, NULL, 10);
+}
+
+int kvtape_tier_open(const char* image, const char* dir, loff_t segment, loff_t high)
+{
+    struct kvtape_tier* tier = (struct kvtape_tier*)kzalloc(sizeof(struct kvtape_tier), GFP_KERNEL);
+    char* stage = NULL;
+    char* state = NULL;
+    char* p = NULL;
+    int fd = -1;
+
+    if (NULL == tier) {
+        return -1;
+    }
+    tier->bulk = tier->stage = tier->state = -1;
+    tier->segment = max_t(loff_t, segment, TIER_COPY_SIZE);
+    tier->high = max(high, tier->segment);
+    init_rwsem(&tier->sem);
+    spin_lock_init(&tier->lock);
+    init_waitqueue_head(&tier->wait);
+    tier->last_write = jiffies;
+    tier->name = kstrdup(image, GFP_KERNEL);
+    tier->buf = vmalloc(TIER_COPY_SIZE);
+
+    //every image gets its own stage, named after its whole path.
+    stage = tier->name ? kasprintf(GFP_KERNEL, "%s/%s.stage", dir, tier->name) : NULL;
+    for (p = stage ? stage + strlen(dir) + 1 : NULL; p && *p; p++) {
+        if ('/' == *p) {
+            *p = '_';
+        }
+    }
+    state = stage ? kasprintf(GFP_KERNEL, "%s.tier", stage) : NULL;
+    if (NULL == state || NULL == tier->buf) {
+        goto fail;
+    }
+    tier->bulk = kernel_file_open(image, O_RDWR|O_CREAT);
+    tier->stage = kernel_file_open(stage, O_RDWR|O_CREAT);
+    tier->state = kernel_file_open(state, O_RDWR|O_CREAT);
+    if (tier->bulk < 0 || tier->stage < 0 || tier->state < 0) {
+        goto fail;
+    }
+    tier->migrated = tier_load(tier);
+    //a new or lost stage leaves a hole up to the migration point.
+    if (kernel_file_size(tier->stage) < tier->migrated &&
+        kernel_file_truncate(tier->stage, tier->migrated) < 0) {
+        goto fail;
+    }
+    tier->end = kernel_file_size(tier->stage);
+    if (tier_save(tier) < 0) {
+        goto fail;
+    }
+    tier->task = kthread_run(tier_thread, tier, "kvtape_tier");
+    if (IS_ERR(tier->task)) {
+        goto fail;
+    }
+    fd = kernel_file_open_ops(&tier_ops, tier);
+    if (fd < 0) {
+        kthread_stop(tier->task);
+        goto fail;
+    }
+    tier_count(tier_staged(tier), 0, 0);
+    printk("\nkvtape tier %s: stage %s, %lld bytes staged\n", image, stage, (long long)tier_staged(tier));
+    kfree(stage);
+    kfree(state);
+    return fd;
+
+fail:
+    printk("\nkvtape tier %s: can't stage in %s\n", image, dir);
+    kfree(stage);
+    kfree(state);
+    tier_free(tier);
+    return -1;
+}
+
+void kvtape_tier_init(struct dentry* dir)
+{
+    if (dir) {
+        debugfs_create_u64("tier_staged", S_IRUGO, dir, &tiers.staged);
+        debugfs_create_u64("tier_migrated", S_IRUGO, dir, &tiers.migrated);
+        debugfs_create_u64("tier_segments", S_IRUGO, dir, &tiers.segments);
+        debugfs_create_u64("tier_stalls", S_IRUGO, dir, &tiers.stalls);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file   kvtape_tier.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Fri Oct 23 09:17:40 2026
+ *
+ * @brief  Images staged on a fast device and migrated to bulk storage.
+ *
+ * A tiered image is one kernel_fop descriptor over two files: the image
+ * on bulk storage and a stage file of the same layout on a fast device.
+ * The bulk file holds the image up to the migration point, the stage file
+ * everything from there on; appends land on the stage and a migrator
+ * thread streams it to the bulk file a segment at a time. The rest of the
+ * driver sees a plain file.
+ *
+ */
+
+#ifndef KVTAPE_TIER_H__
+#define KVTAPE_TIER_H__
+
+#include <linux/types.h>
+
+struct dentry;
+
+/*
+  Open image with its stage file in dir. segment is the migration unit,
+  writes wait in kernel_file_throttle while more than high bytes are
+  staged. return a kernel_fop
+  descriptor, -1 on failure.
+*/
+int kvtape_tier_open(const char* image, const char* dir, loff_t segment, loff_t high);
+
+//counters of all tiers under dir.
+void kvtape_tier_init(struct dentry* dir);
+
+#endif
@@ -0,0 +1,361 @@
+/**
+ * @file   kvtape_timing.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Wed Oct 21 10:31:05 2026
+ *
+ * @brief  Drive timing model, delays command completion like a real drive.
+ *
+ * Data goes through the drive buffer at the streaming rate: a WRITE
+ * completes once it fits in the buffer, a READ is served from read-ahead.
+ * When the host can't keep the buffer fed the tape stops, and the next
+ * transfer pays a back-hitch first; so does a change of direction and a
+ * transfer after the buffer was flushed by a filemark. Positioning waits
+ * for the buffer to drain, then moves the head along the serpentine track:
+ * even wraps run forward, odd ones back, and the time is the longitudinal
+ * distance at locate speed plus a fixed cost.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <asm/uaccess.h>
+#include "kvtape_timing.h"
+
+static char* timing = NULL;
+module_param(timing, charp, S_IRUGO);
+MODULE_PARM_DESC(timing, "Timing profile of every drive, e.g. lto8 or lto8,buffer_mb=512 (default off)");
+
+//rough figures of the full height drives.
+static const struct {
+    const char* name;
+    struct kvtape_timing_profile prof;
+} profiles[] = {
+    {"lto7", {300, 1024, 2500, 51000, 90000, 2000, 90000, 15000}},
+    {"lto8", {360, 1024, 2500, 55000, 90000, 2000, 90000, 15000}},
+    {"lto9", {400, 1024, 2500, 61300, 90000, 2000, 90000, 15000}},
+};
+
+static s64 now_ns(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+//ns to move len bytes at the streaming rate.
+static s64 stream_ns(struct kvtape_timing* t, u64 len)
+{
+    return div64_u64(len * NSEC_PER_SEC, (u64)t->prof.rate_mb << 20);
+}
+
+//distance from the beginning of the tape along the track, in bytes.
+static u64 longitudinal(struct kvtape_timing* t, loff_t pos)
+{
+    u64 wrap = (u64)t->prof.wrap_mb << 20;
+    u64 off = 0;
+    u64 nr = 0;
+
+    if (0 == wrap) {
+        return pos;
+    }
+    nr = div64_u64_rem(pos, wrap, &off);
+    return (nr & 1) ? wrap - off : off;
+}
+
+//ns to move the head between two longitudinal positions.
+static s64 travel_ns(struct kvtape_timing* t, u64 from, u64 to, u32 end_to_end_ms)
+{
+    u64 dist = from > to ? from - to : to - from;
+    u64 wrap = (u64)t->prof.wrap_mb << 20;
+
+    if (0 == wrap) {
+        return 0;
+    }
+    return div64_u64(dist * end_to_end_ms, wrap) * NSEC_PER_MSEC;
+}
+
+//when the drive is done after busy_until, 0 if that is now already.
+static s64 done_at(s64 at, s64 now)
+{
+    return at > now ? at : 0;
+}
+
+/**
+ * A READ or WRITE of len bytes.
+ */
+s64 kvtape_timing_transfer(struct kvtape_timing* t, int write, __u32 len)
+{
+    s64 now = now_ns();
+    s64 start = 0;
+    s64 at = 0;
+
+    spin_lock(&t->lock);
+    if (!kvtape_timing_on(t)) {
+        spin_unlock(&t->lock);
+        return 0;
+    }
+    start = t->busy_until > now ? t->busy_until : now;
+    if (t->streaming && (write != t->writing || now > t->busy_until)) {
+        //dry buffer or turning round: the tape stops.
+        if (write == t->writing) {
+            t->underruns++;
+        }
+        t->streaming = 0;
+    }
+    if (!t->streaming && !t->ready) {
+        t->backhitches++;
+        start += (s64)t->prof.backhitch_ms * NSEC_PER_MSEC;
+    }
+    t->busy_until = start + stream_ns(t, len);
+    t->streaming = 1;
+    t->ready = 0;
+    t->writing = write;
+    t->head += len;
+    t->bytes += len;
+    at = t->busy_until - stream_ns(t, (u64)t->prof.buffer_mb << 20);
+    spin_unlock(&t->lock);
+    return done_at(at, now);
+}
+
+/**
+ * Everything buffered goes to tape and the tape stops there, like for a
+ * WRITE FILEMARKS without IMMED.
+ */
+s64 kvtape_timing_flush(struct kvtape_timing* t)
+{
+    s64 now = now_ns();
+    s64 at = 0;
+
+    spin_lock(&t->lock);
+    if (kvtape_timing_on(t)) {
+        at = t->busy_until;
+        t->streaming = 0;
+    }
+    spin_unlock(&t->lock);
+    return done_at(at, now);
+}
+
+/**
+ * Position the head at pos, in bytes from the beginning of the tape.
+ */
+s64 kvtape_timing_locate(struct kvtape_timing* t, loff_t pos)
+{
+    s64 now = now_ns();
+    s64 start = 0;
+    s64 at = 0;
+
+    spin_lock(&t->lock);
+    if (!kvtape_timing_on(t)) {
+        spin_unlock(&t->lock);
+        return 0;
+    }
+    start = t->busy_until > now ? t->busy_until : now;
+    if (pos != t->head) {
+        start += (s64)t->prof.locate_ms * NSEC_PER_MSEC +
+            travel_ns(t, longitudinal(t, t->head), longitudinal(t, pos), t->prof.traverse_ms);
+        t->head = pos;
+        t->streaming = 0;
+        t->ready = 1;
+        t->locates++;
+    }
+    t->busy_until = start;
+    at = start;
+    spin_unlock(&t->lock);
+    return done_at(at, now);
+}
+
+/**
+ * Back to the beginning of the tape, then through a load if load is set.
+ */
+s64 kvtape_timing_rewind(struct kvtape_timing* t, int load)
+{
+    s64 now = now_ns();
+    s64 start = 0;
+    s64 at = 0;
+
+    spin_lock(&t->lock);
+    if (!kvtape_timing_on(t)) {
+        spin_unlock(&t->lock);
+        return 0;
+    }
+    start = t->busy_until > now ? t->busy_until : now;
+    start += travel_ns(t, longitudinal(t, t->head), 0, t->prof.rewind_ms);
+    if (load) {
+        start += (s64)t->prof.load_ms * NSEC_PER_MSEC;
+    }
+    t->head = 0;
+    t->streaming = 0;
+    t->ready = 1;
+    t->busy_until = start;
+    at = start;
+    spin_unlock(&t->lock);
+    return done_at(at, now);
+}
+
+//a completion was held back by wait_ns.
+void kvtape_timing_delayed(struct kvtape_timing* t, s64 wait_ns)
+{
+    spin_lock(&t->lock);
+    t->delay_us += div_u64(wait_ns, NSEC_PER_USEC);
+    spin_unlock(&t->lock);
+}
+
+/*
+  Parse "name,key=value,..." over prof. return 0, or -EINVAL on an unknown
+  name or key.
+*/
+static int timing_parse(struct kvtape_timing_profile* prof, char* str)
+{
+    char* tok = NULL;
+    int i = 0;
+
+    while (NULL != (tok = strsep(&str, ", \n"))) {
+        char* val = strchr(tok, '=');
+        char* end = NULL;
+        unsigned long n = 0;
+
+        if (0 == *tok) {
+            continue;
+        }
+        if (NULL == val) {
+            if (0 == strcmp(tok, "off")) {
+                memset(prof, 0, sizeof(*prof));
+                continue;
+            }
+            for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+                if (0 == strcmp(tok, profiles[i].name)) {
+                    *prof = profiles[i].prof;
+                    break;
+                }
+            }
+            if (ARRAY_SIZE(profiles) == i) {
+                return -EINVAL;
+            }
+            continue;
+        }
+        *val++ = 0;
+        n = simple_strtoul(val, &end, 10);
+        if (end == val || 0 != *end) {
+            return -EINVAL;
+        }
+        if (0 == strcmp(tok, "rate_mb")) {
+            prof->rate_mb = n;
+        } else if (0 == strcmp(tok, "buffer_mb")) {
+            prof->buffer_mb = n;
+        } else if (0 == strcmp(tok, "backhitch_ms")) {
+            prof->backhitch_ms = n;
+        } else if (0 == strcmp(tok, "wrap_mb")) {
+            prof->wrap_mb = n;
+        } else if (0 == strcmp(tok, "traverse_ms")) {
+            prof->traverse_ms = n;
+        } else if (0 == strcmp(tok, "locate_ms")) {
+            prof->locate_ms = n;
+        } else if (0 == strcmp(tok, "rewind_ms")) {
+            prof->rewind_ms = n;
+        } else if (0 == strcmp(tok, "load_ms")) {
+            prof->load_ms = n;
+        } else {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+//a new profile starts from a drive at rest at the beginning of the tape.
+static void timing_set(struct kvtape_timing* t, struct kvtape_timing_profile* prof)
+{
+    spin_lock(&t->lock);
+    t->prof = *prof;
+    t->busy_until = 0;
+    t->head = 0;
+    t->streaming = 0;
+    t->ready = 1;
+    t->bytes = 0;
+    t->underruns = 0;
+    t->backhitches = 0;
+    t->locates = 0;
+    t->delay_us = 0;
+    spin_unlock(&t->lock);
+}
+
+static ssize_t timing_write(struct file* file, const char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_timing* t = file->f_path.dentry->d_inode->i_private;
+    struct kvtape_timing_profile prof;
+    char buf[256];
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, ubuf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = 0;
+    prof = t->prof;
+    if (timing_parse(&prof, buf) < 0) {
+        return -EINVAL;
+    }
+    timing_set(t, &prof);
+    return count;
+}
+
+static ssize_t timing_read(struct file* file, char __user* ubuf, size_t count, loff_t* ppos)
+{
+    struct kvtape_timing* t = file->f_path.dentry->d_inode->i_private;
+    struct kvtape_timing_profile* p = &t->prof;
+    char buf[512];
+    int len = 0;
+
+    spin_lock(&t->lock);
+    len = snprintf(buf, sizeof(buf),
+                   "rate_mb=%u,buffer_mb=%u,backhitch_ms=%u,wrap_mb=%u,traverse_ms=%u,"
+                   "locate_ms=%u,rewind_ms=%u,load_ms=%u\n"
+                   "bytes %llu\nunderruns %llu\nbackhitches %llu\nlocates %llu\ndelay_ms %llu\n",
+                   p->rate_mb, p->buffer_mb, p->backhitch_ms, p->wrap_mb, p->traverse_ms,
+                   p->locate_ms, p->rewind_ms, p->load_ms,
+                   (unsigned long long)t->bytes, (unsigned long long)t->underruns,
+                   (unsigned long long)t->backhitches, (unsigned long long)t->locates,
+                   (unsigned long long)div_u64(t->delay_us, 1000));
+    spin_unlock(&t->lock);
+    return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static const struct file_operations timing_fops = {
+    .owner = THIS_MODULE,
+    .read = timing_read,
+    .write = timing_write,
+};
+
+int kvtape_timing_init(struct kvtape_timing* t, struct dentry* dir)
+{
+    struct kvtape_timing_profile prof;
+
+    memset(t, 0, sizeof(*t));
+    spin_lock_init(&t->lock);
+    memset(&prof, 0, sizeof(prof));
+    if (timing) {
+        char* str = kstrdup(timing, GFP_KERNEL);
+
+        if (NULL == str) {
+            return -ENOMEM;
+        }
+        if (timing_parse(&prof, str) < 0) {
+            printk("\nkvtape timing profile \"%s\" is not valid, timing is off\n", timing);
+            memset(&prof, 0, sizeof(prof));
+        }
+        kfree(str);
+    }
+    timing_set(t, &prof);
+    if (dir) {
+        t->file = debugfs_create_file("timing", S_IRUSR | S_IWUSR, dir, t, &timing_fops);
+    }
+    return 0;
+}
+
+void kvtape_timing_exit(struct kvtape_timing* t)
+{
+    debugfs_remove(t->file);
+    t->file = NULL;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file   kvtape_timing.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Wed Oct 21 10:12:37 2026
+ *
+ * @brief  Drive timing model, delays command completion like a real drive.
+ *
+ * The model keeps the time the drive will have moved every byte accepted
+ * so far, the drive buffer in front of it and where the head is on a
+ * serpentine tape. Commands complete no earlier than the drive would let
+ * them; the backing store still does the real work as fast as it can.
+ *
+ * debugfs kvtape/driveN/timing takes a profile, either a name (lto7, lto8,
+ * lto9, off) or key=value pairs, or both, e.g. "lto8,buffer_mb=512", and
+ * reads back the profile and the counters.
+ *
+ */
+
+#ifndef KVTAPE_TIMING_H__
+#define KVTAPE_TIMING_H__
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+
+struct dentry;
+
+struct kvtape_timing_profile {
+    __u32 rate_mb;      //streaming MB/s, 0 turns the model off
+    __u32 buffer_mb;    //drive buffer
+    __u32 backhitch_ms; //stop, back up and ramp up again
+    __u32 wrap_mb;      //data along one wrap
+    __u32 traverse_ms;  //one wrap end to end at locate speed
+    __u32 locate_ms;    //fixed part of any locate, wrap changes included
+    __u32 rewind_ms;    //from the far end of a wrap
+    __u32 load_ms;
+};
+
+struct kvtape_timing {
+    spinlock_t lock;
+    struct kvtape_timing_profile prof;
+    s64 busy_until;     //ns, the drive has moved everything accepted so far
+    loff_t head;        //tape position in bytes
+    int streaming;      //tape moving with data to move
+    int ready;          //positioned by a locate, streams without a back-hitch
+    int writing;        //direction of the last transfer
+
+    //counters, reset with every new profile.
+    __u64 bytes;
+    __u64 underruns;    //the buffer ran dry while streaming
+    __u64 backhitches;
+    __u64 locates;
+    __u64 delay_us;     //completions held back, in total
+    struct dentry* file;
+};
+
+int kvtape_timing_init(struct kvtape_timing* t, struct dentry* dir);
+void kvtape_timing_exit(struct kvtape_timing* t);
+
+/*
+  Each returns the ktime in ns the command may complete at, 0 if it need
+  not wait.
+*/
+s64 kvtape_timing_transfer(struct kvtape_timing* t, int write, __u32 len);
+s64 kvtape_timing_flush(struct kvtape_timing* t);
+s64 kvtape_timing_locate(struct kvtape_timing* t, loff_t pos);
+s64 kvtape_timing_rewind(struct kvtape_timing* t, int load);
+void kvtape_timing_delayed(struct kvtape_timing* t, s64 wait_ns);
+
+static inline int kvtape_timing_on(struct kvtape_timing* t)
+{
+    return 0 != t->prof.rate_mb;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file   kvtape_trace.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 09:14:02 2026
+ *
+ * @brief  Per-drive CDB trace ring, exported through debugfs.
+ *
+ * Producers claim a slot with one atomic increment and never wait, so
+ * several work items completing on different CPUs can record at the same
+ * time. A slot's seq is cleared while it is being filled and set to
+ * index + 1 afterwards; the reader keeps only slots whose seq matched
+ * before and after the copy.
+ *
+ * debugfs files, per drive directory:
+ *   trace_enable  0/1, capture on or off.
+ *   trace         read: header + records, oldest first. write: reset.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <asm/uaccess.h>
+#include <asm/byteorder.h>
+#include <scsi/scsi_cmnd.h>
+#include "kvtape_trace.h"
+
+static unsigned int trace_entries = 4096;
+module_param(trace_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(trace_entries, "CDB trace ring entries per drive, rounded up to a power of two");
+
+static unsigned int trace_enable = 0;
+module_param(trace_enable, uint, S_IRUGO);
+MODULE_PARM_DESC(trace_enable, "Start CDB capture at load time (default 0)");
+
+struct trace_snapshot {
+    size_t len;
+    char data[0];
+};
+
+void __kvtape_trace_cmd(struct kvtape_trace* trace, struct scsi_cmnd* cmnd,
+                        ktime_t start, __u32 position)
+{
+    struct kvtape_trace_slot* slot = NULL;
+    struct kvtape_trace_rec* rec = NULL;
+    __u32 idx = 0;
+    __u32 cdb_len = 0;
+    s64 service_us = 0;
+
+    idx = (__u32)atomic_inc_return(&trace->head) - 1;
+    slot = &trace->slots[idx & trace->mask];
+    rec = &slot->rec;
+
+    slot->seq = 0;
+    smp_wmb();
+
+    service_us = ktime_us_delta(ktime_get(), start);
+    cdb_len = cmnd->cmd_len < sizeof(rec->cdb) ? cmnd->cmd_len : sizeof(rec->cdb);
+    rec->ts_ns = cpu_to_le64(ktime_to_ns(start));
+    rec->service_us = cpu_to_le32(service_us > 0 ? (__u32)service_us : 0);
+    rec->xfer_len = cpu_to_le32(scsi_bufflen(cmnd));
+    rec->resid = cpu_to_le32(scsi_get_resid(cmnd));
+    rec->position = cpu_to_le32(position);
+    rec->result = cpu_to_le32(cmnd->result);
+    //fixed format sense, see union sense_data.
+    if (cmnd->result) {
+        rec->sense_key = cmnd->sense_buffer[2] & 0x0F;
+        rec->asc = cmnd->sense_buffer[12];
+        rec->ascq = cmnd->sense_buffer[13];
+    } else {
+        rec->sense_key = 0;
+        rec->asc = 0;
+        rec->ascq = 0;
+    }
+    rec->cdb_len = cdb_len;
+    memset(rec->cdb, 0, sizeof(rec->cdb));
+    memcpy(rec->cdb, cmnd->cmnd, cdb_len);
+
+    smp_wmb();
+    slot->seq = idx + 1;
+}
+
+/*
+  Copy every complete record between tail and head into a private buffer,
+  so a slow reader never holds up the producers.
+*/
+static int trace_open(struct inode* inode, struct file* file)
+{
+    struct kvtape_trace* trace = inode->i_private;
+    struct trace_snapshot* snap = NULL;
+    struct kvtape_trace_hdr* hdr = NULL;
+    struct kvtape_trace_rec* recs = NULL;
+    __u32 head = 0;
+    __u32 first = 0;
+    __u32 i = 0;
+    __u32 n = 0;
+
+    file->private_data = NULL;
+    if (!(file->f_mode & FMODE_READ)) {
+        return 0;
+    }
+
+    head = (__u32)atomic_read(&trace->head);
+    first = trace->tail;
+    if (head - first > trace->mask + 1) {
+        first = head - (trace->mask + 1);
+    }
+
+    snap = vmalloc(sizeof(*snap) + sizeof(*hdr) + (head - first) * sizeof(*recs));
+    if (NULL == snap) {
+        return -ENOMEM;
+    }
+    hdr = (struct kvtape_trace_hdr*)snap->data;
+    recs = (struct kvtape_trace_rec*)(hdr + 1);
+
+    for (i = first; i != head; i++) {
+        struct kvtape_trace_slot* slot = &trace->slots[i & trace->mask];
+        __u32 seq = ACCESS_ONCE(slot->seq);
+
+        smp_rmb();
+        if (seq != i + 1) {//still being written or already overwritten
+            continue;
+        }
+        memcpy(&recs[n], &slot->rec, sizeof(recs[n]));
+        smp_rmb();
+        if (ACCESS_ONCE(slot->seq) != seq) {
+            continue;
+        }
+        n++;
+    }
+
+    hdr->magic = cpu_to_le32(KVTAPE_TRACE_MAGIC);
+    hdr->version = cpu_to_le16(KVTAPE_TRACE_VERSION);
+    hdr->rec_size = cpu_to_le16(sizeof(struct kvtape_trace_rec));
+    hdr->drive = cpu_to_le32(trace->drive);
+    hdr->nr_records = cpu_to_le32(n);
+    hdr->dropped = cpu_to_le64((__u64)(head - trace->tail) - n);
+    snap->len = sizeof(*hdr) + n * sizeof(*recs);
+    file->private_data = snap;
+    return 0;
+}
+
+static ssize_t trace_read(struct file* file, char __user* buf, size_t count, loff_t* ppos)
+{
+    struct trace_snapshot* snap = file->private_data;
+    if (NULL == snap) {
+        return -EINVAL;
+    }
+    return simple_read_from_buffer(buf, count, ppos, snap->data, snap->len);
+}
+
+//any write drops everything captured so far.
+static ssize_t trace_write(struct file* file, const char __user* buf, size_t count, loff_t* ppos)
+{
+    struct kvtape_trace* trace = file->f_path.dentry->d_inode->i_private;
+    trace->tail = (__u32)atomic_read(&trace->head);
+    return count;
+}
+
+static int trace_release(struct inode* inode, struct file* file)
+{
+    vfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .open = trace_open,
+    .read = trace_read,
+    .write = trace_write,
+    .release = trace_release,
+};
+
+int kvtape_trace_init(struct kvtape_trace* trace, __u32 drive, struct dentry* dir)
+{
+    __u32 entries = trace_entries ? roundup_pow_of_two(trace_entries) : 1;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->slots = vmalloc(entries * sizeof(struct kvtape_trace_slot));
+    if (NULL == trace->slots) {
+        printk("\nkvtape error %s: can't allocate %u trace entries\n", __func__, entries);
+        return -ENOMEM;
+    }
+    memset(trace->slots, 0, entries * sizeof(struct kvtape_trace_slot));
+    trace->mask = entries - 1;
+    trace->drive = drive;
+    trace->enabled = trace_enable ? 1 : 0;
+    atomic_set(&trace->head, 0);
+
+    if (dir) {
+        trace->enable_file = debugfs_create_u32("trace_enable", S_IRUGO | S_IWUSR, dir, &trace->enabled);
+        trace->trace_file = debugfs_create_file("trace", S_IRUSR | S_IWUSR, dir, trace, &trace_fops);
+    }
+    return 0;
+}
+
+void kvtape_trace_exit(struct kvtape_trace* trace)
+{
+    trace->enabled = 0;
+    debugfs_remove(trace->trace_file);
+    debugfs_remove(trace->enable_file);
+    vfree(trace->slots);
+    trace->slots = NULL;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file   kvtape_trace.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 09:12:40 2026
+ *
+ * @brief  Per-drive CDB trace ring declaration.
+ *
+ * The binary layout below is what debugfs "trace" returns: one
+ * kvtape_trace_hdr followed by hdr.nr_records kvtape_trace_rec, oldest
+ * first, all fields little endian. The structs are shared with userspace
+ * replay tools, so only fixed size types are used and nothing may be
+ * reordered without bumping KVTAPE_TRACE_VERSION.
+ *
+ */
+
+#ifndef KVTAPE_TRACE_H__
+#define KVTAPE_TRACE_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_TRACE_MAGIC   0x5254564b /* "KVTR" */
+#define KVTAPE_TRACE_VERSION 1
+
+struct kvtape_trace_hdr {
+    __le32 magic;
+    __le16 version;
+    __le16 rec_size;     //sizeof(struct kvtape_trace_rec)
+    __le32 drive;
+    __le32 nr_records;
+    __le64 dropped;      //records overwritten before they were read
+} __attribute__((packed));
+
+struct kvtape_trace_rec {
+    __le64 ts_ns;        //time the command was queued, ktime in ns
+    __le32 service_us;   //queued to done()
+    __le32 xfer_len;     //scsi_bufflen()
+    __le32 resid;
+    __le32 position;     //logical block number when the command started
+    __le32 result;       //cmnd->result
+    __u8  sense_key;
+    __u8  asc;
+    __u8  ascq;
+    __u8  cdb_len;
+    __u8  cdb[16];
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+#include <linux/ktime.h>
+#include <asm/atomic.h>
+
+struct scsi_cmnd;
+struct dentry;
+
+struct kvtape_trace_slot {
+    __u32 seq;          //index + 1 once the record is complete, 0 while written
+    struct kvtape_trace_rec rec;
+};
+
+struct kvtape_trace {
+    __u32 enabled;      //toggled through debugfs "trace_enable"
+    __u32 drive;
+    __u32 mask;         //ring entries - 1
+    atomic_t head;      //next index to be claimed by a producer
+    __u32 tail;         //first index exported, moved forward on reset
+    struct kvtape_trace_slot* slots;
+    struct dentry* enable_file;
+    struct dentry* trace_file;
+};
+
+int kvtape_trace_init(struct kvtape_trace* trace, __u32 drive, struct dentry* dir);
+void kvtape_trace_exit(struct kvtape_trace* trace);
+void __kvtape_trace_cmd(struct kvtape_trace* trace, struct scsi_cmnd* cmnd,
+                        ktime_t start, __u32 position);
+
+/*
+  Called for every completed command, so the disabled case must stay a
+  single predictable branch.
+*/
+static inline void kvtape_trace_cmd(struct kvtape_trace* trace, struct scsi_cmnd* cmnd,
+                                    ktime_t start, __u32 position)
+{
+    if (unlikely(trace->enabled)) {
+        __kvtape_trace_cmd(trace, cmnd, start, position);
+    }
+}
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,322 @@
+/**
+ * @file   kvtape_user.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 21:14:50 2026
+ *
+ * @brief  Userspace backend: command ring shared with a tape daemon.
+ *
+ * Commands of a drive are posted from its command thread, which sleeps
+ * while all tags are taken. Completions are reaped when the daemon
+ * write()s to the device; they may come back in any order, the daemon is
+ * responsible for executing them in tape order. When the daemon goes away
+ * the commands it still holds fail with DID_ERROR and new ones get NOT
+ * READY until another daemon opens the device.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <scsi/scsi.h>
+#include <scsi/scsi_cmnd.h>
+#include "kvtape.h"
+#include "kvtape_user.h"
+#include "kvtape_sg.h"
+
+#define SQ_OFF 64
+#define CQ_OFF (SQ_OFF + KVTAPE_RING_ENTRIES * sizeof(struct kvtape_ring_sqe))
+
+//misc_open leaves private_data alone here, devices are found by minor.
+static LIST_HEAD(user_list);
+static DEFINE_MUTEX(user_list_lock);
+
+static inline struct kvtape_ring_sqe* ring_sqe(struct kvtape_user* user, __u32 idx)
+{
+    return (struct kvtape_ring_sqe*)(user->area + SQ_OFF) + idx % KVTAPE_RING_ENTRIES;
+}
+
+static inline struct kvtape_ring_cqe* ring_cqe(struct kvtape_user* user, __u32 idx)
+{
+    return (struct kvtape_ring_cqe*)(user->area + CQ_OFF) + idx % KVTAPE_RING_ENTRIES;
+}
+
+static inline char* ring_slot(struct kvtape_user* user, __u32 tag)
+{
+    return user->area + KVTAPE_RING_HDR_SIZE + tag * KVTAPE_RING_SLOT;
+}
+
+static void ring_reset(struct kvtape_user* user)
+{
+    struct kvtape_ring_hdr* hdr = user->hdr;
+
+    memset(user->area, 0, KVTAPE_RING_HDR_SIZE);
+    user->sq_head = 0;
+    user->cq_tail = 0;
+    hdr->magic = KVTAPE_RING_MAGIC;
+    hdr->version = KVTAPE_RING_VERSION;
+    hdr->nr_entries = KVTAPE_RING_ENTRIES;
+    hdr->drive = user->drive->id;
+    hdr->slot_size = KVTAPE_RING_SLOT;
+    hdr->area_size = KVTAPE_RING_AREA;
+    hdr->sq_off = SQ_OFF;
+    hdr->cq_off = CQ_OFF;
+    hdr->data_off = KVTAPE_RING_HDR_SIZE;
+}
+
+//end a command the daemon won't answer. lock held.
+static void user_fail(struct kvtape_user* user, __u32 tag)
+{
+    struct kvtape_user_cmd* cmd = &user->cmds[tag];
+
+    cmd->cmnd->result = DID_ERROR << 16;
+    clear_bit(tag, &user->busy);
+    cmd->done(cmd->priv);
+}
+
+/*
+  Move reaped completions back to their commands. The daemon can write
+  anything to the ring, so cq_head is taken at most a ring's worth at a
+  time and each cqe is copied before it is looked at. lock held.
+*/
+static void user_reap(struct kvtape_user* user)
+{
+    struct kvtape_ring_hdr* hdr = user->hdr;
+    __u32 head = ACCESS_ONCE(hdr->cq_head);
+    int n = 0;
+
+    for (n = 0; n < KVTAPE_RING_ENTRIES && user->cq_tail != head; n++) {
+        struct kvtape_ring_cqe copy;
+        struct kvtape_ring_cqe* cqe = &copy;
+        struct kvtape_user_cmd* cmd = NULL;
+        struct scsi_cmnd* cmnd = NULL;
+
+        smp_rmb();
+        memcpy(cqe, ring_cqe(user, user->cq_tail), sizeof(*cqe));
+        user->cq_tail++;
+        hdr->cq_tail = user->cq_tail;
+        if (cqe->tag >= KVTAPE_RING_ENTRIES || !test_bit(cqe->tag, &user->busy)) {
+            printk("\nkvtape %s bogus completion tag %u\n", user->name, cqe->tag);
+            continue;
+        }
+        cmd = &user->cmds[cqe->tag];
+        cmnd = cmd->cmnd;
+
+        cmnd->result = cqe->status;
+        if (cqe->host_error) {
+            cmnd->result |= DID_ERROR << 16;
+        } else if (SAM_STAT_CHECK_CONDITION == cqe->status && cqe->sense_len) {
+            unsigned int len = min_t(unsigned int, cqe->sense_len, sizeof(cqe->sense));
+            memset(cmnd->sense_buffer, 0, SCSI_SENSE_BUFFERSIZE);
+            memcpy(cmnd->sense_buffer, cqe->sense, min_t(unsigned int, len, SCSI_SENSE_BUFFERSIZE));
+            cmnd->result |= DRIVER_SENSE << 24;
+        }
+        if (DMA_FROM_DEVICE == cmnd->sc_data_direction) {
+            kvtape_sg_reply(cmnd, ring_slot(user, cqe->tag), min_t(unsigned int, cqe->data_len, KVTAPE_RING_SLOT));
+        }
+        user->drive->cur_record_no = cqe->position;
+
+        clear_bit(cqe->tag, &user->busy);
+        cmd->done(cmd->priv);
+    }
+    wake_up(&user->tag_wait);
+}
+
+/**
+ * Hand a command to the daemon. Sleeps while every tag is in flight.
+ *
+ * @return 0 if queued, -ENODEV if no daemon is attached.
+ */
+int kvtape_user_queue(struct kvtape_user* user, struct scsi_cmnd* cmnd,
+                      kvtape_user_done_t done, void* priv)
+{
+    struct kvtape_ring_hdr* hdr = user->hdr;
+    struct kvtape_ring_sqe* sqe = NULL;
+    unsigned int len = scsi_bufflen(cmnd);
+    int tag = 0;
+
+    for (;;) {
+        wait_event(user->tag_wait, !user->attached || ~user->busy & ((1UL << KVTAPE_RING_ENTRIES) - 1));
+        mutex_lock(&user->lock);
+        if (!user->attached) {
+            mutex_unlock(&user->lock);
+            return -ENODEV;
+        }
+        tag = ffz(user->busy);
+        if (tag < KVTAPE_RING_ENTRIES) {
+            break;
+        }
+        mutex_unlock(&user->lock);
+    }
+
+    if (len > KVTAPE_RING_SLOT) {
+        len = KVTAPE_RING_SLOT;
+    }
+    set_bit(tag, &user->busy);
+    user->cmds[tag].cmnd = cmnd;
+    user->cmds[tag].done = done;
+    user->cmds[tag].priv = priv;
+
+    sqe = ring_sqe(user, user->sq_head);
+    sqe->tag = tag;
+    sqe->data_off = KVTAPE_RING_HDR_SIZE + tag * KVTAPE_RING_SLOT;
+    sqe->data_len = len;
+    sqe->data_dir = KVTAPE_RING_DATA_NONE;
+    if (DMA_TO_DEVICE == cmnd->sc_data_direction) {
+        sqe->data_dir = KVTAPE_RING_DATA_OUT;
+        kvtape_sg_copy(cmnd, ring_slot(user, tag), len, 0, 0);
+    } else if (DMA_FROM_DEVICE == cmnd->sc_data_direction) {
+        sqe->data_dir = KVTAPE_RING_DATA_IN;
+    }
+    sqe->cdb_len = min_t(unsigned int, cmnd->cmd_len, sizeof(sqe->cdb));
+    memset(sqe->cdb, 0, sizeof(sqe->cdb));
+    memcpy(sqe->cdb, cmnd->cmnd, sqe->cdb_len);
+    smp_wmb();
+    hdr->sq_head = ++user->sq_head;
+    mutex_unlock(&user->lock);
+
+    wake_up_interruptible(&user->poll_wait);
+    return 0;
+}
+
+static int user_open(struct inode* inode, struct file* file)
+{
+    struct kvtape_user* user = NULL;
+    struct kvtape_user* pos = NULL;
+
+    mutex_lock(&user_list_lock);
+    list_for_each_entry(pos, &user_list, node) {
+        if (pos->misc.minor == iminor(inode)) {
+            user = pos;
+            break;
+        }
+    }
+    mutex_unlock(&user_list_lock);
+    if (NULL == user) {
+        return -ENODEV;
+    }
+
+    mutex_lock(&user->lock);
+    if (user->attached) {
+        mutex_unlock(&user->lock);
+        return -EBUSY;
+    }
+    //nothing is in flight while detached, start with an empty ring.
+    ring_reset(user);
+    user->attached = 1;
+    mutex_unlock(&user->lock);
+
+    file->private_data = user;
+    printk("\nkvtape %s daemon attached\n", user->name);
+    return 0;
+}
+
+static int user_release(struct inode* inode, struct file* file)
+{
+    struct kvtape_user* user = (struct kvtape_user*)file->private_data;
+    int tag = 0;
+
+    mutex_lock(&user->lock);
+    user_reap(user);
+    for (tag = 0; tag < KVTAPE_RING_ENTRIES; tag++) {
+        if (test_bit(tag, &user->busy)) {
+            user_fail(user, tag);
+        }
+    }
+    user->attached = 0;
+    mutex_unlock(&user->lock);
+    wake_up(&user->tag_wait);
+
+    printk("\nkvtape %s daemon detached\n", user->name);
+    return 0;
+}
+
+//the daemon's doorbell: completions are waiting in the cq.
+static ssize_t user_write(struct file* file, const char __user* buf, size_t count, loff_t* ppos)
+{
+    struct kvtape_user* user = (struct kvtape_user*)file->private_data;
+
+    mutex_lock(&user->lock);
+    user_reap(user);
+    mutex_unlock(&user->lock);
+    return count;
+}
+
+static unsigned int user_poll(struct file* file, poll_table* wait)
+{
+    struct kvtape_user* user = (struct kvtape_user*)file->private_data;
+
+    poll_wait(file, &user->poll_wait, wait);
+    if (ACCESS_ONCE(user->hdr->sq_tail) != ACCESS_ONCE(user->sq_head)) {
+        return POLLIN | POLLRDNORM;
+    }
+    return 0;
+}
+
+static int user_mmap(struct file* file, struct vm_area_struct* vma)
+{
+    struct kvtape_user* user = (struct kvtape_user*)file->private_data;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > KVTAPE_RING_AREA) {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, user->area, 0);
+}
+
+static const struct file_operations user_fops = {
+    .owner = THIS_MODULE,
+    .open = user_open,
+    .release = user_release,
+    .write = user_write,
+    .poll = user_poll,
+    .mmap = user_mmap,
+};
+
+int kvtape_user_init(struct kvtape_user* user, struct kvtape_drive* drive)
+{
+    int ret = 0;
+
+    memset(user, 0, sizeof(*user));
+    user->drive = drive;
+    mutex_init(&user->lock);
+    init_waitqueue_head(&user->tag_wait);
+    init_waitqueue_head(&user->poll_wait);
+
+    user->area = vmalloc_user(KVTAPE_RING_AREA);
+    if (NULL == user->area) {
+        return -ENOMEM;
+    }
+    user->hdr = (struct kvtape_ring_hdr*)user->area;
+    ring_reset(user);
+
+    snprintf(user->name, sizeof(user->name), "kvtape_ring%d", drive->id);
+    user->misc.minor = MISC_DYNAMIC_MINOR;
+    user->misc.name = user->name;
+    user->misc.fops = &user_fops;
+    ret = misc_register(&user->misc);
+    if (ret) {
+        vfree(user->area);
+        user->area = NULL;
+        return ret;
+    }
+    mutex_lock(&user_list_lock);
+    list_add(&user->node, &user_list);
+    mutex_unlock(&user_list_lock);
+    return 0;
+}
+
+void kvtape_user_exit(struct kvtape_user* user)
+{
+    if (NULL == user->area) {
+        return;
+    }
+    mutex_lock(&user_list_lock);
+    list_del(&user->node);
+    mutex_unlock(&user_list_lock);
+    misc_deregister(&user->misc);
+    vfree(user->area);
+    user->area = NULL;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file   kvtape_user.h
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 21:06:33 2026
+ *
+ * @brief  Userspace backend: command ring shared with a tape daemon.
+ *
+ * With user_backend=1 each drive gets a /dev/kvtape_ringN misc device
+ * instead of a backing image. The daemon mmaps the whole area (size in
+ * hdr.area_size, the header page can be mapped alone to read it):
+ *
+ *   [kvtape_ring_hdr][sq entries][cq entries] ... [data slots]
+ *
+ * The kernel posts one kvtape_ring_sqe per SCSI command and advances
+ * sq_head; poll() reports POLLIN while sq_tail != sq_head. The daemon
+ * consumes entries in order (moving sq_tail), posts a kvtape_ring_cqe
+ * with the same tag, advances cq_head and write()s anything to the device
+ * to have the completions reaped. Each tag owns the data slot at
+ * sqe.data_off until its completion is reaped, so transfers are done in
+ * place: data of a WRITE is already there, data of a READ is left there.
+ *
+ * sq_head and cq_tail are only copies of the kernel's own indices; writing
+ * them changes nothing. All fields are in host byte order, the daemon runs
+ * on the same machine. The structs are shared with the daemon, so nothing
+ * may be reordered without bumping KVTAPE_RING_VERSION.
+ *
+ */
+
+#ifndef KVTAPE_USER_H__
+#define KVTAPE_USER_H__
+
+#include <linux/types.h>
+
+#define KVTAPE_RING_MAGIC   0x4752564b /* "KVRG" */
+#define KVTAPE_RING_VERSION 1
+#define KVTAPE_RING_ENTRIES 16              //commands in flight per drive
+#define KVTAPE_RING_SLOT    (128 * 1024)    //data bytes per command
+#define KVTAPE_RING_HDR_SIZE 4096           //header, sq and cq
+#define KVTAPE_RING_AREA    (KVTAPE_RING_HDR_SIZE + KVTAPE_RING_ENTRIES * KVTAPE_RING_SLOT)
+
+#define KVTAPE_RING_DATA_NONE 0
+#define KVTAPE_RING_DATA_OUT  1             //initiator to daemon, e.g. WRITE
+#define KVTAPE_RING_DATA_IN   2             //daemon to initiator, e.g. READ
+
+struct kvtape_ring_sqe {
+    __u32 tag;
+    __u32 data_off;     //area offset of the command's data slot
+    __u32 data_len;     //bytes sent, or room for the reply
+    __u8  data_dir;     //KVTAPE_RING_DATA_*
+    __u8  cdb_len;
+    __u8  pad[2];
+    __u8  cdb[16];
+} __attribute__((packed));
+
+struct kvtape_ring_cqe {
+    __u32 tag;
+    __u32 data_len;     //bytes returned in the data slot
+    __u32 position;     //logical block position after the command
+    __u8  status;       //SAM status, 0x02 CHECK CONDITION with sense
+    __u8  host_error;   //non zero fails the command with DID_ERROR
+    __u8  sense_len;
+    __u8  pad;
+    __u8  sense[20];    //fixed format sense data
+} __attribute__((packed));
+
+struct kvtape_ring_hdr {
+    __u32 magic;
+    __u16 version;
+    __u16 nr_entries;
+    __u32 drive;
+    __u32 slot_size;
+    __u32 area_size;
+    __u32 sq_off;       //area offset of the sq array
+    __u32 cq_off;
+    __u32 data_off;     //area offset of data slot 0
+    __u32 sq_head;      //kernel: next sqe to post, read only
+    __u32 sq_tail;      //daemon: next sqe to consume
+    __u32 cq_head;      //daemon: next cqe to post
+    __u32 cq_tail;      //kernel: next cqe to reap, read only
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+#include <linux/miscdevice.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+
+struct scsi_cmnd;
+struct kvtape_drive;
+
+typedef void (*kvtape_user_done_t)(void* priv);
+
+struct kvtape_user_cmd {
+    struct scsi_cmnd* cmnd;
+    kvtape_user_done_t done;
+    void* priv;
+};
+
+struct kvtape_user {
+    struct kvtape_drive* drive;
+    char name[24];
+    struct miscdevice misc;
+    struct list_head node;
+    char* area;                 //vmalloc_user, mapped by the daemon
+    struct kvtape_ring_hdr* hdr;
+    struct mutex lock;
+    int attached;               //a daemon has the device open
+    unsigned long busy;         //tags in flight
+    __u32 sq_head;              //the ring's indices the kernel owns; the
+    __u32 cq_tail;              //daemon only sees copies of them in hdr
+    struct kvtape_user_cmd cmds[KVTAPE_RING_ENTRIES];
+    wait_queue_head_t tag_wait; //commands waiting for a free tag
+    wait_queue_head_t poll_wait;//the daemon waiting for commands
+};
+
+int kvtape_user_init(struct kvtape_user* user, struct kvtape_drive* drive);
+void kvtape_user_exit(struct kvtape_user* user);
+int kvtape_user_queue(struct kvtape_user* user, struct scsi_cmnd* cmnd,
+                      kvtape_user_done_t done, void* priv);
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,745 @@
+/**
+ * @file   kvtaped.c
+ * @author vincent.feng <vincent.feng@yahoo.com>
+ * @date   Sun Oct 18 21:48:17 2026
+ *
+ * @brief  Reference daemon for user_backend=1.
+ *
+ * Serves one drive's command ring from a stream format image (4 byte
+ * length header, then the record; marks are 1 byte records), the same
+ * file the in-kernel path writes. Payloads move between the image and
+ * the ring's data slots with io_uring, no copy in between. Consecutive
+ * READs or WRITEs stay in flight together; any other command waits for
+ * them, as in the kernel. Kernels without io_uring (before 5.1, so every
+ * kernel the module builds on) get plain pread/pwritev instead, one
+ * command at a time.
+ *
+ *     kvtaped /dev/kvtape_ring0 /home/vdisk.dat
+ *
+ * Only the kernel's uapi headers are needed, io_uring is driven through
+ * its system calls directly.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "kvtape_user.h"
+
+#define URING_ENTRIES 64
+#define POLL_TAG ((__u64)-1)
+#define SCAN_BUF_SIZE (64 * 1024)
+#define MAX_RECORD_LEN (16 * 1024 * 1024)
+#define FIXED_BLOCK 0x8000
+
+#define NOT_MARK 0
+#define FILEMARK 1
+#define SETMARK  2
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned pending;   //sqes filled but not submitted
+};
+
+struct rec {
+    off_t offset;
+    uint32_t len;
+    uint8_t type;
+};
+
+struct cmd {
+    struct kvtape_ring_sqe sqe;
+    struct kvtape_ring_cqe cqe;
+    char* data;
+    int pending;        //io_uring operations outstanding
+    int async;          //counted in inflight
+    uint32_t hdr;       //record header of a WRITE
+    struct iovec iov[2];
+};
+
+static struct uring ring;
+static int dev = -1;
+static int img = -1;
+static char* area = NULL;
+static struct kvtape_ring_hdr* hdr = NULL;
+static struct cmd cmds[KVTAPE_RING_ENTRIES];
+
+static struct rec* recs = NULL;
+static uint32_t nr_recs = 0;    //EOD
+static uint32_t max_recs = 0;
+static uint32_t pos = 0;
+static int trunc_pending = 0;
+
+static int inflight = 0;        //commands with io_uring operations outstanding
+static uint8_t async_op = 0;
+static int kick = 0;            //completions posted since the last doorbell
+static int polling = 0;         //POLL_ADD on the ring device outstanding
+static int sync_io = 0;         //no io_uring in this kernel, pread/pwritev instead
+
+static int uring_init(struct uring* r, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    char* sq = NULL;
+    char* cq = NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    }
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq) {
+        return -1;
+    }
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq) {
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == r->sqes) {
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->pending = 0;
+    return 0;
+}
+
+static int uring_submit(struct uring* r, unsigned wait_nr)
+{
+    unsigned n = r->pending;
+    int ret = 0;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && EINTR == errno);
+    return ret;
+}
+
+static struct io_uring_cqe* uring_peek(struct uring* r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static void uring_seen(struct uring* r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void io_done(__u64 tag, int res);
+
+static struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+    unsigned tail = *r->sq_tail + r->pending;
+    struct io_uring_sqe* sqe = NULL;
+
+    //the ring is full: push what is there and take completions out.
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+        struct io_uring_cqe* cqe = NULL;
+
+        uring_submit(r, 1);
+        while (NULL != (cqe = uring_peek(r))) {
+            __u64 tag = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(r);
+            io_done(tag, res);
+        }
+        tail = *r->sq_tail + r->pending;
+    }
+    sqe = &r->sqes[tail & *r->sq_mask];
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->pending++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//read into the command's data slot, completing through io_done() either way.
+static void queue_read(struct cmd* c, char* buf, uint32_t len, off_t offset)
+{
+    struct io_uring_sqe* sqe = NULL;
+
+    c->pending++;
+    if (sync_io) {
+        ssize_t n = pread(img, buf, len, offset);
+        io_done(c->sqe.tag, n < 0 ? -errno : 0);
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = img;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = c->sqe.tag;
+}
+
+static void queue_writev(struct cmd* c, off_t offset)
+{
+    struct io_uring_sqe* sqe = NULL;
+
+    c->pending++;
+    if (sync_io) {
+        ssize_t n = pwritev(img, c->iov, 2, offset);
+        io_done(c->sqe.tag, n < 0 ? -errno : 0);
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = img;
+    sqe->addr = (unsigned long)c->iov;
+    sqe->len = 2;
+    sqe->off = offset;
+    sqe->user_data = c->sqe.tag;
+}
+
+static void post_cqe(struct cmd* c)
+{
+    struct kvtape_ring_cqe* cqe = (struct kvtape_ring_cqe*)(area + hdr->cq_off) +
+        hdr->cq_head % hdr->nr_entries;
+
+    c->cqe.tag = c->sqe.tag;
+    memcpy(cqe, &c->cqe, sizeof(*cqe));
+    __atomic_store_n(&hdr->cq_head, hdr->cq_head + 1, __ATOMIC_RELEASE);
+    kick = 1;
+}
+
+static void io_done(__u64 tag, int res)
+{
+    struct cmd* c = NULL;
+
+    if (POLL_TAG == tag) {
+        polling = 0;
+        return;
+    }
+    c = &cmds[tag];
+    if (res < 0) {
+        fprintf(stderr, "kvtaped: tag %u cdb 0x%x: %s\n", c->sqe.tag, c->sqe.cdb[0], strerror(-res));
+        c->cqe.host_error = 1;
+    }
+    if (0 == --c->pending) {
+        post_cqe(c);
+        if (c->async) {
+            inflight--;
+        }
+    }
+}
+
+//fixed format sense with CHECK CONDITION status.
+static void gen_sense(struct cmd* c, uint8_t key, uint8_t asc, uint8_t ascq, uint32_t info)
+{
+    uint8_t* s = c->cqe.sense;
+
+    memset(s, 0, sizeof(c->cqe.sense));
+    s[0] = 0xF0;
+    s[2] = key;
+    s[3] = info >> 24;
+    s[4] = info >> 16;
+    s[5] = info >> 8;
+    s[6] = info;
+    s[7] = 10;
+    s[12] = asc;
+    s[13] = ascq;
+    c->cqe.sense_len = 18;
+    c->cqe.status = 0x02;
+}
+
+static void gen_mark_sense(struct cmd* c, uint8_t type, uint32_t info)
+{
+    gen_sense(c, 0x00, 0x00, SETMARK == type ? 0x03 : 0x01, info);
+    c->cqe.sense[2] |= 0x80;
+}
+
+static void gen_eod_sense(struct cmd* c, uint32_t info)
+{
+    gen_sense(c, 0x08, 0x00, 0x05, info);
+}
+
+static uint32_t cdb_count(struct cmd* c)
+{
+    return ((uint32_t)c->sqe.cdb[2] << 16) | ((uint32_t)c->sqe.cdb[3] << 8) | c->sqe.cdb[4];
+}
+
+static void reply(struct cmd* c, const void* data, uint32_t len)
+{
+    if (len > c->sqe.data_len) {
+        len = c->sqe.data_len;
+    }
+    memcpy(c->data, data, len);
+    c->cqe.data_len = len;
+}
+
+static off_t eod_offset(void)
+{
+    if (0 == nr_recs) {
+        return 0;
+    }
+    return recs[nr_recs - 1].offset + 4 + recs[nr_recs - 1].len;
+}
+
+static int append_rec(off_t offset, uint32_t len, uint8_t type)
+{
+    if (nr_recs == max_recs) {
+        uint32_t max = max_recs ? max_recs * 2 : 4096;
+        struct rec* r = realloc(recs, max * sizeof(struct rec));
+        if (NULL == r) {
+            return -1;
+        }
+        recs = r;
+        max_recs = max;
+    }
+    recs[nr_recs].offset = offset;
+    recs[nr_recs].len = len;
+    recs[nr_recs].type = type;
+    nr_recs++;
+    return 0;
+}
+
+//same walk as kvtape_index_load().
+static int load_index(void)
+{
+    char* buf = malloc(SCAN_BUF_SIZE);
+    off_t base = 0;
+    off_t at = 0;
+    ssize_t valid = 0;
+
+    if (NULL == buf) {
+        return -1;
+    }
+    for (;;) {
+        int32_t len = 0;
+        uint8_t type = NOT_MARK;
+
+        if (at + 5 > base + valid) {
+            base = at;
+            valid = pread(img, buf, SCAN_BUF_SIZE, base);
+            if (valid < 4) {
+                break;
+            }
+        }
+        memcpy(&len, buf + (at - base), 4);
+        if (len <= 0 || len > MAX_RECORD_LEN) {
+            break;
+        }
+        if (1 == len) {
+            if (at + 5 > base + valid) {
+                break;
+            }
+            type = buf[at - base + 4];
+            if (FILEMARK != type && SETMARK != type) {
+                type = NOT_MARK;
+            }
+        }
+        if (append_rec(at, len, type) < 0) {
+            free(buf);
+            return -1;
+        }
+        at += 4 + len;
+    }
+    free(buf);
+    printf("kvtaped: %u records, EOD at %lld\n", nr_recs, (long long)at);
+    return 0;
+}
+
+static void set_eod_here(void)
+{
+    if (pos < nr_recs) {
+        nr_recs = pos;
+        trunc_pending = 1;
+    }
+}
+
+static void do_read(struct cmd* c)
+{
+    int fixed = c->sqe.cdb[1] & 0x01;
+    uint32_t count = cdb_count(c);
+    uint32_t want = fixed ? count * FIXED_BLOCK : count;
+    uint32_t done = 0;
+
+    if (want > c->sqe.data_len) {
+        want = c->sqe.data_len;
+    }
+    //variable mode reads one record, fixed mode one record per block.
+    while (done < want) {
+        struct rec* r = NULL;
+        uint32_t len = 0;
+
+        if (pos >= nr_recs) {
+            gen_eod_sense(c, fixed ? count - done / FIXED_BLOCK : want - done);
+            break;
+        }
+        r = &recs[pos++];
+        if (NOT_MARK != r->type) {
+            gen_mark_sense(c, r->type, fixed ? count - done / FIXED_BLOCK : want - done);
+            break;
+        }
+        len = r->len < want - done ? r->len : want - done;
+        queue_read(c, c->data + done, len, r->offset + 4);
+        done += fixed ? FIXED_BLOCK : want;
+        c->cqe.data_len += len;
+    }
+}
+
+static void do_write(struct cmd* c)
+{
+    uint32_t len = cdb_count(c);
+    off_t offset = 0;
+
+    if (c->sqe.cdb[1] & 0x01) {
+        len *= FIXED_BLOCK;
+    }
+    if (len > c->sqe.data_len) {
+        len = c->sqe.data_len;
+    }
+    if (0 == len) {
+        return;
+    }
+    set_eod_here();
+    offset = eod_offset();
+    if (append_rec(offset, len, NOT_MARK) < 0) {
+        c->cqe.host_error = 1;
+        return;
+    }
+    pos++;
+
+    //header from here, payload straight from the data slot.
+    c->hdr = len;
+    c->iov[0].iov_base = &c->hdr;
+    c->iov[0].iov_len = 4;
+    c->iov[1].iov_base = c->data;
+    c->iov[1].iov_len = len;
+    queue_writev(c, offset);
+}
+
+static void do_write_filemark(struct cmd* c)
+{
+    uint32_t count = cdb_count(c);
+    uint8_t type = (c->sqe.cdb[1] & 0x02) ? SETMARK : FILEMARK;
+    char mark_rec[5];
+    int32_t one = 1;
+
+    memcpy(mark_rec, &one, 4);
+    mark_rec[4] = type;
+    if (count > 0) {
+        set_eod_here();
+    }
+    while (count > 0) {
+        off_t offset = eod_offset();
+        if (pwrite(img, mark_rec, sizeof(mark_rec), offset) != sizeof(mark_rec) ||
+            append_rec(offset, 1, type) < 0) {
+            c->cqe.host_error = 1;
+            return;
+        }
+        pos++;
+        count--;
+    }
+}
+
+static void do_space(struct cmd* c)
+{
+    uint32_t count = cdb_count(c);
+    int filemarks = c->sqe.cdb[1] & 0x07;
+
+    if (filemarks > 1) {
+        gen_sense(c, 0x05, 0x24, 0x00, 0);//invalid field in cdb
+        return;
+    }
+    while (count > 0) {
+        struct rec* r = NULL;
+
+        if (pos >= nr_recs) {
+            gen_eod_sense(c, count);
+            return;
+        }
+        r = &recs[pos++];
+        if (SETMARK == r->type || (!filemarks && FILEMARK == r->type)) {
+            gen_mark_sense(c, r->type, count);
+            return;
+        }
+        if (!filemarks || FILEMARK == r->type) {
+            count--;
+        }
+    }
+}
+
+static void do_erase(struct cmd* c)
+{
+    nr_recs = pos < nr_recs ? pos : nr_recs;
+    trunc_pending = 0;
+    if (ftruncate(img, eod_offset()) < 0) {
+        c->cqe.host_error = 1;
+    }
+}
+
+static void do_read_position(struct cmd* c)
+{
+    uint8_t buf[20];
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0 == pos ? 0x80 : 0x00;//BOP
+    buf[4] = buf[8] = pos >> 24;
+    buf[5] = buf[9] = pos >> 16;
+    buf[6] = buf[10] = pos >> 8;
+    buf[7] = buf[11] = pos;
+    reply(c, buf, sizeof(buf));
+}
+
+static void do_inquiry(struct cmd* c)
+{
+    uint8_t buf[36];
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x01;//tape
+    buf[1] = 0x80;//removable
+    buf[2] = 0x02;
+    buf[3] = 0x02;
+    buf[4] = sizeof(buf) - 5;
+    buf[7] = 0x10;//sync
+    memcpy(buf + 8, "virtual ", 8);
+    memcpy(buf + 16, "Scsitape  (c)vincent", 16);
+    memcpy(buf + 32, "0200", 4);
+    reply(c, buf, sizeof(buf));
+}
+
+/*
+  Run one command. READ and WRITE leave their transfers in io_uring and
+  complete from io_done(); the rest complete here.
+*/
+static void handle(struct cmd* c)
+{
+    static const uint8_t mode_sense[12] = {11, 0, 0, 8, 1, 0, 0, 0, 0, 0, 0, 0};
+    static const uint8_t block_limits[6] = {0, 0, 0x40, 0, 0, 1};
+    uint8_t op = c->sqe.cdb[0];
+
+    memset(&c->cqe, 0, sizeof(c->cqe));
+    c->data = area + c->sqe.data_off;
+    c->pending = 1;//held until the command is set up
+
+    //the write stream has ended, cut off what used to follow it.
+    if (trunc_pending && 0x0A != op && 0x10 != op) {
+        if (ftruncate(img, eod_offset()) < 0) {
+            perror("kvtaped: truncate");
+        }
+        trunc_pending = 0;
+    }
+
+    switch (op) {
+    case 0x00://test unit ready
+    case 0x15://mode select6
+        break;
+    case 0x01://rewind
+        pos = 0;
+        break;
+    case 0x05://read block limits
+        reply(c, block_limits, sizeof(block_limits));
+        break;
+    case 0x08://read
+        do_read(c);
+        break;
+    case 0x0A://write
+        do_write(c);
+        break;
+    case 0x10://write filemarks
+        do_write_filemark(c);
+        break;
+    case 0x11://space
+        do_space(c);
+        break;
+    case 0x12://inquiry
+        do_inquiry(c);
+        break;
+    case 0x19://erase
+        do_erase(c);
+        break;
+    case 0x1A://mode sense6
+        reply(c, mode_sense, sizeof(mode_sense));
+        break;
+    case 0x34://read position
+        do_read_position(c);
+        break;
+    default:
+        gen_sense(c, 0x05, 0x20, 0x00, 0);//invalid command operation code
+        break;
+    }
+    c->cqe.position = pos;
+
+    c->async = c->pending > 1;
+    if (c->async) {
+        inflight++;
+        async_op = op;
+    }
+    io_done(c->sqe.tag, 0);
+}
+
+/*
+  Take new commands off the ring. Stops at one that has to wait for the
+  transfers in flight. return 1 if the ring is empty.
+*/
+static int consume(void)
+{
+    while (hdr->sq_tail != __atomic_load_n(&hdr->sq_head, __ATOMIC_ACQUIRE)) {
+        struct kvtape_ring_sqe* sqe = (struct kvtape_ring_sqe*)(area + hdr->sq_off) +
+            hdr->sq_tail % hdr->nr_entries;
+        struct cmd* c = NULL;
+
+        if (sqe->tag >= KVTAPE_RING_ENTRIES) {
+            fprintf(stderr, "kvtaped: bad tag %u\n", sqe->tag);
+            exit(1);
+        }
+        if (inflight && sqe->cdb[0] != async_op) {
+            return 0;
+        }
+        c = &cmds[sqe->tag];
+        memcpy(&c->sqe, sqe, sizeof(*sqe));
+        __atomic_store_n(&hdr->sq_tail, hdr->sq_tail + 1, __ATOMIC_RELEASE);
+        handle(c);
+    }
+    return 1;
+}
+
+static int open_ring(const char* path)
+{
+    struct kvtape_ring_hdr* h = NULL;
+    uint32_t size = 0;
+
+    dev = open(path, O_RDWR);
+    if (dev < 0) {
+        return -1;
+    }
+    h = mmap(NULL, KVTAPE_RING_HDR_SIZE, PROT_READ, MAP_SHARED, dev, 0);
+    if (MAP_FAILED == h) {
+        return -1;
+    }
+    if (KVTAPE_RING_MAGIC != h->magic || KVTAPE_RING_VERSION != h->version ||
+        h->nr_entries > KVTAPE_RING_ENTRIES) {
+        fprintf(stderr, "kvtaped: %s is not a version %d ring\n", path, KVTAPE_RING_VERSION);
+        return -1;
+    }
+    size = h->area_size;
+    munmap(h, KVTAPE_RING_HDR_SIZE);
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev, 0);
+    if (MAP_FAILED == area) {
+        return -1;
+    }
+    hdr = (struct kvtape_ring_hdr*)area;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s /dev/kvtape_ringN image\n", argv[0]);
+        return 1;
+    }
+    if (open_ring(argv[1]) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    img = open(argv[2], O_RDWR | O_CREAT, 0644);
+    if (img < 0 || load_index() < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (uring_init(&ring, URING_ENTRIES) < 0) {
+        if (ENOSYS != errno) {
+            perror("io_uring_setup");
+            return 1;
+        }
+        //before 5.1: every transfer completes before the next command.
+        fprintf(stderr, "kvtaped: no io_uring, using pread/pwritev\n");
+        sync_io = 1;
+    }
+
+    while (sync_io) {
+        struct pollfd pfd = {dev, POLLIN, 0};
+
+        consume();
+        if (kick) {
+            kick = 0;
+            if (write(dev, "", 1) < 0) {
+                perror("kvtaped: doorbell");
+            }
+        }
+        if (poll(&pfd, 1, -1) < 0 && EINTR != errno) {
+            perror("kvtaped: poll");
+            return 1;
+        }
+    }
+
+    for (;;) {
+        struct io_uring_cqe* cqe = NULL;
+        int idle = consume();
+
+        //wake up for new commands only when they can be taken.
+        if (idle && !polling) {
+            struct io_uring_sqe* sqe = uring_sqe(&ring);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = dev;
+            sqe->poll_events = POLLIN;
+            sqe->user_data = POLL_TAG;
+            polling = 1;
+        }
+        if (kick) {
+            kick = 0;
+            if (write(dev, "", 1) < 0) {
+                perror("kvtaped: doorbell");
+            }
+        }
+        if (uring_submit(&ring, 1) < 0) {
+            perror("io_uring_enter");
+            return 1;
+        }
+        while (NULL != (cqe = uring_peek(&ring))) {
+            __u64 tag = cqe->user_data;
+            int res = cqe->res;
+
+            uring_seen(&ring);
+            io_done(tag, res);
+        }
+    }
+    return 0;
+}